@@ -0,0 +1,71 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Minimal Windows.h for building the translator on a Linux host
+ *
+ * Only what src/dbt/x86.c and the headers it includes need. The services
+ * x86.c uses directly (fork, signal delivery, statistics locks) do nothing:
+ * translatebench runs a single thread and never forks or delivers signals.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* The x86 intrinsic headers pull in the C library through mm_malloc.h, whose
+ * types collide with the ones in common/types.h */
+#define _MM_MALLOC_H_INCLUDED
+
+typedef int BOOL;
+typedef uint32_t DWORD;
+typedef void *HANDLE;
+typedef void *PVOID;
+
+typedef struct
+{
+	DWORD Eip;
+	DWORD Esp;
+} CONTEXT, *PCONTEXT;
+
+typedef struct
+{
+	PVOID Ptr;
+} SRWLOCK;
+
+#define MEM_COMMIT				0x00001000
+#define MEM_RESERVE				0x00002000
+#define MEM_RELEASE				0x00008000
+#define PAGE_READWRITE			0x04
+#define PAGE_EXECUTE_READWRITE	0x40
+
+static inline void InitializeSRWLock(SRWLOCK *lock) {}
+static inline void AcquireSRWLockShared(SRWLOCK *lock) {}
+static inline void ReleaseSRWLockShared(SRWLOCK *lock) {}
+static inline void AcquireSRWLockExclusive(SRWLOCK *lock) {}
+static inline void ReleaseSRWLockExclusive(SRWLOCK *lock) {}
+
+static inline DWORD GetLastError() { return errno; }
+static inline DWORD GetCurrentThreadId() { return 0; }
+
+static inline PVOID VirtualAllocEx(HANDLE process, PVOID addr, size_t size, DWORD type, DWORD protect) { return NULL; }
+static inline BOOL VirtualFreeEx(HANDLE process, PVOID addr, size_t size, DWORD type) { return 0; }
+static inline BOOL WriteProcessMemory(HANDLE process, PVOID addr, const void *buffer, size_t size, size_t *written) { return 0; }
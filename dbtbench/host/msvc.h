@@ -0,0 +1,30 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* MSVC keywords used by the flinux sources, for building them with gcc
+ * Included in every translation unit with -include msvc.h.
+ */
+
+#pragma once
+
+#define __forceinline			inline __attribute__((always_inline))
+#define __declspec(x)			__declspec_##x
+#define __declspec_thread		__thread
+#define __declspec_noreturn		__attribute__((noreturn))
+#define __declspec_align(n)		__attribute__((aligned(n)))
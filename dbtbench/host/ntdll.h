@@ -0,0 +1,36 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Minimal ntdll.h for building the translator on a Linux host, see Windows.h */
+
+#pragma once
+
+#include <Windows.h>
+
+typedef enum
+{
+	ThreadBasicInformation,
+} THREADINFOCLASS;
+
+typedef struct
+{
+	PVOID TebBaseAddress;
+} THREAD_BASIC_INFORMATION;
+
+static inline int NtQueryInformationThread(HANDLE thread, THREADINFOCLASS info_class, PVOID info, DWORD length, DWORD *return_length) { return -1; }
@@ -0,0 +1,58 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Helpers shared by the benchmark programs */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static inline uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Read counters from a "name: value" file of /proc/flinux, values[i] receives the counter called names[i]
+ * Counters missing from the file read as zero. Returns 0 if the file cannot be opened, which means the
+ * program is running natively.
+ */
+static inline int read_flinux_counters(const char *path, const char *const names[], unsigned long long values[], int count)
+{
+	memset(values, 0, count * sizeof(unsigned long long));
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return 0;
+	char line[256], name[64];
+	unsigned long long value;
+	while (fgets(line, sizeof(line), f))
+	{
+		if (sscanf(line, "%63[^:]: %llu", name, &value) != 2)
+			continue;
+		for (int i = 0; i < count; i++)
+			if (!strcmp(name, names[i]))
+				values[i] = value;
+	}
+	fclose(f);
+	return 1;
+}
@@ -0,0 +1,245 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* DBT microbenchmarks
+ *
+ *   gcc -m32 -O2 -o dbtbench dbtbench.c
+ *   ./dbtbench [iterations]
+ *
+ * Each kernel stresses one dispatch path of the translator:
+ *   callret   direct calls and returns (return cache)
+ *   indirect  indirect calls through a function pointer table (sieve)
+ *   switch    dense switch statement compiled to a jump table (sieve)
+ *   tls       __thread variable accesses (gs segment emulation)
+ *   syscall   cheap system calls (syscall entry and exit)
+ *   translate a large number of distinct basic blocks run once (translation)
+ *
+ * The cost of each kernel is reported in ns per dispatched branch, a native
+ * run gives the baseline. Under flinux the blocks and guest bytes the kernel
+ * made the translator translate are shown too, with the translation rate.
+ */
+
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define NOINLINE __attribute__((noinline))
+
+/* Translator counters of /proc/flinux/dbt/process */
+enum { BLOCKS_TRANSLATED, BYTES_TRANSLATED, TRANSLATE_CYCLES, COUNTER_COUNT };
+static const char *const counter_names[COUNTER_COUNT] = { "blocks_translated", "bytes_translated", "translate_cycles" };
+
+static double tsc_ns_per_cycle;
+
+static uint64_t rdtsc()
+{
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* Calibrate TSC against the monotonic clock, used to convert translate_cycles */
+static void calibrate_tsc()
+{
+	uint64_t start_ns = now_ns(), start_tsc = rdtsc();
+	while (now_ns() - start_ns < 100000000ULL)
+		;
+	uint64_t end_ns = now_ns(), end_tsc = rdtsc();
+	tsc_ns_per_cycle = (double)(end_ns - start_ns) / (double)(end_tsc - start_tsc);
+}
+
+static int read_counters(unsigned long long counters[COUNTER_COUNT])
+{
+	return read_flinux_counters("/proc/flinux/dbt/process", counter_names, counters, COUNTER_COUNT);
+}
+
+static volatile int sink;
+
+/* callret: 2 calls + 2 returns per iteration */
+static NOINLINE int leaf(int x)
+{
+	__asm__ __volatile__("");
+	return x + 1;
+}
+
+static NOINLINE int middle(int x)
+{
+	return leaf(x) ^ 3;
+}
+
+static uint64_t kernel_callret(int iterations)
+{
+	int x = 0;
+	for (int i = 0; i < iterations; i++)
+		x = middle(x);
+	sink = x;
+	return (uint64_t)iterations * 4;
+}
+
+/* indirect: 1 indirect call + 1 return per iteration, 8 distinct targets */
+#define TARGET(n) static NOINLINE int target##n(int x) { __asm__ __volatile__(""); return x + n; }
+TARGET(0) TARGET(1) TARGET(2) TARGET(3) TARGET(4) TARGET(5) TARGET(6) TARGET(7)
+static int (*volatile targets[8])(int) = {
+	target0, target1, target2, target3, target4, target5, target6, target7
+};
+
+static uint64_t kernel_indirect(int iterations)
+{
+	int x = 0;
+	for (int i = 0; i < iterations; i++)
+		x = targets[(i * 5) & 7](x);
+	sink = x;
+	return (uint64_t)iterations * 2;
+}
+
+/* switch: 1 indirect jump through the jump table per iteration */
+static NOINLINE uint64_t kernel_switch(int iterations)
+{
+	int x = 0;
+	uint32_t seed = 12345;
+	for (int i = 0; i < iterations; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		switch ((seed >> 16) & 15)
+		{
+		case 0: x += 3; break;
+		case 1: x ^= 5; break;
+		case 2: x -= 7; break;
+		case 3: x <<= 1; break;
+		case 4: x >>= 1; break;
+		case 5: x += i; break;
+		case 6: x ^= i; break;
+		case 7: x |= 9; break;
+		case 8: x &= 0xFFFF; break;
+		case 9: x += 11; break;
+		case 10: x ^= 13; break;
+		case 11: x -= i; break;
+		case 12: x = ~x; break;
+		case 13: x += 17; break;
+		case 14: x ^= 19; break;
+		case 15: x *= 3; break;
+		}
+	}
+	sink = x;
+	return (uint64_t)iterations;
+}
+
+/* tls: 1 loop branch per iteration, each accessing gs twice */
+static __thread volatile int tls_counter;
+
+static uint64_t kernel_tls(int iterations)
+{
+	for (int i = 0; i < iterations; i++)
+		tls_counter += i;
+	sink = tls_counter;
+	return (uint64_t)iterations;
+}
+
+/* syscall: one raw system call per iteration */
+static uint64_t kernel_syscall(int iterations)
+{
+	int x = 0;
+	for (int i = 0; i < iterations; i++)
+		x += syscall(SYS_getppid);
+	sink = x;
+	return (uint64_t)iterations;
+}
+
+/* translate: 4096 distinct basic blocks, each executed once per call */
+#define BLOCK(n) if (x & (1 << ((n) & 31))) x += (n); else x ^= (n);
+#define BLOCK4(n) BLOCK(n) BLOCK(n + 1) BLOCK(n + 2) BLOCK(n + 3)
+#define BLOCK16(n) BLOCK4(n) BLOCK4(n + 4) BLOCK4(n + 8) BLOCK4(n + 12)
+#define BLOCK64(n) BLOCK16(n) BLOCK16(n + 16) BLOCK16(n + 32) BLOCK16(n + 48)
+#define BLOCK256(n) BLOCK64(n) BLOCK64(n + 64) BLOCK64(n + 128) BLOCK64(n + 192)
+#define BLOCK1024(n) BLOCK256(n) BLOCK256(n + 256) BLOCK256(n + 512) BLOCK256(n + 768)
+
+static NOINLINE int many_blocks(int x)
+{
+	BLOCK1024(0) BLOCK1024(1024) BLOCK1024(2048) BLOCK1024(3072)
+	return x;
+}
+
+static uint64_t kernel_translate(int iterations)
+{
+	(void)iterations;
+	/* Runs once, so under flinux this is dominated by translation */
+	sink = many_blocks(sink);
+	return 4096;
+}
+
+struct kernel
+{
+	const char *name;
+	uint64_t (*run)(int iterations);
+	int iterations_shift;
+};
+
+static const struct kernel kernels[] = {
+	{ "callret", kernel_callret, 0 },
+	{ "indirect", kernel_indirect, 0 },
+	{ "switch", kernel_switch, 0 },
+	{ "tls", kernel_tls, 0 },
+	{ "syscall", kernel_syscall, 6 },
+	{ "translate", kernel_translate, 0 },
+};
+
+int main(int argc, char *argv[])
+{
+	int iterations = 10000000;
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	calibrate_tsc();
+
+	unsigned long long before[COUNTER_COUNT], after[COUNTER_COUNT];
+	int flinux = read_counters(before);
+	printf("dbtbench: %d iterations, %s\n", iterations, flinux ? "running under flinux" : "running natively");
+	printf("%-10s %12s %12s %12s %14s %14s\n", "kernel", "ns/branch", "blocks", "bytes", "blocks/sec", "bytes/sec");
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+	{
+		const struct kernel *k = &kernels[i];
+		read_counters(before);
+		uint64_t start = now_ns();
+		uint64_t branches = k->run(iterations >> k->iterations_shift);
+		uint64_t elapsed = now_ns() - start;
+		read_counters(after);
+
+		printf("%-10s %12.2f", k->name, (double)elapsed / (double)branches);
+		if (flinux)
+		{
+			unsigned long long blocks = after[BLOCKS_TRANSLATED] - before[BLOCKS_TRANSLATED];
+			unsigned long long bytes = after[BYTES_TRANSLATED] - before[BYTES_TRANSLATED];
+			double seconds = (after[TRANSLATE_CYCLES] - before[TRANSLATE_CYCLES]) * tsc_ns_per_cycle / 1e9;
+			printf(" %12llu %12llu", blocks, bytes);
+			if (seconds > 0)
+				printf(" %14.0f %14.0f\n", blocks / seconds, bytes / seconds);
+			else
+				printf(" %14s %14s\n", "-", "-");
+		}
+		else
+			printf(" %12s %12s %14s %14s\n", "-", "-", "-", "-");
+	}
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Fork and copy on write benchmark
+ *
+ *   gcc -m32 -O2 -o forkbench forkbench.c
+ *   ./forkbench [-m megabytes] [-n forks]
+ *
+ * A heap region is populated, then the process forks repeatedly. The child
+ * writes to part of the region and exits, while the parent waits for it and
+ * writes to the same part. Each pattern models a different workload:
+ *   none      no writes, fork and exit only
+ *   sparse    one word per 64kB block (a shell touching its stack and data)
+ *   page      one word per 4kB page
+ *   all       the whole region
+ *
+ * A round of fork, child writes and parent writes is timed per pattern.
+ * Under flinux the parent's copy on write faults, the pages it copied one by
+ * one and the 64kB blocks it duplicated whole are shown per round, which
+ * tells whether copying works at page or at block granularity.
+ */
+
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* Copy on write counters of /proc/flinux/mm/stats, children start with zeroed counters */
+enum { COW_FAULTS, COW_PAGES, DUPLICATED_BLOCKS, COUNTER_COUNT };
+static const char *const counter_names[COUNTER_COUNT] = { "cow_faults", "cow_pages", "duplicated_blocks" };
+
+static int read_counters(unsigned long long counters[COUNTER_COUNT])
+{
+	return read_flinux_counters("/proc/flinux/mm/stats", counter_names, counters, COUNTER_COUNT);
+}
+
+static void touch(volatile char *region, size_t size, size_t stride, int value)
+{
+	if (!stride)
+		return;
+	for (size_t i = 0; i < size; i += stride)
+		region[i] = (char)value;
+}
+
+static void bench(const char *name, char *region, size_t size, size_t stride, int forks)
+{
+	unsigned long long before[COUNTER_COUNT], after[COUNTER_COUNT];
+	int flinux = read_counters(before);
+	uint64_t start = now_ns();
+	for (int i = 0; i < forks; i++)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			touch(region, size, stride, i);
+			_exit(0);
+		}
+		if (pid < 0)
+		{
+			perror("fork");
+			exit(1);
+		}
+		waitpid(pid, NULL, 0);
+		touch(region, size, stride, i);
+	}
+	double us = (now_ns() - start) / 1e3 / forks;
+	read_counters(after);
+	printf("%-8s %10.1f us/fork", name, us);
+	if (flinux)
+		printf("  %8.1f cow faults  %8.1f pages copied  %8.1f blocks copied",
+			(double)(after[COW_FAULTS] - before[COW_FAULTS]) / forks,
+			(double)(after[COW_PAGES] - before[COW_PAGES]) / forks,
+			(double)(after[DUPLICATED_BLOCKS] - before[DUPLICATED_BLOCKS]) / forks);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	size_t megabytes = 16;
+	int forks = 100;
+	int opt;
+	while ((opt = getopt(argc, argv, "m:n:")) != -1)
+	{
+		if (opt == 'm')
+			megabytes = atoi(optarg);
+		else if (opt == 'n')
+			forks = atoi(optarg);
+		else
+		{
+			fprintf(stderr, "usage: %s [-m megabytes] [-n forks]\n", argv[0]);
+			return 1;
+		}
+	}
+	size_t size = megabytes << 20;
+	char *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+	memset(region, 1, size);
+	printf("%zu MB region, %d forks per pattern\n", megabytes, forks);
+	bench("none", region, size, 0, forks);
+	bench("sparse", region, size, 65536, forks);
+	bench("page", region, size, 4096, forks);
+	bench("all", region, size, 64, forks);
+	return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Kernel heap contention benchmark
+ *
+ *   gcc -m32 -O2 -pthread -o heapbench heapbench.c
+ *   ./heapbench [-t max_threads] [-n operations]
+ *
+ * Every file object of flinux is allocated from the kernel heap. Each worker
+ * thread repeatedly creates and closes objects, so the kernel allocates and
+ * frees heap memory on every operation. The run is repeated with 1, 2, 4, ...
+ * threads up to max_threads. Each workload stresses a different object:
+ *   eventfd   one object per operation
+ *   pipe      two objects per operation
+ *   burst     16 eventfds created before they are closed, larger than a
+ *             batch of the per-thread caches
+ *
+ * The output lists total operations per second and the latency one thread
+ * sees for each workload and thread count. A heap free of contention scales
+ * the throughput with the thread count and keeps the latency flat.
+ */
+
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define BURST_SIZE	16
+
+static int operations = 20000;
+static pthread_barrier_t barrier;
+
+static void *eventfd_worker(void *arg)
+{
+	(void)arg;
+	pthread_barrier_wait(&barrier);
+	for (int i = 0; i < operations; i++)
+	{
+		int fd = eventfd(0, 0);
+		if (fd < 0)
+		{
+			perror("eventfd");
+			exit(1);
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static void *pipe_worker(void *arg)
+{
+	(void)arg;
+	pthread_barrier_wait(&barrier);
+	for (int i = 0; i < operations; i++)
+	{
+		int fds[2];
+		if (pipe(fds) < 0)
+		{
+			perror("pipe");
+			exit(1);
+		}
+		close(fds[0]);
+		close(fds[1]);
+	}
+	return NULL;
+}
+
+static void *burst_worker(void *arg)
+{
+	(void)arg;
+	pthread_barrier_wait(&barrier);
+	for (int i = 0; i < operations; i += BURST_SIZE)
+	{
+		int fds[BURST_SIZE];
+		for (int j = 0; j < BURST_SIZE; j++)
+		{
+			fds[j] = eventfd(0, 0);
+			if (fds[j] < 0)
+			{
+				perror("eventfd");
+				exit(1);
+			}
+		}
+		for (int j = 0; j < BURST_SIZE; j++)
+			close(fds[j]);
+	}
+	return NULL;
+}
+
+static void bench(const char *name, void *(*worker)(void *), int threads)
+{
+	pthread_t tid[threads];
+	pthread_barrier_init(&barrier, NULL, threads + 1);
+	for (int i = 0; i < threads; i++)
+	{
+		if (pthread_create(&tid[i], NULL, worker, NULL))
+		{
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+	}
+	uint64_t start = now_ns();
+	pthread_barrier_wait(&barrier);
+	for (int i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+	double seconds = (now_ns() - start) / 1e9;
+	pthread_barrier_destroy(&barrier);
+	double total = (double)operations * threads;
+	printf("%-8s %3d threads %12.0f ops/s %10.2f us/op per thread\n",
+		name, threads, total / seconds, seconds * 1e6 / operations);
+}
+
+int main(int argc, char *argv[])
+{
+	int max_threads = 8;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:n:")) != -1)
+	{
+		if (opt == 't')
+			max_threads = atoi(optarg);
+		else if (opt == 'n')
+			operations = atoi(optarg);
+		else
+		{
+			fprintf(stderr, "usage: %s [-t max_threads] [-n operations]\n", argv[0]);
+			return 1;
+		}
+	}
+	printf("%d operations per thread\n", operations);
+	for (int threads = 1; threads <= max_threads; threads *= 2)
+		bench("eventfd", eventfd_worker, threads);
+	for (int threads = 1; threads <= max_threads; threads *= 2)
+		bench("pipe", pipe_worker, threads);
+	for (int threads = 1; threads <= max_threads; threads *= 2)
+		bench("burst", burst_worker, threads);
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Command substitution benchmark
+ *
+ *   gcc -m32 -O2 -o substbench substbench.c
+ *   ./substbench [-n iterations] [-s shell]
+ *
+ * Measures the cost of fork-heavy shell code such as $(true), where every
+ * child runs code its parent already executed many times:
+ *   shell     a shell loop of x=$(true), run by the given shell
+ *   subst     the same pattern in this process: the child of each fork runs
+ *             a workload the parent has warmed up and writes its result
+ *             to a pipe, the parent reads it to the end and waits
+ *
+ * Both tests print the time per iteration. Under flinux every subst child
+ * sends back how many basic blocks it found in the code cache inherited from
+ * its parent and how many it had to translate itself, so the output shows
+ * whether forked children reuse the parent's translations.
+ */
+
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Code cache counters of /proc/flinux/dbt/process */
+enum { BLOCKS_INHERITED, BLOCKS_TRANSLATED, COUNTER_COUNT };
+static const char *const counter_names[COUNTER_COUNT] = { "blocks_inherited", "blocks_translated" };
+
+/* What a subst child sends back to its parent */
+struct child_report
+{
+	long result;
+	int flinux;
+	unsigned long long counters[COUNTER_COUNT];
+};
+
+static int read_counters(unsigned long long counters[COUNTER_COUNT])
+{
+	return read_flinux_counters("/proc/flinux/dbt/process", counter_names, counters, COUNTER_COUNT);
+}
+
+static int compare(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/* A little bit of everything a shell does: formatting, parsing and sorting strings */
+static long work()
+{
+	char buf[32][16];
+	char *strs[32];
+	for (int i = 0; i < 32; i++)
+	{
+		snprintf(buf[i], sizeof(buf[i]), "%d", (i * 7919) % 1000);
+		strs[i] = buf[i];
+	}
+	qsort(strs, 32, sizeof(char *), compare);
+	long sum = 0;
+	for (int i = 0; i < 32; i++)
+		sum = sum * 31 + strtol(strs[i], NULL, 10);
+	return sum;
+}
+
+static void bench_shell(const char *shell, int iterations)
+{
+	char script[128];
+	snprintf(script, sizeof(script), "i=0; while [ $i -lt %d ]; do x=$(true); i=$((i+1)); done", iterations);
+	uint64_t start = now_ns();
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		execl(shell, shell, "-c", script, (char *)NULL);
+		perror("execl");
+		_exit(1);
+	}
+	if (pid < 0)
+	{
+		perror("fork");
+		exit(1);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+	{
+		fprintf(stderr, "%s failed\n", shell);
+		return;
+	}
+	printf("%-8s %10.1f us/iteration\n", "shell", (now_ns() - start) / 1e3 / iterations);
+}
+
+static void bench_subst(int iterations)
+{
+	/* Warm up the parent */
+	long expected = 0;
+	for (int i = 0; i < 100; i++)
+		expected = work();
+	struct child_report report;
+	int flinux = read_counters(report.counters);
+	unsigned long long inherited = 0, translated = 0;
+	uint64_t start = now_ns();
+	for (int i = 0; i < iterations; i++)
+	{
+		int fds[2];
+		if (pipe(fds) < 0)
+		{
+			perror("pipe");
+			exit(1);
+		}
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			close(fds[0]);
+			report.result = work();
+			report.flinux = read_counters(report.counters);
+			if (write(fds[1], &report, sizeof(report)) < 0)
+				_exit(1);
+			_exit(0);
+		}
+		if (pid < 0)
+		{
+			perror("fork");
+			exit(1);
+		}
+		close(fds[1]);
+		if (read(fds[0], &report, sizeof(report)) != sizeof(report) || report.result != expected)
+		{
+			fprintf(stderr, "child failed\n");
+			exit(1);
+		}
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+		flinux = flinux && report.flinux;
+		inherited += report.counters[BLOCKS_INHERITED];
+		translated += report.counters[BLOCKS_TRANSLATED];
+	}
+	printf("%-8s %10.1f us/iteration", "subst", (now_ns() - start) / 1e3 / iterations);
+	if (flinux)
+		printf("  %8.1f blocks inherited  %8.1f blocks translated",
+			(double)inherited / iterations, (double)translated / iterations);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = 200;
+	const char *shell = "/bin/sh";
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:")) != -1)
+	{
+		if (opt == 'n')
+			iterations = atoi(optarg);
+		else if (opt == 's')
+			shell = optarg;
+		else
+		{
+			fprintf(stderr, "usage: %s [-n iterations] [-s shell]\n", argv[0]);
+			return 1;
+		}
+	}
+	printf("%d iterations\n", iterations);
+	bench_shell(shell, iterations);
+	bench_subst(iterations);
+	return 0;
+}
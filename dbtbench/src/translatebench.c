@@ -0,0 +1,314 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Translator benchmark, hosted on Linux
+ *
+ * Compiles the translator itself (src/dbt/x86.c and x86_decoder.c) for an
+ * x86-64 Linux host and times dbt_translate() directly, no Windows box needed:
+ *
+ *   gcc -O2 -std=gnu11 -no-pie -mxsave -I../host -I../../src -include msvc.h \
+ *       -o translatebench translatebench.c ../../src/dbt/x86.c \
+ *       ../../src/dbt/x86_decoder.c ../../src/lib/rbtree.c
+ *   ./translatebench [-r rounds] [-n blocks]
+ *
+ * The host services of dbt/x86_platform.h are implemented here. ../host holds
+ * the MSVC keywords (msvc.h) and minimal Windows.h, ntdll.h, intrin.h and
+ * log.h for the parts of x86.c not yet behind that header. All translator
+ * memory and the synthetic guest code are allocated below 2GB and the program
+ * is not position independent, so the 32-bit addresses written into generated
+ * code stay exact. Expect pointer cast warnings from x86.c on this host.
+ *
+ * Each kernel is a run of synthetic 32-bit guest basic blocks ending in one
+ * kind of control transfer:
+ *   callret   call rel32 to a function block ending in ret (return cache)
+ *   indirect  call through a function pointer table (sieve)
+ *   switch    jmp through a jump table (sieve)
+ *   tls       gs relative loads and stores (gs segment emulation)
+ *   syscall   int 0x80 (syscall entry)
+ * For every kernel the code cache is reset, then each block is translated
+ * through dbt_find_next(), the path taken when a branch misses the code
+ * cache. The output is translated blocks and guest bytes per second, then
+ * the cost of finding an already translated block again (lookup).
+ *
+ * The generated code is 32-bit and is never run here, so the cost of a
+ * dispatched branch in translated code is measured by dbtbench.c running
+ * under flinux instead.
+ */
+
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <x86intrin.h>
+
+/* Translator interface, src/dbt/x86.h needs the Windows headers */
+void dbt_init();
+void dbt_reset();
+void dbt_find_next(size_t pc);
+
+/* dbt/x86_platform.h services */
+#define TLS_SIZE			256
+#define TLS_USER_OFFSET		128 /* User TLS entries follow the kernel ones */
+static __thread uint8_t tls_area[TLS_SIZE];
+
+static void *map_low(size_t size, int prot)
+{
+	void *addr = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_32BIT, -1, 0);
+	return addr == MAP_FAILED? NULL: addr;
+}
+
+void *dbt_platform_reserve(size_t size, bool executable)
+{
+	return map_low(size, PROT_NONE);
+}
+
+bool dbt_platform_commit(void *addr, size_t size, bool executable)
+{
+	return mprotect(addr, size, PROT_READ | PROT_WRITE | (executable? PROT_EXEC: 0)) == 0;
+}
+
+void *dbt_platform_alloc(size_t size, bool executable)
+{
+	return map_low(size, PROT_READ | PROT_WRITE | (executable? PROT_EXEC: 0));
+}
+
+uint32_t dbt_platform_read_tls(int offset)
+{
+	uint32_t value;
+	memcpy(&value, tls_area + offset, sizeof(value));
+	return value;
+}
+
+void dbt_platform_write_tls(int offset, uint32_t value)
+{
+	memcpy(tls_area + offset, &value, sizeof(value));
+}
+
+uint64_t dbt_platform_timestamp()
+{
+	return __rdtsc();
+}
+
+/* flinux services x86.c links against */
+int logger_attached = 0;
+void log_raw_internal(const char *format, ...) {}
+void log_debug_internal(const char *format, ...) {}
+void log_info_internal(const char *format, ...) {}
+void log_warning_internal(const char *format, ...) {}
+void log_error_internal(const char *format, ...) {}
+
+int ksprintf(char *buffer, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int r = vsprintf(buffer, format, args);
+	va_end(args);
+	return r;
+}
+
+int tls_kernel_entry_to_offset(int entry)
+{
+	return entry * sizeof(uint32_t);
+}
+
+int tls_user_entry_to_offset(int entry)
+{
+	return TLS_USER_OFFSET + entry * sizeof(uint32_t);
+}
+
+uint32_t dbt_xsave_mask, dbt_xsave_size, dbt_mxcsr_mask;
+void dbt_cpuid_init() {}
+void signal_setup_handler(void *context) {}
+
+/* Assembly entry points, generated code jumps to them but is never run */
+void dbt_find_direct_internal() { abort(); }
+void dbt_find_indirect_internal() { abort(); }
+void dbt_sieve_fallback() { abort(); }
+void dbt_return_fallback() { abort(); }
+void dbt_save_simd_state() { abort(); }
+void dbt_restore_simd_state() { abort(); }
+void dbt_cpuid_internal() { abort(); }
+void syscall_handler() { abort(); }
+
+/* Synthetic guest code */
+enum { KERNEL_CALLRET, KERNEL_INDIRECT, KERNEL_SWITCH, KERNEL_TLS, KERNEL_SYSCALL, KERNEL_COUNT };
+static const char *const kernel_names[KERNEL_COUNT] = { "callret", "indirect", "switch", "tls", "syscall" };
+
+#define GUEST_SIZE			0x01000000
+#define GUEST_TABLE			0x1000 /* Fake jump table address, never read */
+
+static uint8_t *guest;
+
+static void emit(uint8_t **out, const uint8_t *bytes, size_t count)
+{
+	memcpy(*out, bytes, count);
+	*out += count;
+}
+
+static void emit_rel32(uint8_t **out, uint8_t opcode, const uint8_t *dest)
+{
+	*(*out)++ = opcode;
+	int32_t rel = (int32_t)(dest - (*out + 4));
+	emit(out, (const uint8_t *)&rel, 4);
+}
+
+/* Typical straight line code at the start of every block */
+static void emit_body(uint8_t **out)
+{
+	static const uint8_t body[] = {
+		0x05, 0x78, 0x56, 0x34, 0x12, /* add eax, 0x12345678 */
+		0x8B, 0x4B, 0x08, /* mov ecx, [ebx+8] */
+		0x8D, 0x54, 0x88, 0x10, /* lea edx, [eax+ecx*4+16] */
+		0x31, 0xFE, /* xor esi, edi */
+	};
+	emit(out, body, sizeof(body));
+}
+
+/* Generate blocks of a kernel, every block ends with an instruction which ends translation
+ * Returns the number of guest bytes, starts[] receives the block addresses.
+ */
+static size_t gen_kernel(int kernel, int blocks, size_t starts[])
+{
+	uint8_t *out = guest;
+	for (int i = 0; i < blocks; i++)
+	{
+		starts[i] = (size_t)out;
+		emit_body(&out);
+		switch (kernel)
+		{
+		case KERNEL_CALLRET:
+			if (i % 2 == 0)
+			{
+				/* Caller: call the next block, then jump past it */
+				uint8_t *call = out;
+				emit_rel32(&out, 0xE8, call + 10);
+				emit_rel32(&out, 0xE9, call + 10);
+			}
+			else
+				*out++ = 0xC3; /* ret */
+			break;
+
+		case KERNEL_INDIRECT:
+		{
+			/* call [eax*4+table]; jmp next */
+			static const uint8_t call[] = { 0xFF, 0x14, 0x85, GUEST_TABLE & 0xFF, GUEST_TABLE >> 8, 0, 0 };
+			emit(&out, call, sizeof(call));
+			emit_rel32(&out, 0xE9, out + 5);
+			break;
+		}
+
+		case KERNEL_SWITCH:
+		{
+			/* jmp [eax*4+table] */
+			static const uint8_t jmp[] = { 0xFF, 0x24, 0x85, GUEST_TABLE & 0xFF, GUEST_TABLE >> 8, 0, 0 };
+			emit(&out, jmp, sizeof(jmp));
+			break;
+		}
+
+		case KERNEL_TLS:
+		{
+			static const uint8_t tls[] = {
+				0x65, 0xA1, 0x10, 0, 0, 0, /* mov eax, gs:[0x10] */
+				0x65, 0x8B, 0x48, 0x04, /* mov ecx, gs:[eax+4] */
+				0x65, 0x89, 0x0D, 0x14, 0, 0, 0, /* mov gs:[0x14], ecx */
+			};
+			emit(&out, tls, sizeof(tls));
+			emit_rel32(&out, 0xE9, out + 5);
+			break;
+		}
+
+		case KERNEL_SYSCALL:
+		{
+			static const uint8_t syscall[] = {
+				0xB8, 0x14, 0, 0, 0, /* mov eax, 20 (getpid) */
+				0xCD, 0x80, /* int 0x80 */
+			};
+			emit(&out, syscall, sizeof(syscall));
+			break;
+		}
+		}
+	}
+	return out - guest;
+}
+
+static void bench_kernel(int kernel, int blocks, int rounds, size_t starts[])
+{
+	size_t bytes = gen_kernel(kernel, blocks, starts);
+	uint64_t translate_ns = UINT64_MAX, lookup_ns = UINT64_MAX;
+	for (int r = 0; r < rounds; r++)
+	{
+		dbt_reset();
+		uint64_t start = now_ns();
+		for (int i = 0; i < blocks; i++)
+			dbt_find_next(starts[i]);
+		uint64_t mid = now_ns();
+		for (int i = 0; i < blocks; i++)
+			dbt_find_next(starts[i]);
+		uint64_t end = now_ns();
+		if (mid - start < translate_ns)
+			translate_ns = mid - start;
+		if (end - mid < lookup_ns)
+			lookup_ns = end - mid;
+	}
+	printf("%-9s %8.1f ns/block %7.2f M blocks/s %7.1f MB/s   lookup %6.1f ns\n",
+		kernel_names[kernel], (double)translate_ns / blocks, blocks * 1e3 / translate_ns,
+		bytes * 1e3 / translate_ns, (double)lookup_ns / blocks);
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = 20, blocks = 4096;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:n:")) != -1)
+	{
+		if (opt == 'r')
+			rounds = atoi(optarg);
+		else if (opt == 'n')
+			blocks = atoi(optarg);
+		else
+		{
+			fprintf(stderr, "usage: %s [-r rounds] [-n blocks]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (rounds <= 0 || blocks <= 0 || blocks > GUEST_SIZE / 64)
+	{
+		fprintf(stderr, "invalid rounds or blocks\n");
+		return 1;
+	}
+	if (!(guest = map_low(GUEST_SIZE, PROT_READ | PROT_WRITE)))
+	{
+		perror("mmap");
+		return 1;
+	}
+	size_t *starts = malloc(blocks * sizeof(size_t));
+	dbt_init();
+	printf("%d blocks, best of %d rounds\n", blocks, rounds);
+	for (int kernel = 0; kernel < KERNEL_COUNT; kernel++)
+		bench_kernel(kernel, blocks, rounds, starts);
+	return 0;
+}
@@ -26,6 +26,10 @@
 
 #define MAP_FAILED		((void *)-1)
 
+/* Flags for mremap. */
+#define MREMAP_MAYMOVE	1
+#define MREMAP_FIXED	2
+
 /* Flags for msync. */
 #define MS_ASYNC		1	 /* sync memory synchronously */
 #define MS_INVALIDATE	2	 /* invalidate the caches */
@@ -37,6 +41,7 @@
 #define MADV_SEQUENTIAL		2		/* expect sequential page references */
 #define MADV_WILLNEED		3		/* will need these pages */
 #define MADV_DONTNEED		4		/* don't need these pages */
+#define MADV_FREE			8		/* free pages only if memory pressure */
 #define MADV_REMOVE			9		/* remove these pages & resources */
 #define MADV_DONTFORK		10		/* don't inherit across fork */
 #define MADV_DOFORK			11		/* do inherit across fork */
@@ -49,3 +54,7 @@
 
 #define MADV_HWPOISON		100		/* poison a page for testing */
 #define MADV_SOFT_OFFLINE	101		/* soft offline page for testing */
+
+/* Flags for memfd_create. */
+#define MFD_CLOEXEC			0x0001U
+#define MFD_ALLOW_SEALING	0x0002U
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <common/types.h>
+
+typedef int key_t;
+
+/* Resource get request flags */
+#define IPC_CREAT		00001000	/* create if key is nonexistent */
+#define IPC_EXCL		00002000	/* fail if key exists */
+#define IPC_NOWAIT		00004000	/* return error on wait */
+
+#define IPC_PRIVATE		((key_t)0)
+
+/* Control commands used with semctl, msgctl and shmctl */
+#define IPC_RMID		0	/* remove resource */
+#define IPC_SET			1	/* set ipc_perm options */
+#define IPC_STAT		2	/* get ipc_perm options */
+#define IPC_INFO		3	/* see ipcs */
+
+/* Version flag of control commands, for the 64-bit structures */
+#define IPC_64			0x0100
+
+/* Commands of the ipc() multiplexer syscall */
+#define SHMAT			21
+#define SHMDT			22
+#define SHMGET			23
+#define SHMCTL			24
+
+/* shmat() flags */
+#define SHM_RDONLY		010000	/* read-only access */
+#define SHM_RND			020000	/* round attach address to SHMLBA boundary */
+#define SHM_REMAP		040000	/* take-over region on attach */
+#define SHM_EXEC		0100000	/* execution access */
+
+/* shmctl() commands */
+#define SHM_LOCK		11
+#define SHM_UNLOCK		12
+#define SHM_STAT		13
+#define SHM_INFO		14
+
+#define SHMLBA			4096
+
+struct ipc64_perm
+{
+	key_t key;
+	uid_t uid;
+	gid_t gid;
+	uid_t cuid;
+	gid_t cgid;
+	unsigned int mode; /* Including padding */
+	unsigned short seq;
+	unsigned short __pad2;
+	uintptr_t __unused1;
+	uintptr_t __unused2;
+};
+
+struct shmid64_ds
+{
+	struct ipc64_perm shm_perm; /* operation perms */
+	size_t shm_segsz; /* size of segment (bytes) */
+#ifdef _WIN64
+	intptr_t shm_atime; /* last attach time */
+	intptr_t shm_dtime; /* last detach time */
+	intptr_t shm_ctime; /* last change time */
+#else
+	uintptr_t shm_atime; /* last attach time */
+	uintptr_t shm_atime_high;
+	uintptr_t shm_dtime; /* last detach time */
+	uintptr_t shm_dtime_high;
+	uintptr_t shm_ctime; /* last change time */
+	uintptr_t shm_ctime_high;
+#endif
+	pid_t shm_cpid; /* pid of creator */
+	pid_t shm_lpid; /* pid of last operator */
+	uintptr_t shm_nattch; /* no. of current attaches */
+	uintptr_t __unused4;
+	uintptr_t __unused5;
+};
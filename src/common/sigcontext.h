@@ -62,6 +62,12 @@ struct fpx_sw_bytes
 	uint32_t padding[7]; /* for future use. */
 };
 
+#define FP_XSTATE_MAGIC1		0x46505853U
+#define FP_XSTATE_MAGIC2		0x46505845U
+#define FP_XSTATE_MAGIC2_SIZE	sizeof(uint32_t)
+
+#define X86_FXSR_MAGIC			0x0000 /* struct fpstate magic: FXSR data present */
+
 struct fpreg
 {
 	uint16_t significand[4];
@@ -154,6 +160,8 @@ struct sigcontext
 	uint32_t cr2;
 };
 
+#define UC_FP_XSTATE	0x1 /* uc_mcontext.fpstate contains extended state */
+
 struct ucontext
 {
 	uint32_t uc_flags;
@@ -20,6 +20,7 @@
 #include <dbt/cpuid.h>
 #include <str.h>
 
+#include <immintrin.h>
 #include <intrin.h>
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
@@ -183,7 +184,7 @@ static struct cpuinfo_feature cpuinfo_features_00000001_ecx[] =
 	{ FEATURE_TSC_DEADLINE, "tsc_deadline_timer" },
 	{ FEATURE_AES, "aes" },
 	{ FEATURE_XSAVE, "xsave" },
-	//{ FEATURE_OSXSAVE, "osxsave" },
+	{ FEATURE_OSXSAVE, "osxsave" },
 	{ FEATURE_AVX, "avx" },
 	{ FEATURE_F16C, "f16c" },
 	{ FEATURE_RDRAND, "rdrand" },
@@ -286,6 +287,49 @@ static struct cpuinfo_feature cpuinfo_features_7_0_ebx[] =
 	{ FEATURE_AVX512CD, "avx512cd" },
 };
 
+/* XSAVE state components */
+#define XSTATE_X87				BIT(0)
+#define XSTATE_SSE				BIT(1)
+#define XSTATE_AVX				BIT(2)
+
+uint32_t dbt_xsave_mask;
+uint32_t dbt_xsave_size;
+uint32_t dbt_mxcsr_mask;
+
+/* CPUID virtualization policy
+ * Extended (AVX) register state is only exposed to the application when the host
+ * OS has enabled it in XCR0. In that case all processor state saves done on
+ * behalf of the application (signal frames, translator) use XSAVE with
+ * dbt_xsave_mask, otherwise FXSAVE is used and AVX related features are hidden.
+ * Leaf 0xD is passed through unchanged, XGETBV and XSAVE executed by the
+ * application run natively and must agree with the host.
+ */
+void dbt_cpuid_init()
+{
+	int cpuinfo[4];
+	/* A zero mxcsr_mask in the FXSAVE image means the default mask */
+	__declspec(align(16)) uint8_t fxsave_area[512] = { 0 };
+	_fxsave(fxsave_area);
+	dbt_mxcsr_mask = *(uint32_t *)(fxsave_area + 28);
+	if (!dbt_mxcsr_mask)
+		dbt_mxcsr_mask = 0x0000FFBF;
+	dbt_xsave_mask = 0;
+	dbt_xsave_size = 512;
+	__cpuid(cpuinfo, 0);
+	if (cpuinfo[0] < 0x0D)
+		return;
+	__cpuid(cpuinfo, 1);
+	if (!(cpuinfo[2] & FEATURE_XSAVE) || !(cpuinfo[2] & FEATURE_OSXSAVE) || !(cpuinfo[2] & FEATURE_AVX))
+		return;
+	uint64_t xcr0 = _xgetbv(0);
+	if ((xcr0 & (XSTATE_X87 | XSTATE_SSE | XSTATE_AVX)) != (XSTATE_X87 | XSTATE_SSE | XSTATE_AVX))
+		return;
+	/* Size of XSAVE area for x87, SSE and AVX: offset + size of AVX component */
+	__cpuidex(cpuinfo, 0x0D, 2);
+	dbt_xsave_mask = XSTATE_X87 | XSTATE_SSE | XSTATE_AVX;
+	dbt_xsave_size = cpuinfo[1] + cpuinfo[0];
+}
+
 void dbt_cpuid(int eax, int ecx, struct cpuid_t *cpuid)
 {
 	int cpuinfo[4];
@@ -297,6 +341,7 @@ void dbt_cpuid(int eax, int ecx, struct cpuid_t *cpuid)
 	/* Mangle cpu feature bits, omit unsupported features  */
 	if (eax == 0x01)
 	{
+		uint32_t cpuid_host_ecx = cpuid->ecx;
 		/* Feature information */
 		cpuid->edx &= (0
 			| FEATURE_FPU
@@ -362,6 +407,8 @@ void dbt_cpuid(int eax, int ecx, struct cpuid_t *cpuid)
 			//| FEATURE_RDRAND
 			| FEATURE_HYPERVISOR
 			);
+		if (dbt_xsave_mask & XSTATE_AVX)
+			cpuid->ecx |= cpuid_host_ecx & (FEATURE_XSAVE | FEATURE_OSXSAVE | FEATURE_AVX | FEATURE_FMA | FEATURE_F16C);
 	}
 	else if (eax == 0x80000001)
 	{
@@ -410,6 +457,7 @@ void dbt_cpuid(int eax, int ecx, struct cpuid_t *cpuid)
 		/* Structured extended feature flags */
 		if (ecx == 0x00)
 		{
+			uint32_t cpuid_host_ebx = cpuid->ebx;
 			cpuid->eax = 0;
 			cpuid->ebx &= (0
 				//| FEATURE_FSGSBASE
@@ -432,6 +480,8 @@ void dbt_cpuid(int eax, int ecx, struct cpuid_t *cpuid)
 				//| FEATURE_AVX512ER
 				//| FEATURE_AVX512CD
 				);
+			if (dbt_xsave_mask & XSTATE_AVX)
+				cpuid->ebx |= cpuid_host_ebx & (FEATURE_AVX2 | FEATURE_BMI1 | FEATURE_BMI2);
 			cpuid->ecx = 0;
 			cpuid->edx = 0;
 		}
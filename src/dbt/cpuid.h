@@ -30,6 +30,15 @@ struct cpuid_t
 	uint32_t edx;
 };
 
+/* Processor extended state saved on behalf of the application
+ * dbt_xsave_mask is zero if XSAVE is not used, FXSAVE should be used instead */
+extern uint32_t dbt_xsave_mask;
+extern uint32_t dbt_xsave_size;
+/* Supported MXCSR bits, restoring an MXCSR value with other bits set faults */
+extern uint32_t dbt_mxcsr_mask;
+
+void dbt_cpuid_init();
+
 /* Singature used in dbt trampoline */
 void dbt_cpuid(int eax, int ecx, struct cpuid_t *cpuid);
 int dbt_get_cpuinfo(char *buf);
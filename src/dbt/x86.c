@@ -17,30 +17,26 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <dbt/cpuid.h>
 #include <dbt/x86.h>
-#include <dbt/x86_inst.h>
+#include <dbt/x86_decoder.h>
+#include <dbt/x86_platform.h>
 #include <lib/rbtree.h>
 #include <lib/slist.h>
 #include <syscall/mm.h>
 #include <syscall/sig.h>
 #include <syscall/tls.h>
 #include <log.h>
+#include <str.h>
 
+#include <immintrin.h>
+#include <intrin.h>
 #include <stdbool.h>
 #include <stdint.h>
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #include <ntdll.h>
 
-#define GET_MODRM_MOD(c)	(((c) >> 6) & 7)
-#define GET_MODRM_R(c)		(((c) >> 3) & 7)
-#define GET_MODRM_RM(c)		((c) & 7)
-#define GET_MODRM_CODE(c)	GET_MODRM_R(c)
-
-#define GET_SIB_SCALE(s)	((s) >> 6)
-#define GET_SIB_INDEX(s)	(((s) >> 3) & 7)
-#define GET_SIB_BASE(s)		((s) & 7)
-
 #define GET_REX_W(r)		(((r) >> 3) & 1)
 #define GET_REX_R(r)		(((r) >> 2) & 1)
 #define GET_REX_X(r)		(((r) >> 1) & 1)
@@ -131,17 +127,23 @@ static uint8_t __forceinline parse_byte(uint8_t **code)
 
 static uint16_t __forceinline parse_word(uint8_t **code)
 {
-	return *((uint16_t*)*code)++;
+	uint16_t x = *(uint16_t *)(*code);
+	*code += 2;
+	return x;
 }
 
 static uint32_t __forceinline parse_dword(uint8_t **code)
 {
-	return *((uint32_t*)*code)++;
+	uint32_t x = *(uint32_t *)(*code);
+	*code += 4;
+	return x;
 }
 
 static uint64_t __forceinline parse_qword(uint8_t **code)
 {
-	return *((uint64_t*)*code)++;
+	uint64_t x = *(uint64_t *)(*code);
+	*code += 8;
+	return x;
 }
 
 static int32_t __forceinline parse_rel(uint8_t **code, int rel_bytes)
@@ -304,7 +306,7 @@ static __forceinline void gen_modrm_sib(uint8_t **out, int r, struct modrm_rm_t
 
 static __forceinline void gen_fs_prefix(uint8_t **out)
 {
-	gen_byte(out, 0x64);
+	gen_byte(out, DBT_PLATFORM_TLS_PREFIX);
 }
 
 static __forceinline void gen_mov_rm_imm32(uint8_t **out, struct modrm_rm_t rm, uint32_t imm32)
@@ -467,8 +469,29 @@ static int cache_tree_cmp(const struct rb_node *left, const struct rb_node *righ
 #define DBT_BLOCK_MAXSIZE		1024 /* Maximum size of a translated basic block */
 #define DBT_BLOCKS_TABLE_SIZE	0x00800000U
 #define DBT_CACHE_SIZE			0x00800000U
+#define DBT_COMMIT_SIZE			0x00010000U /* Granularity of committing dbt memory */
+#define DBT_TRAMPOLINE_RESERVE	256 /* Trampoline space kept committed below dbt->end */
+#define DBT_SIMD_STATE_SIZE		1024 /* Enough for x87, SSE and AVX states (see dbt_xsave_mask) */
 #define MAX_DBT_BLOCKS			(DBT_BLOCKS_TABLE_SIZE / sizeof(struct dbt_block))
 
+/* Translator statistics, exposed in /proc/flinux/dbt
+ * These are only written by the owner thread, readers may see slightly stale values
+ */
+struct dbt_stats
+{
+	uint64_t blocks_inherited; /* Number of basic blocks inherited from parent on fork() */
+	uint64_t blocks_translated; /* Number of basic blocks translated */
+	uint64_t bytes_translated; /* Number of guest code bytes translated */
+	uint64_t translate_cycles; /* Time spent in dbt_translate(), in TSC cycles */
+	uint64_t flushes; /* Total code cache flushes */
+	uint64_t evictions; /* Flushes caused by a full code cache or block table */
+	uint64_t sieve_fallbacks; /* Indirect branches which missed the sieve, including return cache misses */
+	uint64_t sieve_chain_total; /* Sum of sieve chain lengths walked on insertion */
+	uint64_t sieve_chain_max; /* Longest sieve chain seen */
+	uint64_t return_cache_misses; /* Returns which missed the return cache */
+	uint64_t direct_patches; /* Direct branch trampolines patched */
+};
+
 struct dbt_global_data
 {
 	/* Cached offsets for accessing thread local storage in fs:[.] */
@@ -480,6 +503,10 @@ struct dbt_global_data
 	int tls_kernel_esp_offset; /* saved kernel stack pointer */
 	int tls_esp_offset; /* saved user stack pointer */
 	int tls_eip_offset; /* saved instruction pointer */
+	/* List of dbt thread data of all threads, for statistics */
+	SRWLOCK threads_lock;
+	struct slist threads;
+	struct dbt_stats exited_stats; /* Accumulated statistics of exited threads */
 } static _dbt_global;
 
 static struct dbt_global_data *const dbt_global = &_dbt_global;
@@ -489,6 +516,7 @@ static struct dbt_global_data *const dbt_global = &_dbt_global;
 #define SIEVE_HASH(x)				((x) & 0xFFFF)
 #define DBT_RETURN_CACHE_ENTRIES	65536
 #define RETURN_CACHE_HASH(x)		((x) & 0xFFFF)
+
 struct dbt_data
 {
 	struct slist block_hash[DBT_BLOCK_HASH_BUCKETS];
@@ -499,9 +527,17 @@ struct dbt_data
 	uint8_t *code_cache;
 	uint8_t *internal_trampoline_end;
 	uint8_t *out, *end;
+	/* The block table and code cache are only reserved, memory is committed
+	 * incrementally as the allocation pointers advance.
+	 * Code cache: [code_cache, cache_commit_low) and [cache_commit_high, code_cache + DBT_CACHE_SIZE)
+	 * Block table: [blocks, blocks + blocks_commit)
+	 */
+	uint8_t *cache_commit_low, *cache_commit_high;
+	size_t blocks_commit;
 	/* Trampolines */
 	void *run_trampoline;
 	void *restore_fork_trampoline;
+	void *resume_trampoline;
 	void *signal_trampoline;
 	void *sigreturn_trampoline;
 	/* Sieve */
@@ -513,11 +549,16 @@ struct dbt_data
 	/* Information of current signal to be delivered */
 	bool signal_pending;
 	bool signal_need_fixup;
+	/* Statistics */
+	struct slist threads; /* Entry in dbt_global->threads */
+	DWORD win_tid;
+	struct dbt_stats stats;
 };
 
 extern void dbt_find_direct_internal();
 extern void dbt_find_indirect_internal();
 extern void dbt_sieve_fallback();
+extern void dbt_return_fallback();
 
 extern void dbt_save_simd_state();
 extern void dbt_restore_simd_state();
@@ -527,6 +568,9 @@ extern void syscall_handler();
 
 static __declspec(thread) struct dbt_data *dbt;
 
+/* Set by parent in dbt_fork() when the child inherits the parent's code cache */
+static struct dbt_data *dbt_fork_data;
+
 /* We use a return trampoline for returning to user code from kernel code
  * The return address is stored in TLS and set up in kernel code
  * This enables us to do efficient return address patching on receipt of signals
@@ -606,6 +650,35 @@ static void dbt_gen_restore_fork_trampoline()
 	dbt->out = out;
 }
 
+/* Like the restore fork trampoline, but the kernel stack pointer is kept and eax is restored */
+static void dbt_gen_resume_trampoline()
+{
+	uint8_t *out;
+	out = (uint8_t*)ALIGN_TO(dbt->out, DBT_OUT_ALIGN);
+	dbt->resume_trampoline = out;
+
+	/* stack: struct syscall_context* */
+	/* stack: return address */
+	/* mov eax, [esp + 4] */
+	gen_mov_r_rm_32(&out, EAX, modrm_rm_mreg(ESP, 4));
+	/* restore context */
+	gen_mov_r_rm_32(&out, ECX, modrm_rm_mreg(EAX, offsetof(struct syscall_context, ecx)));
+	gen_mov_r_rm_32(&out, EDX, modrm_rm_mreg(EAX, offsetof(struct syscall_context, edx)));
+	gen_mov_r_rm_32(&out, EBX, modrm_rm_mreg(EAX, offsetof(struct syscall_context, ebx)));
+	gen_mov_r_rm_32(&out, ESP, modrm_rm_mreg(EAX, offsetof(struct syscall_context, esp)));
+	gen_mov_r_rm_32(&out, EBP, modrm_rm_mreg(EAX, offsetof(struct syscall_context, ebp)));
+	gen_mov_r_rm_32(&out, ESI, modrm_rm_mreg(EAX, offsetof(struct syscall_context, esi)));
+	gen_mov_r_rm_32(&out, EDI, modrm_rm_mreg(EAX, offsetof(struct syscall_context, edi)));
+	/* push [eax].eip */
+	gen_push_rm(&out, modrm_rm_mreg(EAX, offsetof(struct syscall_context, eip)));
+	/* mov eax, [eax].eax */
+	gen_mov_r_rm_32(&out, EAX, modrm_rm_mreg(EAX, offsetof(struct syscall_context, eax)));
+	/* jmp dbt_find_indirect_internal */
+	gen_jmp(&out, dbt_find_indirect_internal);
+
+	dbt->out = out;
+}
+
 static void dbt_setup_signal_handler(struct syscall_context *context);
 static void dbt_gen_signal_trampoline()
 {
@@ -700,10 +773,73 @@ static void dbt_gen_sigreturn_trampoline()
 
 static void dbt_set_return_addr(size_t original_pc, size_t translated_addr)
 {
-	__writefsdword(dbt_global->tls_eip_offset, original_pc);
-	__writefsdword(dbt_global->tls_return_addr_offset, translated_addr);
+	dbt_platform_write_tls(dbt_global->tls_eip_offset, original_pc);
+	dbt_platform_write_tls(dbt_global->tls_return_addr_offset, translated_addr);
 	if (dbt->signal_pending)
-		__writefsdword(dbt_global->tls_return_addr_offset, (DWORD)dbt->signal_trampoline);
+		dbt_platform_write_tls(dbt_global->tls_return_addr_offset, (DWORD)dbt->signal_trampoline);
+}
+
+/* Commit reserved dbt memory
+ * This could be called in the middle of a translation, where the SIMD states
+ * are not saved. Wrap the system call to keep them unchanged.
+ */
+static void dbt_commit(void *addr, size_t size, bool executable)
+{
+	__declspec(align(64)) uint8_t simd_state[DBT_SIMD_STATE_SIZE];
+	if (dbt_xsave_mask)
+		_xsave(simd_state, dbt_xsave_mask);
+	else
+		_fxsave(simd_state);
+	if (!dbt_platform_commit(addr, size, executable))
+	{
+		log_error("dbt: commit(%p, %p) failed, error code: %d\n", addr, size, GetLastError());
+		__debugbreak();
+	}
+	if (dbt_xsave_mask)
+		_xrstor(simd_state, dbt_xsave_mask);
+	else
+		_fxrstor(simd_state);
+}
+
+/* Ensure code cache [code_cache, addr) is committed */
+static __forceinline void dbt_commit_cache_low(uint8_t *addr)
+{
+	if (addr > dbt->cache_commit_low)
+	{
+		uint8_t *commit_end = (uint8_t *)ALIGN_TO(addr, DBT_COMMIT_SIZE);
+		if (commit_end > dbt->code_cache + DBT_CACHE_SIZE)
+			commit_end = dbt->code_cache + DBT_CACHE_SIZE;
+		dbt_commit(dbt->cache_commit_low, commit_end - dbt->cache_commit_low, true);
+		dbt->cache_commit_low = commit_end;
+	}
+}
+
+/* Ensure code cache [addr, code_cache + DBT_CACHE_SIZE) is committed */
+static __forceinline void dbt_commit_cache_high(uint8_t *addr)
+{
+	if (addr < dbt->cache_commit_high)
+	{
+		uint8_t *commit_start = (uint8_t *)((size_t)addr & -DBT_COMMIT_SIZE);
+		if (commit_start < dbt->code_cache)
+			commit_start = dbt->code_cache;
+		dbt_commit(commit_start, dbt->cache_commit_high - commit_start, true);
+		dbt->cache_commit_high = commit_start;
+	}
+}
+
+/* Ensure there is enough committed space for translating a new block and its trampolines */
+static __forceinline void dbt_commit_cache()
+{
+	dbt_commit_cache_low(dbt->out + DBT_OUT_ALIGN + DBT_BLOCK_MAXSIZE);
+	dbt_commit_cache_high(dbt->end - DBT_TRAMPOLINE_RESERVE);
+}
+
+static size_t dbt_get_committed(struct dbt_data *data)
+{
+	size_t cache_committed = (data->cache_commit_low - data->code_cache) + (data->code_cache + DBT_CACHE_SIZE - data->cache_commit_high);
+	if (cache_committed > DBT_CACHE_SIZE)
+		cache_committed = DBT_CACHE_SIZE;
+	return cache_committed + data->blocks_commit;
 }
 
 static void dbt_gen_sieve_dispatch();
@@ -721,32 +857,89 @@ static void dbt_gen_tables()
 	dbt->out += sizeof(uint8_t*) * DBT_SIEVE_ENTRIES;
 	dbt->return_cache = (uint8_t**)dbt->out;
 	dbt->out += sizeof(uint8_t*) * DBT_RETURN_CACHE_ENTRIES;
+	/* The tables are fully populated, they are committed as a whole */
+	dbt_commit_cache();
 
 	/* Trampolines */
 	dbt_gen_run_trampoline();
 	dbt_gen_restore_fork_trampoline();
+	dbt_gen_resume_trampoline();
 	dbt_gen_signal_trampoline();
 	dbt_gen_sigreturn_trampoline();
 	dbt->internal_trampoline_end = dbt->out;
 	dbt_gen_sieve_dispatch();
 	for (int i = 0; i < DBT_RETURN_CACHE_ENTRIES; i++)
-		dbt->return_cache[i] = (uint8_t*)&dbt_sieve_fallback;
+		dbt->return_cache[i] = (uint8_t*)&dbt_return_fallback;
 }
 
 void dbt_init_thread()
 {
-	dbt = VirtualAlloc(NULL, sizeof(struct dbt_data), MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE);
-	if (!(dbt->blocks = VirtualAlloc(NULL, DBT_BLOCKS_TABLE_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE)))
-		log_error("VirtualAlloc() for dbt_blocks failed.\n");
-	if (!(dbt->code_cache = VirtualAlloc(NULL, DBT_CACHE_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_EXECUTE_READWRITE)))
-		log_error("VirtualAlloc() for dbt_cache failed.\n");
-	dbt_gen_tables();
-	__writefsdword(dbt_global->tls_dbt_offset, (DWORD)dbt);
+	if (dbt_fork_data)
+	{
+		/* We are a fork child, the parent has already set up its code cache for us at the same addresses */
+		dbt = dbt_fork_data;
+		dbt_fork_data = NULL;
+		dbt->signal_pending = false;
+		dbt->signal_need_fixup = false;
+		memset(&dbt->stats, 0, sizeof(struct dbt_stats));
+		dbt->stats.blocks_inherited = dbt->blocks_count;
+	}
+	else
+	{
+		dbt = dbt_platform_alloc(sizeof(struct dbt_data), false);
+		if (!(dbt->blocks = dbt_platform_reserve(DBT_BLOCKS_TABLE_SIZE, false)))
+			log_error("Reserving memory for dbt_blocks failed.\n");
+		if (!(dbt->code_cache = dbt_platform_reserve(DBT_CACHE_SIZE, true)))
+			log_error("Reserving memory for dbt_cache failed.\n");
+		dbt->blocks_commit = 0;
+		dbt->cache_commit_low = dbt->code_cache;
+		dbt->cache_commit_high = dbt->code_cache + DBT_CACHE_SIZE;
+		dbt_gen_tables();
+	}
+	dbt_platform_write_tls(dbt_global->tls_dbt_offset, (DWORD)dbt);
+	dbt->win_tid = GetCurrentThreadId();
+	AcquireSRWLockExclusive(&dbt_global->threads_lock);
+	slist_add(&dbt_global->threads, &dbt->threads);
+	ReleaseSRWLockExclusive(&dbt_global->threads_lock);
+}
+
+static void dbt_add_stats(struct dbt_stats *total, struct dbt_stats *stats)
+{
+	total->blocks_inherited += stats->blocks_inherited;
+	total->blocks_translated += stats->blocks_translated;
+	total->bytes_translated += stats->bytes_translated;
+	total->translate_cycles += stats->translate_cycles;
+	total->flushes += stats->flushes;
+	total->evictions += stats->evictions;
+	total->sieve_fallbacks += stats->sieve_fallbacks;
+	total->sieve_chain_total += stats->sieve_chain_total;
+	if (stats->sieve_chain_max > total->sieve_chain_max)
+		total->sieve_chain_max = stats->sieve_chain_max;
+	total->return_cache_misses += stats->return_cache_misses;
+	total->direct_patches += stats->direct_patches;
+}
+
+/* Remove the current thread from the statistics list, called before the thread exits */
+void dbt_exit_thread()
+{
+	AcquireSRWLockExclusive(&dbt_global->threads_lock);
+	slist_iterate(&dbt_global->threads, prev, cur)
+	{
+		if (cur == &dbt->threads)
+		{
+			slist_remove(prev, cur);
+			break;
+		}
+	}
+	dbt_add_stats(&dbt_global->exited_stats, &dbt->stats);
+	ReleaseSRWLockExclusive(&dbt_global->threads_lock);
 }
 
 void dbt_init()
 {
 	log_info("Initializing dbt subsystem...\n");
+	dbt_cpuid_init();
+	x86_decoder_init();
 	/* Initialize TLS offsets */
 	dbt_global->tls_dbt_offset = tls_kernel_entry_to_offset(TLS_ENTRY_DBT);
 	dbt_global->tls_scratch_offset = tls_kernel_entry_to_offset(TLS_ENTRY_SCRATCH);
@@ -755,8 +948,10 @@ void dbt_init()
 	dbt_global->tls_return_addr_offset = tls_kernel_entry_to_offset(TLS_ENTRY_RETURN_ADDR);
 	dbt_global->tls_kernel_esp_offset = tls_kernel_entry_to_offset(TLS_ENTRY_KERNEL_ESP);
 	dbt_global->tls_esp_offset = tls_kernel_entry_to_offset(TLS_ENTRY_ESP);
+	InitializeSRWLock(&dbt_global->threads_lock);
+	slist_init(&dbt_global->threads);
 	/* Generate return trampoline */
-	void *buffer = VirtualAlloc(NULL, PAGE_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_EXECUTE_READWRITE);
+	void *buffer = dbt_platform_alloc(PAGE_SIZE, true);
 	dbt_gen_return_trampoline(buffer);
 	/* Initialize dbt thread local data for main thread */
 	dbt_init_thread();
@@ -768,11 +963,77 @@ void dbt_shutdown()
 	/* TODO */
 }
 
+/* Copy a range of dbt memory to the same address in the child process */
+static bool dbt_fork_copy(HANDLE process, void *addr, size_t size)
+{
+	if (size == 0)
+		return true;
+	if (!WriteProcessMemory(process, addr, addr, size, NULL))
+	{
+		log_warning("dbt_fork(): Write %p failed, error code: %d\n", addr, GetLastError());
+		return false;
+	}
+	return true;
+}
+
+/* Let the fork child inherit the code cache of the current thread
+ * The child runs at the same addresses with the same memory mappings, so all
+ * translated blocks, the block tables, the sieve table and the return cache
+ * stay valid. Only the live parts of the reserved regions are copied.
+ * If anything fails, the child falls back to an empty code cache.
+ */
+void dbt_fork(HANDLE process)
+{
+	if (!VirtualAllocEx(process, dbt, sizeof(struct dbt_data), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE))
+	{
+		log_warning("dbt_fork(): Allocate dbt_data failed, error code: %d\n", GetLastError());
+		return;
+	}
+	if (!VirtualAllocEx(process, dbt->blocks, DBT_BLOCKS_TABLE_SIZE, MEM_RESERVE, PAGE_READWRITE))
+	{
+		log_warning("dbt_fork(): Reserve block table failed, error code: %d\n", GetLastError());
+		goto fail_blocks;
+	}
+	if (!VirtualAllocEx(process, dbt->code_cache, DBT_CACHE_SIZE, MEM_RESERVE, PAGE_EXECUTE_READWRITE))
+	{
+		log_warning("dbt_fork(): Reserve code cache failed, error code: %d\n", GetLastError());
+		goto fail_code_cache;
+	}
+	uint8_t *cache_end = dbt->code_cache + DBT_CACHE_SIZE;
+	/* Commit the same ranges as in parent, then copy the used parts */
+	if (dbt->blocks_commit > 0 && !VirtualAllocEx(process, dbt->blocks, dbt->blocks_commit, MEM_COMMIT, PAGE_READWRITE))
+		goto fail;
+	if (!VirtualAllocEx(process, dbt->code_cache, dbt->cache_commit_low - dbt->code_cache, MEM_COMMIT, PAGE_EXECUTE_READWRITE))
+		goto fail;
+	if (dbt->cache_commit_high < cache_end
+		&& !VirtualAllocEx(process, dbt->cache_commit_high, cache_end - dbt->cache_commit_high, MEM_COMMIT, PAGE_EXECUTE_READWRITE))
+		goto fail;
+	if (!dbt_fork_copy(process, dbt->blocks, dbt->blocks_count * sizeof(struct dbt_block)))
+		goto fail;
+	if (!dbt_fork_copy(process, dbt->code_cache, dbt->out - dbt->code_cache))
+		goto fail;
+	if (!dbt_fork_copy(process, dbt->end, cache_end - dbt->end))
+		goto fail;
+	if (!dbt_fork_copy(process, dbt, sizeof(struct dbt_data)))
+		goto fail;
+	if (!WriteProcessMemory(process, &dbt_fork_data, &dbt, sizeof(struct dbt_data *), NULL))
+		goto fail;
+	return;
+
+fail:
+	VirtualFreeEx(process, dbt->code_cache, 0, MEM_RELEASE);
+fail_code_cache:
+	VirtualFreeEx(process, dbt->blocks, 0, MEM_RELEASE);
+fail_blocks:
+	VirtualFreeEx(process, dbt, 0, MEM_RELEASE);
+}
+
 static void dbt_flush()
 {
 	for (int i = 0; i < DBT_BLOCK_HASH_BUCKETS; i++)
 		slist_init(&dbt->block_hash[i]);
 	dbt_gen_tables();
+	dbt->stats.flushes++;
 	log_info("dbt code cache flushed.\n");
 }
 
@@ -807,6 +1068,12 @@ static struct dbt_block *alloc_block()
 {
 	if (dbt->blocks_count == MAX_DBT_BLOCKS || dbt->end - dbt->out < DBT_BLOCK_MAXSIZE)
 		return NULL;
+	if ((dbt->blocks_count + 1) * sizeof(struct dbt_block) > dbt->blocks_commit)
+	{
+		dbt_commit((uint8_t *)dbt->blocks + dbt->blocks_commit, DBT_COMMIT_SIZE, false);
+		dbt->blocks_commit += DBT_COMMIT_SIZE;
+	}
+	dbt_commit_cache();
 	return &dbt->blocks[dbt->blocks_count++];
 }
 
@@ -1042,6 +1309,8 @@ struct instruction_t
 	int lock_prefix;
 	int escape_0x0f;
 	uint8_t escape_byte2; /* 0x38 or 0x3A */
+	uint8_t vex[3]; /* Raw VEX prefix bytes */
+	int vex_len; /* Length of VEX prefix, 0 if not present */
 	int r;
 	struct modrm_rm_t rm;
 	int imm_bytes;
@@ -1103,7 +1372,9 @@ static void dbt_copy_instruction(uint8_t **out, uint8_t **code, struct instructi
 		gen_byte(out, ins->rep_prefix);
 	if (ins->segment_prefix && ins->segment_prefix != PREFIX_GS)
 		gen_byte(out, ins->segment_prefix);
-	if (ins->escape_0x0f)
+	if (ins->vex_len)
+		gen_copy(out, ins->vex, ins->vex_len); /* VEX prefix encodes the escape bytes */
+	else if (ins->escape_0x0f)
 	{
 		gen_byte(out, 0x0f);
 		if (ins->escape_byte2)
@@ -1138,7 +1409,7 @@ static bool dbt_gen_push_gs_rm(uint8_t **out, int temp_reg, struct modrm_rm_t rm
 	if (context && context->eip <= (DWORD)*out)
 	{
 		context->eip = current_ip;
-		set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+		set_context_register(context, temp_reg, dbt_platform_read_tls(dbt_global->tls_scratch_offset));
 		return true;
 	}
 
@@ -1153,7 +1424,7 @@ static bool dbt_gen_push_gs_rm(uint8_t **out, int temp_reg, struct modrm_rm_t rm
 	if (context && context->eip <= (DWORD)*out)
 	{
 		context->eip = current_ip;
-		set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+		set_context_register(context, temp_reg, dbt_platform_read_tls(dbt_global->tls_scratch_offset));
 		context->esp += 4;
 		return true;
 	}
@@ -1168,7 +1439,7 @@ static bool dbt_gen_call_postamble(uint8_t **out, size_t source_pc, struct sysca
 	gen_mov_r_rm_32(out, ECX, modrm_rm_mreg(ESP, 4));
 	gen_lea(out, ECX, modrm_rm_mreg(ECX, -source_pc));
 	gen_jecxz_rel(out, 5);
-	gen_jmp(out, &dbt_sieve_fallback);
+	gen_jmp(out, &dbt_return_fallback);
 	if (context && context->eip <= (DWORD)*out)
 	{
 		context->eip = *(DWORD *)(context->esp + 4);
@@ -1216,6 +1487,38 @@ static bool dbt_gen_ret_trampoline(uint8_t **out, struct syscall_context *contex
 	return false;
 }
 
+/* Parse a VEX prefixed instruction (AVX, AVX2, FMA, F16C, BMI)
+ * In 32-bit mode VEX is distinguished from LES/LDS (0xC4/0xC5) by ModR/M.mod == 3
+ * None of these instructions change control flow, they are copied verbatim.
+ * A descriptor is built on the fly in desc since the opcode maps are not tabulated.
+ */
+static void parse_vex(uint8_t **code, struct instruction_t *ins, struct instruction_desc *desc)
+{
+	int map, vvvv;
+	ins->vex[0] = ins->opcode;
+	ins->vex[1] = parse_byte(code);
+	if (ins->vex[0] == 0xC5)
+	{
+		/* 2-byte VEX: R vvvv L pp, implied 0F map */
+		ins->vex_len = 2;
+		map = 1;
+		vvvv = (~ins->vex[1] >> 3) & 0x0F;
+	}
+	else
+	{
+		/* 3-byte VEX: R X B mmmmm, W vvvv L pp */
+		ins->vex[2] = parse_byte(code);
+		ins->vex_len = 3;
+		map = ins->vex[1] & 0x1F;
+		vvvv = (~ins->vex[2] >> 3) & 0x0F;
+	}
+	ins->opcode = parse_byte(code);
+	ins->escape_0x0f = 1;
+	ins->escape_byte2 = map == X86_MAP_0F38? 0x38: map == X86_MAP_0F3A? 0x3A: 0;
+	/* vvvv is included in read_regs, so it is never picked as a temporary register */
+	x86_decoder_vex_desc(map, ins->opcode, vvvv, desc);
+}
+
 static void dbt_log_opcode(struct instruction_t *ins)
 {
 	log_info("Opcode: 0x%02x\n", ins->opcode);
@@ -1274,6 +1577,7 @@ static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *contex
 		if (!block) /* The cache is full */
 		{
 			/* TODO: We may need to check this flush-all-on-full semantic when we add signal handling */
+			dbt->stats.evictions++;
 			dbt_flush();
 			block = alloc_block(); /* We won't fail again */
 		}
@@ -1299,6 +1603,8 @@ static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *contex
 			goto end_block;
 		}
 		struct instruction_t ins;
+		struct instruction_desc vex_desc;
+		ins.vex_len = 0;
 		ins.rep_prefix = 0;
 		ins.opsize_prefix = 0;
 		ins.segment_prefix = 0;
@@ -1367,8 +1673,17 @@ done_prefix:
 		/* Extract instruction descriptor */
 		ins.escape_0x0f = 0;
 		ins.escape_byte2 = 0;
+		int mandatory = ins.opsize_prefix? MANDATORY_0x66
+			: ins.rep_prefix == 0xF3? MANDATORY_0xF3
+			: ins.rep_prefix == 0xF2? MANDATORY_0xF2
+			: MANDATORY_NONE;
 
-		if (ins.opcode == 0x0F)
+		if ((ins.opcode == 0xC4 || ins.opcode == 0xC5) && GET_MODRM_MOD(*code) == 3)
+		{
+			parse_vex(&code, &ins, &vex_desc);
+			ins.desc = &vex_desc;
+		}
+		else if (ins.opcode == 0x0F)
 		{
 			ins.escape_0x0f = 1;
 			ins.opcode = parse_byte(&code);
@@ -1376,21 +1691,20 @@ done_prefix:
 			{
 				ins.escape_byte2 = 0x38;
 				ins.opcode = parse_byte(&code);
-				ins.desc = &three_byte_inst_0x38[ins.opcode];
+				ins.desc = x86_decoder_lookup(X86_MAP_0F38, ins.opcode, mandatory);
 			}
 			else if (ins.opcode == 0x3A)
 			{
 				ins.escape_byte2 = 0x3A;
 				ins.opcode = parse_byte(&code);
-				ins.desc = &three_byte_inst_0x3A[ins.opcode];
+				ins.desc = x86_decoder_lookup(X86_MAP_0F3A, ins.opcode, mandatory);
 			}
 			else
-				ins.desc = &two_byte_inst[ins.opcode];
+				ins.desc = x86_decoder_lookup(X86_MAP_0F, ins.opcode, mandatory);
 		}
 		else
-			ins.desc = &one_byte_inst[ins.opcode];
+			ins.desc = x86_decoder_lookup(X86_MAP_ONE_BYTE, ins.opcode, mandatory);
 
-	inst_mandatory_reentry:
 		if (ins.desc->has_modrm)
 			parse_modrm(&code, &ins.r, &ins.rm);
 		
@@ -1420,24 +1734,6 @@ done_prefix:
 			goto inst_extension_reentry;
 		}
 
-		case INST_TYPE_MANDATORY:
-		{
-			if (!ins.escape_0x0f)
-			{
-				log_error("Invalid opcode.\n");
-				__debugbreak();
-			}
-			if (ins.opsize_prefix)
-				ins.desc = &ins.desc->extension_table[MANDATORY_0x66];
-			else if (ins.rep_prefix == 0xF3)
-				ins.desc = &ins.desc->extension_table[MANDATORY_0xF3];
-			else if (ins.rep_prefix == 0xF2)
-				ins.desc = &ins.desc->extension_table[MANDATORY_0xF2];
-			else
-				ins.desc = &ins.desc->extension_table[MANDATORY_NONE];
-			goto inst_mandatory_reentry;
-		}
-
 		case INST_TYPE_X87:
 		{
 			/* A very simplistic way to handle x87 escape opcode */
@@ -1480,7 +1776,7 @@ done_prefix:
 				if (context && context->eip <= (DWORD)out)
 				{
 					/* The instruction is not yet executed, rollback */
-					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+					set_context_register(context, temp_reg, dbt_platform_read_tls(dbt_global->tls_scratch_offset));
 					context->eip = current_ip;
 					goto end_block;
 				}
@@ -1490,7 +1786,7 @@ done_prefix:
 				if (context && context->eip == (DWORD)out)
 				{
 					/* The instruction is already executed, commit */
-					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+					set_context_register(context, temp_reg, dbt_platform_read_tls(dbt_global->tls_scratch_offset));
 					context->eip = (DWORD)code;
 					goto end_block;
 				}
@@ -1527,7 +1823,7 @@ done_prefix:
 				gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_gs_addr_offset));
 				if (context && context->eip <= (DWORD)out)
 				{
-					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+					set_context_register(context, temp_reg, dbt_platform_read_tls(dbt_global->tls_scratch_offset));
 					context->eip = current_ip;
 					goto end_block;
 				}
@@ -1549,7 +1845,7 @@ done_prefix:
 				gen_modrm_sib(&out, 0, modrm_rm_mreg(temp_reg, disp));
 				if (context && context->eip == (DWORD)out)
 				{
-					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+					set_context_register(context, temp_reg, dbt_platform_read_tls(dbt_global->tls_scratch_offset));
 					context->eip = (DWORD)code;
 					goto end_block;
 				}
@@ -1809,7 +2105,7 @@ done_prefix:
 			{
 				/* The instruction is not yet executed, rollback */
 				context->eip = current_ip;
-				set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+				set_context_register(context, temp_reg, dbt_platform_read_tls(dbt_global->tls_scratch_offset));
 				goto end_block;
 			}
 
@@ -1819,7 +2115,7 @@ done_prefix:
 			{
 				/* The instruction is already executed, commit */
 				context->eip = (DWORD)code;
-				set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+				set_context_register(context, temp_reg, dbt_platform_read_tls(dbt_global->tls_scratch_offset));
 				goto end_block;
 			}
 
@@ -1894,7 +2190,10 @@ done_prefix:
 		break;
 	}
 	if (!context)
+	{
 		dbt->out = out;
+		dbt->stats.bytes_translated += (size_t)code - pc;
+	}
 	return block;
 }
 
@@ -1909,8 +2208,11 @@ static uint8_t *dbt_find(size_t pc)
 	}
 
 	/* Block not found, translate it now */
+	uint64_t start_cycles = dbt_platform_timestamp();
 	struct dbt_block *block = dbt_translate(pc, NULL);
 	slist_add(&dbt->block_hash[bucket], &block->list);
+	dbt->stats.blocks_translated++;
+	dbt->stats.translate_cycles += dbt_platform_timestamp() - start_cycles;
 	return block->start;
 }
 
@@ -1922,8 +2224,10 @@ void dbt_find_next(size_t pc)
 void dbt_find_next_sieve(size_t pc)
 {
 	uint8_t *target = dbt_find(pc);
+	dbt_commit_cache();
 	uint8_t *sieve = dbt_gen_sieve(pc, target);
 
+	dbt->stats.sieve_fallbacks++;
 	/* Patch sieve table */
 	int hash = SIEVE_HASH(pc);
 	if (dbt->sieve_table[hash] == (void*)&dbt_sieve_fallback)
@@ -1931,6 +2235,7 @@ void dbt_find_next_sieve(size_t pc)
 	else
 	{
 		uint8_t *current = dbt->sieve_table[hash];
+		uint64_t chain_length = 1;
 		for (;;)
 		{
 			uint8_t *next_bucket_rel = *(uint8_t**)&current[DBT_SIEVE_NEXT_BUCKET_OFFSET];
@@ -1938,19 +2243,30 @@ void dbt_find_next_sieve(size_t pc)
 			if (next_bucket == (void*)&dbt_sieve_fallback)
 				break;
 			current = next_bucket;
+			chain_length++;
 		}
 		uint8_t *next_bucket_rel = sieve - (size_t)(current + DBT_SIEVE_NEXT_BUCKET_OFFSET + sizeof(size_t));
 		*(uint8_t**)&current[DBT_SIEVE_NEXT_BUCKET_OFFSET] = next_bucket_rel;
+		dbt->stats.sieve_chain_total += chain_length;
+		if (chain_length > dbt->stats.sieve_chain_max)
+			dbt->stats.sieve_chain_max = chain_length;
 	}
 	dbt_set_return_addr(pc, (size_t)target);
 }
 
+void dbt_find_next_return(size_t pc)
+{
+	dbt->stats.return_cache_misses++;
+	dbt_find_next_sieve(pc);
+}
+
 void dbt_find_direct(size_t pc, size_t patch_addr)
 {
 	/* Translate or generate the block */
 	size_t block_start = (size_t)dbt_find(pc);
 	/* Patch the jmp/call address so we don't need to repeat work again */
 	*(size_t*)patch_addr = (intptr_t)(block_start - (patch_addr + 4)); /* Relative address */
+	dbt->stats.direct_patches++;
 	dbt_set_return_addr(pc, block_start);
 }
 
@@ -1968,16 +2284,22 @@ void __declspec(noreturn) dbt_restore_fork_context(struct syscall_context *ctx)
 	((void(*)(struct syscall_context *ctx))dbt->restore_fork_trampoline)(ctx);
 }
 
+void __declspec(noreturn) dbt_resume_context(struct syscall_context *ctx)
+{
+	log_info("dbt: Resuming context, (pc: %p, sp: %p)\n", ctx->eip, ctx->esp);
+	((void(*)(struct syscall_context *ctx))dbt->resume_trampoline)(ctx);
+}
+
 int dbt_get_gs()
 {
-	return __readfsdword(dbt_global->tls_gs_offset);
+	return dbt_platform_read_tls(dbt_global->tls_gs_offset);
 }
 
 void dbt_update_tls(int gs)
 {
-	DWORD gs_addr = __readfsdword(tls_user_entry_to_offset(gs >> 3));
-	__writefsdword(dbt_global->tls_gs_offset, gs);
-	__writefsdword(dbt_global->tls_gs_addr_offset, gs_addr);
+	DWORD gs_addr = dbt_platform_read_tls(tls_user_entry_to_offset(gs >> 3));
+	dbt_platform_write_tls(dbt_global->tls_gs_offset, gs);
+	dbt_platform_write_tls(dbt_global->tls_gs_addr_offset, gs_addr);
 }
 
 void dbt_deliver_signal(HANDLE thread, CONTEXT *context)
@@ -2013,3 +2335,85 @@ void __declspec(noreturn) dbt_sigreturn(struct sigcontext *context)
 {
 	((void(*)(struct sigcontext *context))dbt->sigreturn_trampoline)(context);
 }
+
+static int dbt_code_cache_used(struct dbt_data *data)
+{
+	return (int)((data->out - data->code_cache) + (data->code_cache + DBT_CACHE_SIZE - data->end));
+}
+
+static int dbt_format_stats(char *buf, struct dbt_stats *stats, int blocks_count, int code_cache_used, size_t committed)
+{
+	uint64_t sieve_chain_avg = stats->sieve_fallbacks ? stats->sieve_chain_total / stats->sieve_fallbacks : 0;
+	return ksprintf(buf,
+		"blocks:               %d\n"
+		"blocks_inherited:     %llu\n"
+		"blocks_translated:    %llu\n"
+		"bytes_translated:     %llu\n"
+		"code_cache_used:      %d\n"
+		"code_cache_size:      %d\n"
+		"committed:            %u\n"
+		"flushes:              %llu\n"
+		"evictions:            %llu\n"
+		"sieve_fallbacks:      %llu\n"
+		"sieve_chain_avg:      %llu\n"
+		"sieve_chain_max:      %llu\n"
+		"return_cache_misses:  %llu\n"
+		"direct_patches:       %llu\n"
+		"translate_cycles:     %llu\n",
+		blocks_count,
+		stats->blocks_inherited,
+		stats->blocks_translated,
+		stats->bytes_translated,
+		code_cache_used,
+		DBT_CACHE_SIZE,
+		committed,
+		stats->flushes,
+		stats->evictions,
+		stats->sieve_fallbacks,
+		sieve_chain_avg,
+		stats->sieve_chain_max,
+		stats->return_cache_misses,
+		stats->direct_patches,
+		stats->translate_cycles);
+}
+
+int dbt_get_process_stats(char *buf)
+{
+	int blocks_count = 0, code_cache_used = 0, threads = 0;
+	size_t committed = 0;
+	AcquireSRWLockShared(&dbt_global->threads_lock);
+	struct dbt_stats total = dbt_global->exited_stats;
+	slist_iterate(&dbt_global->threads, prev, cur)
+	{
+		struct dbt_data *data = slist_entry(cur, struct dbt_data, threads);
+		dbt_add_stats(&total, &data->stats);
+		blocks_count += data->blocks_count;
+		code_cache_used += dbt_code_cache_used(data);
+		committed += dbt_get_committed(data);
+		threads++;
+	}
+	ReleaseSRWLockShared(&dbt_global->threads_lock);
+	char *original_buf = buf;
+	buf += ksprintf(buf, "threads:              %d\n", threads);
+	buf += dbt_format_stats(buf, &total, blocks_count, code_cache_used, committed);
+	return buf - original_buf;
+}
+
+int dbt_get_thread_stats(char *buf, int size)
+{
+	/* Longest text of a single thread */
+	const int max_thread_len = 1024;
+	char *original_buf = buf;
+	AcquireSRWLockShared(&dbt_global->threads_lock);
+	slist_iterate(&dbt_global->threads, prev, cur)
+	{
+		if (buf - original_buf + max_thread_len > size)
+			break;
+		struct dbt_data *data = slist_entry(cur, struct dbt_data, threads);
+		buf += ksprintf(buf, "thread:               %u\n", data->win_tid);
+		buf += dbt_format_stats(buf, &data->stats, data->blocks_count, dbt_code_cache_used(data), dbt_get_committed(data));
+		buf += ksprintf(buf, "\n");
+	}
+	ReleaseSRWLockShared(&dbt_global->threads_lock);
+	return buf - original_buf;
+}
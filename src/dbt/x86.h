@@ -45,12 +45,16 @@ struct syscall_context
 };
 
 void dbt_init_thread();
+void dbt_exit_thread();
 void dbt_init();
 void dbt_reset();
 void dbt_shutdown();
+void dbt_fork(HANDLE process);
 
 void __declspec(noreturn) dbt_run(size_t pc, size_t sp);
 void __declspec(noreturn) dbt_restore_fork_context(struct syscall_context *context);
+/* Continue user code at the given context in the current thread, eax is restored as well */
+void __declspec(noreturn) dbt_resume_context(struct syscall_context *context);
 
 /* Get current GS register value */
 int dbt_get_gs();
@@ -67,3 +71,7 @@ void dbt_deliver_signal(HANDLE thread, CONTEXT *context);
 
 /* Return from signal */
 void __declspec(noreturn) dbt_sigreturn(struct sigcontext *context);
+
+/* Print translator statistics (/proc/flinux/dbt) */
+int dbt_get_process_stats(char *buf);
+int dbt_get_thread_stats(char *buf, int size);
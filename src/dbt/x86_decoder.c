@@ -0,0 +1,551 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dbt/x86_decoder.h>
+#include <dbt/x86_inst.h>
+
+#include <string.h>
+
+static const struct instruction_desc invalid_desc = { .type = INST_TYPE_INVALID };
+
+/* Flat opcode lookup table, indexed by [map][opcode][mandatory prefix]
+ * Mandatory prefix tables are folded in at initialization, so looking up any
+ * opcode only takes a single indexed load.
+ */
+static const struct instruction_desc *decode_table[X86_MAP_COUNT][256][4];
+
+/* Prefix classification of every byte, PREFIX_NONE if the byte is not a prefix */
+#define PREFIX_NONE				0
+#define PREFIX_LOCK				1
+#define PREFIX_REP				2
+#define PREFIX_REPNE			3
+#define PREFIX_SEGMENT			4
+#define PREFIX_OPSIZE			5
+#define PREFIX_ADDRSIZE			6
+static uint8_t prefix_table[256];
+
+/* Length information of every opcode for x86_decode_length(), indexed like decode_table
+ * The mandatory prefix index tells whether an operand size prefix is present, so the immediate size
+ * is resolved here. Address size prefixes always take the slow path. ModR/M extensions store the
+ * index of their per-member information in extension_length_table in the high byte. Opcodes whose
+ * length does not follow from the opcode and ModR/M bytes alone (VEX, nested tables) are marked
+ * LENGTH_SLOW and go through x86_decode().
+ */
+#define LENGTH_IMM_MASK			0x0F /* Bytes of immediate */
+#define LENGTH_INVALID			0x10
+#define LENGTH_MODRM			0x20
+#define LENGTH_EXTENSION		0x40
+#define LENGTH_SLOW				0x80
+#define LENGTH_EXTENSION_SHIFT	8
+#define MAX_EXTENSION_LENGTHS	64
+static uint16_t length_table[X86_MAP_COUNT][256][4];
+static uint8_t extension_length_table[MAX_EXTENSION_LENGTHS][8];
+
+/* Bytes after a ModR/M byte with 32-bit addressing, including the SIB byte
+ * The disp32 of a SIB byte with no base register is not included, modrm32_sib_nobase tells when to
+ * check for it.
+ */
+static uint8_t modrm32_length[256];
+static uint8_t modrm32_sib_nobase[256];
+
+static uint8_t get_length_info(const struct instruction_desc *desc, int mandatory)
+{
+	switch (desc->type)
+	{
+	case INST_TYPE_UNKNOWN:
+	case INST_TYPE_INVALID:
+	case INST_TYPE_UNSUPPORTED:
+		return LENGTH_INVALID;
+	case INST_TYPE_EXTENSION:
+	case INST_TYPE_MANDATORY:
+		return LENGTH_SLOW;
+	case INST_TYPE_X87:
+		return LENGTH_MODRM; /* Register forms and x87_desc both take a ModR/M and no immediate */
+	}
+	if (desc->require_0x66 && mandatory != MANDATORY_0x66)
+		return LENGTH_INVALID;
+	uint8_t info = desc->has_modrm? LENGTH_MODRM: 0;
+	if (desc->imm_bytes == PREFIX_OPERAND_SIZE)
+		return info | (mandatory == MANDATORY_0x66? 2: 4);
+	if (desc->imm_bytes == PREFIX_ADDRESS_SIZE)
+		return info | 4;
+	return info | desc->imm_bytes;
+}
+
+/* The members of a ModR/M extension are looked up by the r field of the ModR/M byte */
+static uint16_t get_extension_length_info(const struct instruction_desc *desc, int mandatory, int *extension_count)
+{
+	if (!desc->has_modrm)
+		return LENGTH_INVALID;
+	uint8_t info[8];
+	for (int r = 0; r < 8; r++)
+		info[r] = get_length_info(&desc->extension_table[r], mandatory) & ~LENGTH_MODRM;
+	for (int i = 0; i < *extension_count; i++)
+		if (!memcmp(extension_length_table[i], info, sizeof(info)))
+			return LENGTH_EXTENSION | (i << LENGTH_EXTENSION_SHIFT);
+	if (*extension_count == MAX_EXTENSION_LENGTHS)
+		return LENGTH_SLOW;
+	memcpy(extension_length_table[*extension_count], info, sizeof(info));
+	return LENGTH_EXTENSION | ((*extension_count)++ << LENGTH_EXTENSION_SHIFT);
+}
+
+static void init_length_tables()
+{
+	int extension_count = 0;
+	for (int map = 0; map < X86_MAP_COUNT; map++)
+		for (int opcode = 0; opcode < 256; opcode++)
+			for (int mandatory = 0; mandatory < 4; mandatory++)
+			{
+				const struct instruction_desc *desc = decode_table[map][opcode][mandatory];
+				length_table[map][opcode][mandatory] = desc->type == INST_TYPE_EXTENSION?
+					get_extension_length_info(desc, mandatory, &extension_count): get_length_info(desc, mandatory);
+			}
+	/* VEX prefixes in 32-bit mode are told apart from LES/LDS by the following byte */
+	for (int mandatory = 0; mandatory < 4; mandatory++)
+	{
+		length_table[X86_MAP_ONE_BYTE][0xC4][mandatory] = LENGTH_SLOW;
+		length_table[X86_MAP_ONE_BYTE][0xC5][mandatory] = LENGTH_SLOW;
+	}
+	for (int modrm = 0; modrm < 256; modrm++)
+	{
+		int mod = GET_MODRM_MOD(modrm), rm = GET_MODRM_RM(modrm);
+		int length = 0;
+		if (mod != 3 && rm == 4)
+			length++; /* SIB */
+		if (mod == 1)
+			length += 1;
+		else if (mod == 2 || (mod == 0 && rm == 5))
+			length += 4;
+		modrm32_length[modrm] = (uint8_t)length;
+		modrm32_sib_nobase[modrm] = mod == 0 && rm == 4;
+	}
+}
+
+void x86_decoder_init()
+{
+	static const struct instruction_desc *const maps[X86_MAP_COUNT] = {
+		one_byte_inst, two_byte_inst, three_byte_inst_0x38, three_byte_inst_0x3A
+	};
+	for (int map = 0; map < X86_MAP_COUNT; map++)
+		for (int opcode = 0; opcode < 256; opcode++)
+		{
+			const struct instruction_desc *desc = &maps[map][opcode];
+			for (int mandatory = 0; mandatory < 4; mandatory++)
+			{
+				if (desc->type != INST_TYPE_MANDATORY)
+					decode_table[map][opcode][mandatory] = desc;
+				else if (map == X86_MAP_ONE_BYTE) /* Mandatory prefixes only exist for escaped opcodes */
+					decode_table[map][opcode][mandatory] = &invalid_desc;
+				else
+					decode_table[map][opcode][mandatory] = &desc->extension_table[mandatory];
+			}
+		}
+	prefix_table[0xF0] = PREFIX_LOCK;
+	prefix_table[0xF3] = PREFIX_REP;
+	prefix_table[0xF2] = PREFIX_REPNE;
+	prefix_table[0x2E] = PREFIX_SEGMENT;
+	prefix_table[0x36] = PREFIX_SEGMENT;
+	prefix_table[0x3E] = PREFIX_SEGMENT;
+	prefix_table[0x26] = PREFIX_SEGMENT;
+	prefix_table[0x64] = PREFIX_SEGMENT;
+	prefix_table[0x65] = PREFIX_SEGMENT;
+	prefix_table[0x66] = PREFIX_OPSIZE;
+	prefix_table[0x67] = PREFIX_ADDRSIZE;
+	init_length_tables();
+}
+
+const struct instruction_desc *x86_decoder_lookup(int map, uint8_t opcode, int mandatory)
+{
+	return decode_table[map][opcode][mandatory];
+}
+
+/* VEX encoded instructions (AVX, AVX2, FMA, F16C, BMI) are not tabulated
+ * None of them change control flow, so a generic descriptor is enough.
+ */
+void x86_decoder_vex_desc(int map, uint8_t opcode, int vvvv, struct instruction_desc *desc)
+{
+	memset(desc, 0, sizeof(struct instruction_desc));
+	if (map < X86_MAP_0F || map > X86_MAP_0F3A)
+	{
+		desc->type = INST_TYPE_INVALID;
+		return;
+	}
+	desc->type = INST_TYPE_NORMAL;
+	/* VZEROUPPER/VZEROALL is the only VEX instruction without ModR/M */
+	desc->has_modrm = !(map == X86_MAP_0F && opcode == 0x77);
+	if (map == X86_MAP_0F3A)
+		desc->imm_bytes = 1;
+	else if (map == X86_MAP_0F && ((opcode >= 0x70 && opcode <= 0x73) || (opcode >= 0xC4 && opcode <= 0xC6) || opcode == 0xC2))
+		desc->imm_bytes = 1;
+	/* vvvv may name a general purpose register (BMI) */
+	desc->read_regs = MODRM_R | MODRM_RM | REG_MASK(vvvv & 7);
+	desc->write_regs = MODRM_R | MODRM_RM;
+	if (map == X86_MAP_0F38)
+	{
+		/* BLSR/BLSMSK/BLSI and MULX write their (low) result to vvvv */
+		if (opcode == 0xF3 || opcode == 0xF6)
+			desc->write_regs |= REG_MASK(vvvv & 7);
+		/* MULX multiplies by EDX implicitly */
+		if (opcode == 0xF6)
+			desc->read_regs |= REG_DX;
+	}
+}
+
+/* Base and index registers of 16-bit ModR/M addressing, indexed by R/M field */
+static const int8_t modrm16_base[8] = { 3, 3, 5, 5, 6, 7, 5, 3 }; /* BX, BX, BP, BP, SI, DI, BP, BX */
+static const int8_t modrm16_index[8] = { 6, 7, 6, 7, -1, -1, -1, -1 }; /* SI, DI, SI, DI */
+
+static uint32_t resolve_regs(int mask, const struct x86_instruction *ins)
+{
+	uint32_t regs = mask & 0xFFFF;
+	if ((mask & MODRM_R) && ins->r >= 0)
+		regs |= REG_MASK(ins->r);
+	if (ins->is_memory)
+	{
+		if (mask & MODRM_RM_M)
+			regs |= MODRM_RM_M;
+	}
+	else if ((mask & MODRM_RM_R) && ins->base >= 0)
+		regs |= REG_MASK(ins->base);
+	return regs;
+}
+
+#define NEED(n) do { if (end - code < (n)) return 0; } while (0)
+
+int x86_decode(const uint8_t *code, size_t size, struct x86_instruction *ins)
+{
+	const uint8_t *start = code;
+	const uint8_t *end = code + (size < X86_MAX_INSTRUCTION_LENGTH? size: X86_MAX_INSTRUCTION_LENGTH);
+	struct instruction_desc vex_desc;
+	const struct instruction_desc *desc;
+	int rep_prefix = 0;
+
+	ins->length = 0;
+	ins->type = INST_TYPE_INVALID;
+	ins->prefixes = 0;
+	ins->segment = 0;
+	ins->map = X86_MAP_ONE_BYTE;
+	ins->r = -1;
+	ins->base = -1;
+	ins->index = -1;
+	ins->scale = 0;
+	ins->is_memory = 0;
+	ins->disp = 0;
+
+	/* Prefixes */
+	NEED(1);
+	while (prefix_table[*code] != PREFIX_NONE)
+	{
+		switch (prefix_table[*code])
+		{
+		case PREFIX_LOCK: ins->prefixes |= X86_PREFIX_LOCK; break;
+		case PREFIX_REP: rep_prefix = 0xF3; break;
+		case PREFIX_REPNE: rep_prefix = 0xF2; break;
+		case PREFIX_SEGMENT: ins->segment = *code; break;
+		case PREFIX_OPSIZE: ins->prefixes |= X86_PREFIX_OPERAND_SIZE; break;
+		case PREFIX_ADDRSIZE: ins->prefixes |= X86_PREFIX_ADDRESS_SIZE; break;
+		}
+		code++;
+		NEED(1);
+	}
+	ins->opcode = *code++;
+	if (rep_prefix == 0xF3)
+		ins->prefixes |= X86_PREFIX_REP;
+	else if (rep_prefix == 0xF2)
+		ins->prefixes |= X86_PREFIX_REPNE;
+
+	/* Opcode */
+	if ((ins->opcode == 0xC4 || ins->opcode == 0xC5) && code < end && GET_MODRM_MOD(*code) == 3)
+	{
+		/* VEX, in 32-bit mode distinguished from LES/LDS by ModR/M.mod == 3 */
+		int map, vvvv;
+		uint8_t vex1 = *code++;
+		if (ins->opcode == 0xC5)
+		{
+			map = X86_MAP_0F;
+			vvvv = (~vex1 >> 3) & 0x0F;
+		}
+		else
+		{
+			NEED(1);
+			uint8_t vex2 = *code++;
+			map = vex1 & 0x1F;
+			vvvv = (~vex2 >> 3) & 0x0F;
+		}
+		NEED(1);
+		ins->opcode = *code++;
+		ins->map = map;
+		ins->prefixes |= X86_PREFIX_VEX;
+		x86_decoder_vex_desc(map, ins->opcode, vvvv, &vex_desc);
+		desc = &vex_desc;
+	}
+	else
+	{
+		if (ins->opcode == 0x0F)
+		{
+			NEED(1);
+			ins->opcode = *code++;
+			ins->map = X86_MAP_0F;
+			if (ins->opcode == 0x38 || ins->opcode == 0x3A)
+			{
+				ins->map = ins->opcode == 0x38? X86_MAP_0F38: X86_MAP_0F3A;
+				NEED(1);
+				ins->opcode = *code++;
+			}
+		}
+		int mandatory = (ins->prefixes & X86_PREFIX_OPERAND_SIZE)? MANDATORY_0x66
+			: rep_prefix == 0xF3? MANDATORY_0xF3
+			: rep_prefix == 0xF2? MANDATORY_0xF2
+			: MANDATORY_NONE;
+		desc = decode_table[ins->map][ins->opcode][mandatory];
+	}
+
+	if (desc->type == INST_TYPE_X87)
+	{
+		NEED(1);
+		if (GET_MODRM_MOD(*code) == 3)
+		{
+			/* A non-operand opcode */
+			ins->base = GET_MODRM_RM(*code);
+			code++;
+			ins->type = INST_TYPE_NORMAL;
+			ins->imm_offset = 0;
+			ins->imm_bytes = 0;
+			ins->read_regs = 0;
+			ins->write_regs = 0;
+			ins->length = (uint8_t)(code - start);
+			return ins->length;
+		}
+		desc = &x87_desc;
+	}
+
+	/* ModR/M */
+	if (desc->has_modrm)
+	{
+		NEED(1);
+		uint8_t modrm = *code++;
+		int mod = GET_MODRM_MOD(modrm);
+		int rm = GET_MODRM_RM(modrm);
+		ins->r = GET_MODRM_R(modrm);
+		if (mod == 3)
+			ins->base = rm;
+		else if (ins->prefixes & X86_PREFIX_ADDRESS_SIZE)
+		{
+			/* 16-bit addressing */
+			ins->is_memory = 1;
+			if (mod == 0 && rm == 6)
+			{
+				NEED(2);
+				ins->disp = (int16_t)(code[0] | (code[1] << 8));
+				code += 2;
+			}
+			else
+			{
+				ins->base = modrm16_base[rm];
+				ins->index = modrm16_index[rm];
+				if (mod == 1)
+				{
+					NEED(1);
+					ins->disp = (int8_t)*code++;
+				}
+				else if (mod == 2)
+				{
+					NEED(2);
+					ins->disp = (int16_t)(code[0] | (code[1] << 8));
+					code += 2;
+				}
+			}
+		}
+		else
+		{
+			ins->is_memory = 1;
+			if (rm == 4)
+			{
+				/* ModR/M with SIB byte */
+				NEED(1);
+				uint8_t sib = *code++;
+				ins->scale = GET_SIB_SCALE(sib);
+				if (GET_SIB_INDEX(sib) != 4)
+					ins->index = GET_SIB_INDEX(sib);
+				if (GET_SIB_BASE(sib) == 5 && mod == 0)
+					mod = 2; /* disp32 without base */
+				else
+					ins->base = GET_SIB_BASE(sib);
+			}
+			else if (mod == 0 && rm == 5)
+				mod = 2; /* disp32 without base */
+			else
+				ins->base = rm;
+			if (mod == 1)
+			{
+				NEED(1);
+				ins->disp = (int8_t)*code++;
+			}
+			else if (mod == 2)
+			{
+				NEED(4);
+				memcpy(&ins->disp, code, 4);
+				code += 4;
+			}
+		}
+		if (desc->type == INST_TYPE_EXTENSION)
+			desc = &desc->extension_table[ins->r];
+	}
+
+	switch (desc->type)
+	{
+	case INST_TYPE_UNKNOWN:
+	case INST_TYPE_INVALID:
+	case INST_TYPE_UNSUPPORTED:
+	case INST_TYPE_EXTENSION:
+	case INST_TYPE_MANDATORY:
+	case INST_TYPE_X87:
+		return 0;
+	}
+	if (desc->require_0x66 && !(ins->prefixes & X86_PREFIX_OPERAND_SIZE))
+		return 0;
+
+	/* Immediate */
+	int imm_bytes = desc->imm_bytes;
+	if (imm_bytes == PREFIX_OPERAND_SIZE)
+		imm_bytes = (ins->prefixes & X86_PREFIX_OPERAND_SIZE)? 2: 4;
+	else if (imm_bytes == PREFIX_ADDRESS_SIZE)
+		imm_bytes = (ins->prefixes & X86_PREFIX_ADDRESS_SIZE)? 2: 4;
+	NEED(imm_bytes);
+	ins->imm_offset = (uint8_t)(code - start);
+	ins->imm_bytes = (uint8_t)imm_bytes;
+	code += imm_bytes;
+
+	/* Register usage */
+	ins->type = desc->type;
+	ins->read_regs = resolve_regs(desc->read_regs, ins);
+	ins->write_regs = resolve_regs(desc->write_regs, ins);
+	if (ins->is_memory)
+	{
+		if (ins->base >= 0)
+			ins->read_regs |= REG_MASK(ins->base);
+		if (ins->index >= 0)
+			ins->read_regs |= REG_MASK(ins->index);
+	}
+	if (rep_prefix)
+	{
+		ins->read_regs |= REG_CX;
+		ins->write_regs |= REG_CX;
+	}
+	ins->length = (uint8_t)(code - start);
+	return ins->length;
+}
+
+size_t x86_decode_bulk(const uint8_t *code, size_t size, struct x86_instruction *ins, size_t count, size_t *decoded_bytes)
+{
+	size_t offset = 0, n = 0;
+	while (n < count && offset < size)
+	{
+		if (x86_decode(code + offset, size - offset, &ins[n]))
+			offset += ins[n].length;
+		else
+			offset++; /* Skip the byte and resynchronize */
+		n++;
+	}
+	*decoded_bytes = offset;
+	return n;
+}
+
+static int decode_length_slow(const uint8_t *code, size_t size)
+{
+	struct x86_instruction ins;
+	return x86_decode(code, size, &ins);
+}
+
+#define LENGTH_USE_SLOW		0xFF /* Returned by decode_length_fast() if x86_decode() must be used */
+
+/* Length of the instruction at code, at least 2 * X86_MAX_INSTRUCTION_LENGTH bytes must be readable
+ * Instructions longer than X86_MAX_INSTRUCTION_LENGTH are rejected at the end.
+ */
+static __inline int decode_length_fast(const uint8_t *code)
+{
+	const uint8_t *p = code;
+	int opsize = 0, rep_mandatory = MANDATORY_NONE;
+	uint8_t prefix;
+	while ((prefix = prefix_table[*p]) != PREFIX_NONE)
+	{
+		if (prefix == PREFIX_OPSIZE)
+			opsize = 1;
+		else if (prefix == PREFIX_REP)
+			rep_mandatory = MANDATORY_0xF3;
+		else if (prefix == PREFIX_REPNE)
+			rep_mandatory = MANDATORY_0xF2;
+		else if (prefix == PREFIX_ADDRSIZE)
+			return LENGTH_USE_SLOW; /* 16-bit addressing */
+		if (++p - code == X86_MAX_INSTRUCTION_LENGTH)
+			return 0;
+	}
+	int map = X86_MAP_ONE_BYTE;
+	uint8_t opcode = *p++;
+	if (opcode == 0x0F)
+	{
+		opcode = *p++;
+		map = X86_MAP_0F;
+		if (opcode == 0x38 || opcode == 0x3A)
+		{
+			map = opcode == 0x38? X86_MAP_0F38: X86_MAP_0F3A;
+			opcode = *p++;
+		}
+	}
+	uint16_t info = length_table[map][opcode][opsize? MANDATORY_0x66: rep_mandatory];
+	if (info & (LENGTH_INVALID | LENGTH_EXTENSION | LENGTH_SLOW))
+	{
+		if (info & LENGTH_EXTENSION)
+			info = extension_length_table[info >> LENGTH_EXTENSION_SHIFT][GET_MODRM_R(*p)] | LENGTH_MODRM;
+		if (info & LENGTH_SLOW)
+			return LENGTH_USE_SLOW;
+		if (info & LENGTH_INVALID)
+			return 0;
+	}
+	/* ModR/M, SIB and displacement, computed without branches as they are hard to predict
+	 * Reading the bytes is safe even if there is no ModR/M byte */
+	int has_modrm = (info & LENGTH_MODRM) != 0;
+	uint8_t modrm = p[0];
+	int nobase = modrm32_sib_nobase[modrm] & (GET_SIB_BASE(p[1]) == 5);
+	p += (1 + modrm32_length[modrm] + 4 * nobase) & -has_modrm;
+	p += info & LENGTH_IMM_MASK;
+	int length = (int)(p - code);
+	return length <= X86_MAX_INSTRUCTION_LENGTH? length: 0;
+}
+
+int x86_decode_length(const uint8_t *code, size_t size)
+{
+	if (size < 2 * X86_MAX_INSTRUCTION_LENGTH)
+		return decode_length_slow(code, size);
+	int length = decode_length_fast(code);
+	return length == LENGTH_USE_SLOW? decode_length_slow(code, size): length;
+}
+
+size_t x86_decode_lengths(const uint8_t *code, size_t size, uint8_t *lengths, size_t count, size_t *decoded_bytes)
+{
+	size_t offset = 0, n = 0;
+	while (n < count && offset < size)
+	{
+		int length = x86_decode_length(code + offset, size - offset);
+		lengths[n++] = (uint8_t)length;
+		offset += length? length: 1; /* Skip the byte and resynchronize */
+	}
+	*decoded_bytes = offset;
+	return n;
+}
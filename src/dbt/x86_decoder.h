@@ -0,0 +1,197 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* x86 instruction decoder
+ *
+ * Decodes instruction length, operands and register usage from the
+ * instruction description tables in x86_inst.h. This is used by the
+ * translator and is kept free of any flinux dependencies so it can also be
+ * built standalone (see dbtbench/src/decodebench.c).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GET_MODRM_MOD(c)	(((c) >> 6) & 7)
+#define GET_MODRM_R(c)		(((c) >> 3) & 7)
+#define GET_MODRM_RM(c)		((c) & 7)
+#define GET_MODRM_CODE(c)	GET_MODRM_R(c)
+
+#define GET_SIB_SCALE(s)	((s) >> 6)
+#define GET_SIB_INDEX(s)	(((s) >> 3) & 7)
+#define GET_SIB_BASE(s)		((s) & 7)
+
+/* Generic instruction types */
+#define INST_TYPE_UNKNOWN		0 /* Unknown/not implemented */
+#define INST_TYPE_INVALID		1 /* Invalid instruction */
+#define INST_TYPE_UNSUPPORTED	2 /* Unsupported instruction */
+#define INST_TYPE_EXTENSION		3 /* Opcode extension, use ModR/M R field to distinguish */
+#define INST_TYPE_MANDATORY		4 /* SIMD opcode, distinguished with a mandatory prefix (none, 0x66, 0xF3, 0xF2) */
+#define INST_TYPE_X87			5 /* An x87 escape code */
+#define INST_TYPE_NORMAL		6 /* Normal instruction which does not need special handling */
+
+/* Extension table indices for mandatory prefixes */
+#define MANDATORY_NONE			0
+#define MANDATORY_0x66			1
+#define MANDATORY_0xF3			2
+#define MANDATORY_0xF2			3
+
+/* Special instruction types */
+#define INST_TYPE_SPECIAL		7
+#define INST_MOV_MOFFSET		(INST_TYPE_SPECIAL + 0)
+#define INST_CALL_DIRECT		(INST_TYPE_SPECIAL + 1)
+#define INST_CALL_INDIRECT		(INST_TYPE_SPECIAL + 2)
+#define INST_RET				(INST_TYPE_SPECIAL + 3)
+#define INST_RETN				(INST_TYPE_SPECIAL + 4)
+#define INST_JMP_DIRECT			(INST_TYPE_SPECIAL + 5)
+#define INST_JMP_INDIRECT		(INST_TYPE_SPECIAL + 6)
+/* Jcc occupies 16 instruction types for each condition code */
+#define INST_JCC				(INST_TYPE_SPECIAL + 7)
+#define GET_JCC_COND(type)		((type) - INST_JCC)
+#define INST_JCC_REL8			(INST_TYPE_SPECIAL + 23)
+#define INST_INT				(INST_TYPE_SPECIAL + 24)
+#define INST_MOV_FROM_SEG		(INST_TYPE_SPECIAL + 25)
+#define INST_MOV_TO_SEG			(INST_TYPE_SPECIAL + 26)
+#define INST_CPUID				(INST_TYPE_SPECIAL + 27)
+
+#define REG_AX			0x00000001 /* AL, AH, AX, EAX, RAX register */
+#define REG_CX			0x00000002 /* CL, CH, CX, ECX, RCX register */
+#define REG_DX			0x00000004 /* DL, DH, DX, EDX, RDX register */
+#define REG_BX			0x00000008 /* BL, BH, BX, EBX, RBX register */
+#define REG_SP			0x00000010 /* SPL, SP, ESP, RSP register */
+#define REG_BP			0x00000020 /* BPL, BP, EBP, RBP register */
+#define REG_SI			0x00000040 /* SIL, SI, ESI, RSI register */
+#define REG_DI			0x00000080 /* DIL, DI, EDI, RDI register */
+#define REG_R8			0x00000100 /* R8L, R8W, R8D, R8 register */
+#define REG_R9			0x00000200 /* R9L, R9W, R9D, R9 register */
+#define REG_R10			0x00000400 /* R10L, R10W, R10D, R10 register */
+#define REG_R11			0x00000800 /* R11L, R11W, R11D, R11 register */
+#define REG_R12			0x00001000 /* R12L, R12W, R12D, R12 register */
+#define REG_R13			0x00002000 /* R13L, R13W, R13D, R13 register */
+#define REG_R14			0x00004000 /* R14L, R14W, R14D, R14 register */
+#define REG_R15			0x00008000 /* R15L, R15W, R15D, R15 register */
+#define REG_MASK(r)		(1 << (r)) /* Generate a mask from a numeric register id */
+#define MODRM_R			0x01000000 /* R field of ModR/M */
+#define MODRM_RM_R		0x02000000 /* Register type of ModR/M R/M field */
+#define MODRM_RM_M		0x04000000 /* Memory type of ModR/M R/M field */
+#define MODRM_RM		MODRM_RM_R | MODRM_RM_M /* R/M field of ModR/M */
+
+#define PREFIX_OPERAND_SIZE		9 /* Indicate imm_bytes is 2 or 4 bytes depends on operand size prefix */
+#ifdef _WIN64
+#define PREFIX_OPERAND_SIZE_64	10 /* Indicate imm_bytes is 2 or 4 or 8 bytes depends on operand size prefix */
+#else
+#define PREFIX_OPERAND_SIZE_64	PREFIX_OPERAND_SIZE /* Not supported on x86 */
+#endif
+#define PREFIX_ADDRESS_SIZE		11 /* Indicate imm_bytes is 2 or 4 or 8 bytes depends on address size prefix */
+#define PREFIX_ADDRESS_SIZE_64	PREFIX_ADDRESS_SIZE /* Indicate imm_bytes is 2 or 4 or 8 bytes depends on address size prefix */
+struct instruction_desc
+{
+	int type:8; /* Instruction type */
+	int has_modrm:1; /* Whether the instruction has ModR/M opcode */
+	int require_0x66:1; /* Whether the instruction requires a mandatory 0x66 prefix */
+	int is_privileged:1; /* Whether the instruction is a privileged instruction */
+	uint8_t imm_bytes:4; /* Bytes of immediate, 1, 2, 4, 8, or PREFIX_xxx_SIZE */
+	union
+	{
+		struct
+		{
+			int read_regs; /* The bitmask of registers which are read from */
+			int write_regs; /* The bitmask of registers which are written to */
+		};
+		const struct instruction_desc *extension_table; /* Secondary lookup table for INST_TYPE_EXTENSION */
+	};
+};
+
+/* Opcode maps */
+#define X86_MAP_ONE_BYTE		0 /* No escape */
+#define X86_MAP_0F				1 /* 0F xx */
+#define X86_MAP_0F38			2 /* 0F 38 xx */
+#define X86_MAP_0F3A			3 /* 0F 3A xx */
+#define X86_MAP_COUNT			4
+
+/* Prefix flags of a decoded instruction */
+#define X86_PREFIX_LOCK			0x01
+#define X86_PREFIX_REP			0x02 /* F3 */
+#define X86_PREFIX_REPNE		0x04 /* F2 */
+#define X86_PREFIX_OPERAND_SIZE	0x08 /* 66 */
+#define X86_PREFIX_ADDRESS_SIZE	0x10 /* 67 */
+#define X86_PREFIX_VEX			0x20 /* C4/C5 */
+
+/* Maximum length of an x86 instruction */
+#define X86_MAX_INSTRUCTION_LENGTH	15
+
+/* A decoded instruction
+ * read_regs and write_regs are resolved to REG_xxx masks of the general purpose
+ * registers actually used; MODRM_RM_M is kept if the instruction reads from or
+ * writes to its memory operand. Address registers count as read registers.
+ */
+struct x86_instruction
+{
+	uint8_t length; /* Total length in bytes, 0 if the instruction cannot be decoded */
+	uint8_t opcode; /* Opcode byte in its map */
+	uint8_t map; /* X86_MAP_xxx */
+	uint8_t prefixes; /* X86_PREFIX_xxx flags */
+	uint8_t segment; /* Segment override prefix byte, 0 if none */
+	uint8_t type; /* INST_xxx */
+	uint8_t imm_offset; /* Offset of the immediate, if any */
+	uint8_t imm_bytes; /* Bytes of immediate */
+	int8_t r; /* ModR/M R field, -1 if no ModR/M */
+	int8_t base; /* Base register or register operand, -1 if none */
+	int8_t index; /* Index register, -1 if none */
+	uint8_t scale; /* SIB scale (log2) */
+	uint8_t is_memory; /* Whether R/M refers to memory */
+	int32_t disp; /* Displacement of memory operand */
+	uint32_t read_regs; /* Registers read from */
+	uint32_t write_regs; /* Registers written to */
+};
+
+/* Initialize the flat opcode lookup table, must be called before any other functions */
+void x86_decoder_init();
+
+/* Look up the descriptor of an opcode, with mandatory prefixes (MANDATORY_xxx) resolved
+ * ModR/M extensions (INST_TYPE_EXTENSION) are not resolved since they depend on the ModR/M byte
+ */
+const struct instruction_desc *x86_decoder_lookup(int map, uint8_t opcode, int mandatory);
+
+/* Build the descriptor of a VEX encoded instruction, vvvv is the decoded (not inverted) register */
+void x86_decoder_vex_desc(int map, uint8_t opcode, int vvvv, struct instruction_desc *desc);
+
+/* Descriptor for x87 escape opcodes with a memory operand */
+extern struct instruction_desc x87_desc;
+
+/* Decode one instruction at code, at most size bytes are read
+ * Returns the length of the instruction, or 0 if it is invalid, unsupported or truncated
+ */
+int x86_decode(const uint8_t *code, size_t size, struct x86_instruction *ins);
+
+/* Decode consecutive instructions in [code, code + size) into ins[0..count)
+ * An undecodable byte is stored as an instruction with length 0 and skipped.
+ * Returns the number of instructions stored, *decoded_bytes receives the number of bytes consumed.
+ */
+size_t x86_decode_bulk(const uint8_t *code, size_t size, struct x86_instruction *ins, size_t count, size_t *decoded_bytes);
+
+/* Decode only the length of one instruction, the result always equals what x86_decode() returns
+ * Common opcodes are decoded from a compact length table without filling a struct x86_instruction.
+ */
+int x86_decode_length(const uint8_t *code, size_t size);
+
+/* Length only counterpart of x86_decode_bulk(), lengths[i] receives the length of each instruction */
+size_t x86_decode_lengths(const uint8_t *code, size_t size, uint8_t *lengths, size_t count, size_t *decoded_bytes);
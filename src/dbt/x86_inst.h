@@ -18,88 +18,8 @@
  */
 
 /* Instruction description tables */
-#include <stdint.h>
+#include <dbt/x86_decoder.h>
 
-/* Generic instruction types */
-#define INST_TYPE_UNKNOWN		0 /* Unknown/not implemented */
-#define INST_TYPE_INVALID		1 /* Invalid instruction */
-#define INST_TYPE_UNSUPPORTED	2 /* Unsupported instruction */
-#define INST_TYPE_EXTENSION		3 /* Opcode extension, use ModR/M R field to distinguish */
-#define INST_TYPE_MANDATORY		4 /* SIMD opcode, distinguished with a mandatory prefix (none, 0x66, 0xF3, 0xF2) */
-#define INST_TYPE_X87			5 /* An x87 escape code */
-#define INST_TYPE_NORMAL		6 /* Normal instruction which does not need special handling */
-
-/* Extension table indices for mandatory prefixes */
-#define MANDATORY_NONE			0
-#define MANDATORY_0x66			1
-#define MANDATORY_0xF3			2
-#define MANDATORY_0xF2			3
-
-/* Special instruction types */
-#define INST_TYPE_SPECIAL		7
-#define INST_MOV_MOFFSET		(INST_TYPE_SPECIAL + 0)
-#define INST_CALL_DIRECT		(INST_TYPE_SPECIAL + 1)
-#define INST_CALL_INDIRECT		(INST_TYPE_SPECIAL + 2)
-#define INST_RET				(INST_TYPE_SPECIAL + 3)
-#define INST_RETN				(INST_TYPE_SPECIAL + 4)
-#define INST_JMP_DIRECT			(INST_TYPE_SPECIAL + 5)
-#define INST_JMP_INDIRECT		(INST_TYPE_SPECIAL + 6)
-/* Jcc occupies 16 instruction types for each condition code */
-#define INST_JCC				(INST_TYPE_SPECIAL + 7)
-#define GET_JCC_COND(type)		((type) - INST_JCC)
-#define INST_JCC_REL8			(INST_TYPE_SPECIAL + 23)
-#define INST_INT				(INST_TYPE_SPECIAL + 24)
-#define INST_MOV_FROM_SEG		(INST_TYPE_SPECIAL + 25)
-#define INST_MOV_TO_SEG			(INST_TYPE_SPECIAL + 26)
-#define INST_CPUID				(INST_TYPE_SPECIAL + 27)
-
-#define REG_AX			0x00000001 /* AL, AH, AX, EAX, RAX register */
-#define REG_CX			0x00000002 /* CL, CH, CX, ECX, RCX register */
-#define REG_DX			0x00000004 /* DL, DH, DX, EDX, RDX register */
-#define REG_BX			0x00000008 /* BL, BH, BX, EBX, RBX register */
-#define REG_SP			0x00000010 /* SPL, SP, ESP, RSP register */
-#define REG_BP			0x00000020 /* BPL, BP, EBP, RBP register */
-#define REG_SI			0x00000040 /* SIL, SI, ESI, RSI register */
-#define REG_DI			0x00000080 /* DIL, DI, EDI, RDI register */
-#define REG_R8			0x00000100 /* R8L, R8W, R8D, R8 register */
-#define REG_R9			0x00000200 /* R9L, R9W, R9D, R9 register */
-#define REG_R10			0x00000400 /* R10L, R10W, R10D, R10 register */
-#define REG_R11			0x00000800 /* R11L, R11W, R11D, R11 register */
-#define REG_R12			0x00001000 /* R12L, R12W, R12D, R12 register */
-#define REG_R13			0x00002000 /* R13L, R13W, R13D, R13 register */
-#define REG_R14			0x00004000 /* R14L, R14W, R14D, R14 register */
-#define REG_R15			0x00008000 /* R15L, R15W, R15D, R15 register */
-#define REG_MASK(r)		(1 << (r)) /* Generate a mask from a numeric register id */
-#define MODRM_R			0x01000000 /* R field of ModR/M */
-#define MODRM_RM_R		0x02000000 /* Register type of ModR/M R/M field */
-#define MODRM_RM_M		0x04000000 /* Memory type of ModR/M R/M field */
-#define MODRM_RM		MODRM_RM_R | MODRM_RM_M /* R/M field of ModR/M */
-
-#define PREFIX_OPERAND_SIZE		9 /* Indicate imm_bytes is 2 or 4 bytes depends on operand size prefix */
-#ifdef _WIN64
-#define PREFIX_OPERAND_SIZE_64	10 /* Indicate imm_bytes is 2 or 4 or 8 bytes depends on operand size prefix */
-#else
-#define PREFIX_OPERAND_SIZE_64	PREFIX_OPERAND_SIZE /* Not supported on x86 */
-#endif
-#define PREFIX_ADDRESS_SIZE		11 /* Indicate imm_bytes is 2 or 4 or 8 bytes depends on address size prefix */
-#define PREFIX_ADDRESS_SIZE_64	PREFIX_ADDRESS_SIZE /* Indicate imm_bytes is 2 or 4 or 8 bytes depends on address size prefix */
-struct instruction_desc
-{
-	int type:8; /* Instruction type */
-	int has_modrm:1; /* Whether the instruction has ModR/M opcode */
-	int require_0x66:1; /* Whether the instruction requires a mandatory 0x66 prefix */
-	int is_privileged:1; /* Whether the instruction is a privileged instruction */
-	uint8_t imm_bytes:4; /* Bytes of immediate, 1, 2, 4, 8, or PREFIX_xxx_SIZE */
-	union
-	{
-		struct
-		{
-			int read_regs; /* The bitmask of registers which are read from */
-			int write_regs; /* The bitmask of registers which are written to */
-		};
-		const struct instruction_desc *extension_table; /* Secondary lookup table for INST_TYPE_EXTENSION */
-	};
-};
 #define UNKNOWN()		{ .type = INST_TYPE_UNKNOWN },
 #define INVALID()		{ .type = INST_TYPE_INVALID },
 #define UNSUPPORTED()	{ .type = INST_TYPE_UNSUPPORTED },
@@ -446,8 +366,8 @@ static const struct instruction_desc one_byte_inst[256] =
 	/* 0xC4: INVALID */ INVALID()
 	/* 0xC5: INVALID */ INVALID()
 #else
-	/* 0xC4: LES r?, m16:? */ UNSUPPORTED()
-	/* 0xC5: LDS r?, m16:? */ UNSUPPORTED()
+	/* 0xC4: LES r?, m16:? (3-byte VEX if ModR/M.mod == 3, see parse_vex()) */ UNSUPPORTED()
+	/* 0xC5: LDS r?, m16:? (2-byte VEX if ModR/M.mod == 3, see parse_vex()) */ UNSUPPORTED()
 #endif
 	/* 0xC6: */ EXTENSION(C6)
 	/* 0xC7: */ EXTENSION(C7)
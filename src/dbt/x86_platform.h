@@ -0,0 +1,99 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* Host platform services used by the translator core
+ *
+ * The code generation, block tables, sieve and trampolines only need a
+ * handful of things from the host: reserving and committing memory, reading
+ * and writing the per-thread kernel TLS slots, and a cycle counter. These go
+ * through this header.
+ *
+ * The rest of x86.c still uses Windows and flinux services directly: fork
+ * (VirtualAllocEx, WriteProcessMemory), signal delivery (thread contexts,
+ * NtQueryInformationThread), statistics (SRW locks), TLS slot lookup and the
+ * mm and signal subsystems. Hosting the translator elsewhere needs those
+ * moved behind this header too.
+ *
+ * On hosts other than Windows the services are only declared here and the
+ * host program implements them. dbtbench/src/translatebench.c does so to
+ * compile x86.c on x86-64 Linux and time translation.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Segment override prefix used by generated code to address kernel TLS slots */
+#define DBT_PLATFORM_TLS_PREFIX		0x64 /* fs */
+
+#ifdef _WIN32
+
+#include <intrin.h>
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+/* Reserve address space, no memory is committed */
+static __forceinline void *dbt_platform_reserve(size_t size, bool executable)
+{
+	return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_TOP_DOWN, executable? PAGE_EXECUTE_READWRITE: PAGE_READWRITE);
+}
+
+/* Commit memory in a previously reserved region */
+static __forceinline bool dbt_platform_commit(void *addr, size_t size, bool executable)
+{
+	return VirtualAlloc(addr, size, MEM_COMMIT, executable? PAGE_EXECUTE_READWRITE: PAGE_READWRITE) != NULL;
+}
+
+/* Reserve and commit memory */
+static __forceinline void *dbt_platform_alloc(size_t size, bool executable)
+{
+	return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, executable? PAGE_EXECUTE_READWRITE: PAGE_READWRITE);
+}
+
+/* Read a kernel TLS slot of current thread */
+static __forceinline uint32_t dbt_platform_read_tls(int offset)
+{
+	return __readfsdword(offset);
+}
+
+/* Write a kernel TLS slot of current thread */
+static __forceinline void dbt_platform_write_tls(int offset, uint32_t value)
+{
+	__writefsdword(offset, value);
+}
+
+/* Cycle counter for statistics */
+static __forceinline uint64_t dbt_platform_timestamp()
+{
+	return __rdtsc();
+}
+
+#else
+
+/* Other hosts: implemented by the host program */
+void *dbt_platform_reserve(size_t size, bool executable);
+bool dbt_platform_commit(void *addr, size_t size, bool executable);
+void *dbt_platform_alloc(size_t size, bool executable);
+uint32_t dbt_platform_read_tls(int offset);
+void dbt_platform_write_tls(int offset, uint32_t value);
+uint64_t dbt_platform_timestamp();
+
+#endif
@@ -86,6 +86,26 @@ dbt_sieve_fallback PROC
 	jmp dword ptr [dbt_return_trampoline]
 dbt_sieve_fallback ENDP
 
+EXTERN dbt_find_next_return:NEAR
+dbt_return_fallback PROC
+	; stack: address
+	; stack: ecx
+	push eax
+	push edx
+	pushfd
+	mov ecx, [esp+4*4] ; original address
+	push ecx
+	call dbt_find_next_return
+	lea esp, [esp+4]
+	; restore context
+	popfd
+	pop edx
+	pop eax
+	pop ecx
+	lea esp, [esp+4]
+	jmp dword ptr [dbt_return_trampoline]
+dbt_return_fallback ENDP
+
 ; TODO: Return through return trampoline
 EXTERN dbt_cpuid:NEAR
 dbt_cpuid_internal PROC
@@ -180,18 +200,53 @@ out_of_range:
 syscall_handler ENDP
 
 ; TODO: Thread safety
+EXTERN dbt_xsave_mask:DWORD
 dbt_save_simd_state PROC
-	fxsave dbt_simd_state
+	push eax
+	push ecx
+	push edx
+	; XSAVE area must be 64 byte aligned
+	lea ecx, dbt_simd_state + 63
+	and ecx, -64
+	mov eax, dbt_xsave_mask
+	test eax, eax
+	jz save_fxsave
+	xor edx, edx
+	xsave [ecx]
+	jmp save_done
+save_fxsave:
+	fxsave [ecx]
+save_done:
+	pop edx
+	pop ecx
+	pop eax
 	ret
 dbt_save_simd_state ENDP
 
 dbt_restore_simd_state PROC
-	fxrstor dbt_simd_state
+	push eax
+	push ecx
+	push edx
+	lea ecx, dbt_simd_state + 63
+	and ecx, -64
+	mov eax, dbt_xsave_mask
+	test eax, eax
+	jz restore_fxrstor
+	xor edx, edx
+	xrstor [ecx]
+	jmp restore_done
+restore_fxrstor:
+	fxrstor [ecx]
+restore_done:
+	pop edx
+	pop ecx
+	pop eax
 	ret
 dbt_restore_simd_state ENDP
 
 .data
 
-dbt_simd_state DB 512 DUP(?)
+; Large enough for x87, SSE and AVX states, plus alignment
+dbt_simd_state DB 1024 + 64 DUP(?)
 
 END
@@ -45,6 +45,8 @@ struct file_ops
 	size_t (*write)(struct file *f, const void *buf, size_t count);
 	size_t (*pread)(struct file *f, void *buf, size_t count, loff_t offset);
 	size_t (*pwrite)(struct file *f, const void *buf, size_t count, loff_t offset);
+	HANDLE (*get_section)(struct file *f);
+	HANDLE (*get_shared_section)(struct file *f);
 	size_t (*readlink)(struct file *f, char *buf, size_t bufsize);
 	int (*truncate)(struct file *f, loff_t length);
 	int (*fsync)(struct file *f);
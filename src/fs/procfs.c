@@ -20,8 +20,10 @@
 #include <common/errno.h>
 #include <common/param.h>
 #include <dbt/cpuid.h>
+#include <dbt/x86.h>
 #include <fs/procfs.h>
 #include <fs/virtual.h>
+#include <syscall/mm.h>
 #include <syscall/process.h>
 #include <datetime.h>
 #include <log.h>
@@ -30,6 +32,7 @@
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <Psapi.h>
 
 static int proc_stat_gettext(int tag, char *buf)
 {
@@ -38,11 +41,35 @@ static int proc_stat_gettext(int tag, char *buf)
 
 static struct virtualfs_text_desc proc_stat_desc = VIRTUALFS_TEXT(proc_stat_gettext);
 
+static int proc_status_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_STATUS, buf);
+}
+
+static struct virtualfs_text_desc proc_status_desc = VIRTUALFS_TEXT(proc_status_gettext);
+
+static int proc_maps_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_MAPS, buf);
+}
+
+static struct virtualfs_text_desc proc_maps_desc = VIRTUALFS_TEXT(proc_maps_gettext);
+
+static int proc_smaps_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_SMAPS, buf);
+}
+
+static struct virtualfs_text_desc proc_smaps_desc = VIRTUALFS_TEXT(proc_smaps_gettext);
+
 struct virtualfs_directory_desc proc_pid_desc =
 {
 	.type = VIRTUALFS_TYPE_DIRECTORY,
 	.entries = {
+		VIRTUALFS_ENTRY("maps", proc_maps_desc)
+		VIRTUALFS_ENTRY("smaps", proc_smaps_desc)
 		VIRTUALFS_ENTRY("stat", proc_stat_desc)
+		VIRTUALFS_ENTRY("status", proc_status_desc)
 		VIRTUALFS_ENTRY_END()
 	}
 };
@@ -222,18 +249,27 @@ static int meminfo_gettext(int tag, char *buf)
 	MEMORYSTATUSEX memory;
 	memory.dwLength = sizeof(memory);
 	GlobalMemoryStatusEx(&memory);
+	/* Available memory of Windows includes the standby cache, which Linux does not count as free */
+	PERFORMANCE_INFORMATION performance;
+	unsigned long long cached = 0;
+	if (GetPerformanceInfo(&performance, sizeof(performance)))
+		cached = min((unsigned long long)performance.SystemCache * performance.PageSize, memory.ullAvailPhys);
 	return ksprintf(buf,
-		"MemTotal:  %13llu kB\n"
-		"MemFree:   %13llu kB\n"
-		"HighTotal: %13llu kB\n"
-		"HighFree:  %13llu kB\n"
-		"LowTotal:  %13llu kB\n"
-		"LowFree:   %13llu kB\n"
-		"SwapTotal: %13llu kB\n"
-		"SwapFree:  %13llu kB\n",
-		memory.ullTotalPhys / 1024ULL, memory.ullAvailPhys / 1024ULL,
+		"MemTotal:     %13llu kB\n"
+		"MemFree:      %13llu kB\n"
+		"MemAvailable: %13llu kB\n"
+		"Cached:       %13llu kB\n"
+		"HighTotal:    %13llu kB\n"
+		"HighFree:     %13llu kB\n"
+		"LowTotal:     %13llu kB\n"
+		"LowFree:      %13llu kB\n"
+		"SwapTotal:    %13llu kB\n"
+		"SwapFree:     %13llu kB\n",
+		memory.ullTotalPhys / 1024ULL, (memory.ullAvailPhys - cached) / 1024ULL,
+		memory.ullAvailPhys / 1024ULL,
+		cached / 1024ULL,
 		0ULL, 0ULL,
-		memory.ullTotalPhys / 1024ULL, memory.ullAvailPhys / 1024ULL,
+		memory.ullTotalPhys / 1024ULL, (memory.ullAvailPhys - cached) / 1024ULL,
 		memory.ullTotalPageFile / 1024ULL, memory.ullAvailPageFile / 1024ULL);
 }
 
@@ -257,6 +293,82 @@ static int uptime_gettext(int tag, char *buf)
 
 static struct virtualfs_text_desc uptime_desc = VIRTUALFS_TEXT(uptime_gettext);
 
+static int flinux_dbt_process_gettext(int tag, char *buf)
+{
+	return dbt_get_process_stats(buf);
+}
+
+static struct virtualfs_text_desc flinux_dbt_process_desc = VIRTUALFS_TEXT(flinux_dbt_process_gettext);
+
+static int flinux_dbt_threads_gettext(int tag, char *buf)
+{
+	return dbt_get_thread_stats(buf, VIRTUALFS_TEXT_MAX_SIZE);
+}
+
+static struct virtualfs_text_desc flinux_dbt_threads_desc = VIRTUALFS_TEXT(flinux_dbt_threads_gettext);
+
+static struct virtualfs_directory_desc flinux_dbt_desc =
+{
+	.type = VIRTUALFS_TYPE_DIRECTORY,
+	.entries = {
+		VIRTUALFS_ENTRY("process", flinux_dbt_process_desc)
+		VIRTUALFS_ENTRY("threads", flinux_dbt_threads_desc)
+		VIRTUALFS_ENTRY_END()
+	}
+};
+
+static int flinux_mm_stats_gettext(int tag, char *buf)
+{
+	return mm_get_stats(buf);
+}
+
+static struct virtualfs_text_desc flinux_mm_stats_desc = VIRTUALFS_TEXT(flinux_mm_stats_gettext);
+
+static unsigned int flinux_mm_fault_around_get(int tag)
+{
+	return mm_get_fault_around();
+}
+
+static void flinux_mm_fault_around_set(int tag, unsigned int value)
+{
+	mm_set_fault_around(value);
+}
+
+static struct virtualfs_param_desc flinux_mm_fault_around_desc = VIRTUALFS_PARAM_UINT(flinux_mm_fault_around_get, flinux_mm_fault_around_set);
+
+static unsigned int flinux_mm_hugepage_get(int tag)
+{
+	return mm_get_hugepage_mode();
+}
+
+static void flinux_mm_hugepage_set(int tag, unsigned int value)
+{
+	mm_set_hugepage_mode(value);
+}
+
+static struct virtualfs_param_desc flinux_mm_hugepage_desc = VIRTUALFS_PARAM_UINT(flinux_mm_hugepage_get, flinux_mm_hugepage_set);
+
+static struct virtualfs_directory_desc flinux_mm_desc =
+{
+	.type = VIRTUALFS_TYPE_DIRECTORY,
+	.entries = {
+		VIRTUALFS_ENTRY("stats", flinux_mm_stats_desc)
+		VIRTUALFS_ENTRY("fault_around", flinux_mm_fault_around_desc)
+		VIRTUALFS_ENTRY("hugepage", flinux_mm_hugepage_desc)
+		VIRTUALFS_ENTRY_END()
+	}
+};
+
+static struct virtualfs_directory_desc flinux_desc =
+{
+	.type = VIRTUALFS_TYPE_DIRECTORY,
+	.entries = {
+		VIRTUALFS_ENTRY("dbt", flinux_dbt_desc)
+		VIRTUALFS_ENTRY("mm", flinux_mm_desc)
+		VIRTUALFS_ENTRY_END()
+	}
+};
+
 static const struct virtualfs_directory_desc procfs =
 {
 	.type = VIRTUALFS_TYPE_DIRECTORY,
@@ -265,6 +377,7 @@ static const struct virtualfs_directory_desc procfs =
 		VIRTUALFS_ENTRY("self", proc_pid_desc)
 		VIRTUALFS_ENTRY("stat", stat_desc)
 		VIRTUALFS_ENTRY("sys", sys_desc)
+		VIRTUALFS_ENTRY("flinux", flinux_desc)
 		VIRTUALFS_ENTRY("cpuinfo", cpuinfo_desc)
 		VIRTUALFS_ENTRY("loadavg", loadavg_desc)
 		VIRTUALFS_ENTRY("meminfo", meminfo_desc)
@@ -0,0 +1,1043 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <common/dirent.h>
+#include <common/errno.h>
+#include <common/fcntl.h>
+#include <common/fs.h>
+#include <common/mman.h>
+#include <common/shm.h>
+#include <fs/shm.h>
+#include <syscall/mm.h>
+#include <syscall/process.h>
+#include <syscall/syscall.h>
+#include <syscall/vfs.h>
+#include <datetime.h>
+#include <heap.h>
+#include <log.h>
+#include <str.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <limits.h>
+
+/* Shared memory objects: /dev/shm files, memfd_create() files and System V segments
+ *
+ * The content of an object lives in a pagefile backed section. MAP_SHARED mappings of an object
+ * map views of the section directly (see map_shm_block() in mm.c), so every attached process
+ * shares the same physical pages and nothing is ever copied. Forked children inherit the section
+ * handles and map the same views.
+ *
+ * Objects visible to all flinux processes (/dev/shm names and System V keys) are described in a
+ * table in the global shared area. Their sections are named after the object id. Windows destroys
+ * a section once no process holds a handle to it, thus an object loses its content when the last
+ * process which has it open, mapped or looked up exits. The object itself stays, with zeroed content.
+ * A section cannot grow, so it is created with SEC_RESERVE and room for SHM_RESERVE_SIZE bytes, of
+ * which only the 64kB rounded capacity of the object is committed. Growing commits more pages of the
+ * same section, which existing mappings in every process see at once. An object cannot grow beyond
+ * the reservation of its section.
+ */
+
+#define SHM_MAX_COUNT		128	/* Maximum number of named objects and segments in the system */
+#define SHM_MAX_ATTACH		64	/* Maximum number of attached System V segments per process */
+#define SHM_NAME_MAX		256
+#define SHM_ID_GENERATIONS	(INT_MAX / SHM_MAX_COUNT - 1)
+#define SHM_RESERVE_SIZE	0x10000000ULL /* Room of a section for growing in place, 256MB */
+#define SHM_COMMIT_CHUNK	0x01000000 /* Maximum size of a temporary view for committing a section */
+
+#define SHM_TYPE_FREE		0
+#define SHM_TYPE_POSIX		1	/* Named object in /dev/shm */
+#define SHM_TYPE_SYSV		2	/* System V segment */
+
+struct shm_object
+{
+	int type;
+	int id; /* Slot index plus a generation, never reused soon */
+	uint64_t size;
+	uint64_t capacity; /* Committed part of the section */
+	uint64_t reserve; /* Maximum size of the section */
+	/* System V segment information */
+	key_t key;
+	int removed; /* IPC_RMID done, freed on last detach */
+	int mode;
+	pid_t cpid, lpid;
+	int nattch;
+	uint64_t atime, dtime, ctime;
+	char name[SHM_NAME_MAX]; /* Name of a /dev/shm object */
+};
+
+struct shm_shared_data
+{
+	struct shm_object objects[SHM_MAX_COUNT];
+};
+
+struct shm_attach
+{
+	void *addr;
+	size_t size;
+	int id;
+};
+
+struct shm_data
+{
+	/* Mutex for shm_shared_data */
+	HANDLE mutex;
+	/* Sections of System V segments this process looked up, they keep the segments alive */
+	HANDLE segments[SHM_MAX_COUNT];
+	int segment_ids[SHM_MAX_COUNT];
+	struct shm_attach attaches[SHM_MAX_ATTACH];
+};
+
+static struct shm_shared_data *shm_shared;
+static struct shm_data *shm;
+
+static void shm_init_private()
+{
+	shm_shared = (struct shm_shared_data *)mm_global_shared_alloc(sizeof(struct shm_shared_data));
+	shm->mutex = CreateMutexW(NULL, FALSE, L"flinux_shm_mutex");
+}
+
+void shm_init()
+{
+	shm = (struct shm_data *)mm_static_alloc(sizeof(struct shm_data));
+	shm_init_private();
+}
+
+static void shm_lock()
+{
+	WaitForSingleObject(shm->mutex, INFINITE);
+}
+
+static void shm_unlock()
+{
+	ReleaseMutex(shm->mutex);
+}
+
+static uint64_t get_current_time()
+{
+	FILETIME filetime;
+	GetSystemTimeAsFileTime(&filetime);
+	return filetime_to_unix_sec(&filetime);
+}
+
+static uint64_t get_capacity(uint64_t size)
+{
+	return (size + BLOCK_SIZE - 1) & ~(uint64_t)(BLOCK_SIZE - 1);
+}
+
+/* Commit [start, end) of a section, committed pages show up in every view of it */
+static bool commit_section(HANDLE section, uint64_t start, uint64_t end)
+{
+	for (uint64_t offset = start; offset < end; offset += SHM_COMMIT_CHUNK)
+	{
+		size_t count = (size_t)min(end - offset, (uint64_t)SHM_COMMIT_CHUNK);
+		void *view = MapViewOfFile(section, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)offset, count);
+		bool committed = view && VirtualAlloc(view, count, MEM_COMMIT, PAGE_READWRITE);
+		if (!committed)
+			log_warning("Committing section failed, error code: %d\n", GetLastError());
+		if (view)
+			UnmapViewOfFile(view);
+		if (!committed)
+			return false;
+	}
+	return true;
+}
+
+/* Create the section of an object, or open it if another process already did
+ * A section created anew has [0, capacity) committed and zeroed.
+ * With a zero id the section is unnamed, it is only reachable through the file which owns it.
+ */
+static HANDLE create_section(int id, uint64_t reserve, uint64_t capacity)
+{
+	char name[64];
+	if (id)
+		ksprintf(name, "flinux_shm_%d", id);
+	SECURITY_ATTRIBUTES attr;
+	attr.nLength = sizeof(SECURITY_ATTRIBUTES);
+	attr.bInheritHandle = TRUE;
+	attr.lpSecurityDescriptor = NULL;
+	HANDLE section = CreateFileMappingA(INVALID_HANDLE_VALUE, &attr, PAGE_EXECUTE_READWRITE | SEC_RESERVE,
+		(DWORD)(reserve >> 32), (DWORD)reserve, id ? name : NULL);
+	if (!section)
+	{
+		log_warning("CreateFileMapping() failed, error code: %d\n", GetLastError());
+		return NULL;
+	}
+	if (GetLastError() != ERROR_ALREADY_EXISTS && !commit_section(section, 0, capacity))
+	{
+		CloseHandle(section);
+		return NULL;
+	}
+	return section;
+}
+
+#define SHM_ACCESS_READ		0
+#define SHM_ACCESS_WRITE	1
+#define SHM_ACCESS_ZERO		2
+
+/* Read, write or zero [offset, offset + count) of a section through a temporary view */
+static bool access_section(HANDLE section, uint64_t offset, void *buf, size_t count, int access)
+{
+	uint64_t view_offset = offset & ~(uint64_t)(BLOCK_SIZE - 1);
+	size_t delta = (size_t)(offset - view_offset);
+	char *view = (char *)MapViewOfFile(section, access == SHM_ACCESS_READ ? FILE_MAP_READ : FILE_MAP_WRITE,
+		(DWORD)(view_offset >> 32), (DWORD)view_offset, delta + count);
+	if (!view)
+	{
+		log_warning("MapViewOfFile() failed, error code: %d\n", GetLastError());
+		return false;
+	}
+	if (access == SHM_ACCESS_READ)
+		memcpy(buf, view + delta, count);
+	else if (access == SHM_ACCESS_WRITE)
+		memcpy(view + delta, buf, count);
+	else
+		RtlZeroMemory(view + delta, count);
+	UnmapViewOfFile(view);
+	return true;
+}
+
+/* Allocate an object slot, caller holds the shm mutex */
+static struct shm_object *alloc_object(int type)
+{
+	for (int i = 0; i < SHM_MAX_COUNT; i++)
+	{
+		struct shm_object *obj = &shm_shared->objects[i];
+		if (obj->type == SHM_TYPE_FREE)
+		{
+			int generation = obj->id / SHM_MAX_COUNT % SHM_ID_GENERATIONS + 1;
+			RtlZeroMemory(obj, sizeof(struct shm_object));
+			obj->type = type;
+			obj->id = generation * SHM_MAX_COUNT + i;
+			obj->ctime = get_current_time();
+			return obj;
+		}
+	}
+	log_warning("Shared memory object table exhausted.\n");
+	return NULL;
+}
+
+/* Free an object slot, the id is kept for generating the next one */
+static void free_object(struct shm_object *obj)
+{
+	obj->type = SHM_TYPE_FREE;
+	obj->name[0] = 0;
+}
+
+static struct shm_object *get_object(int id)
+{
+	if (id <= 0)
+		return NULL;
+	struct shm_object *obj = &shm_shared->objects[id % SHM_MAX_COUNT];
+	if (obj->type == SHM_TYPE_FREE || obj->id != id)
+		return NULL;
+	return obj;
+}
+
+static struct shm_object *find_named_object(const char *name)
+{
+	for (int i = 0; i < SHM_MAX_COUNT; i++)
+	{
+		struct shm_object *obj = &shm_shared->objects[i];
+		if (obj->type == SHM_TYPE_POSIX && !strcmp(obj->name, name))
+			return obj;
+	}
+	return NULL;
+}
+
+static struct shm_object *find_segment(key_t key)
+{
+	for (int i = 0; i < SHM_MAX_COUNT; i++)
+	{
+		struct shm_object *obj = &shm_shared->objects[i];
+		if (obj->type == SHM_TYPE_SYSV && !obj->removed && obj->key == key)
+			return obj;
+	}
+	return NULL;
+}
+
+struct shm_file
+{
+	struct file base_file;
+	HANDLE section; /* NULL while the object is empty */
+	uint64_t size, capacity, reserve;
+	int id; /* Object id, zero for memfd files and files of unlinked objects */
+	loff_t position;
+	int pathlen;
+	char path[];
+};
+
+static const struct file_ops shm_file_ops;
+
+static struct shm_file *shm_file_alloc(const char *path, int flags)
+{
+	int pathlen = strlen(path);
+	struct shm_file *file = (struct shm_file *)kmalloc(sizeof(struct shm_file) + pathlen + 1);
+	file_init(&file->base_file, &shm_file_ops, flags);
+	file->section = NULL;
+	file->size = 0;
+	file->capacity = 0;
+	file->reserve = 0;
+	file->id = 0;
+	file->position = 0;
+	file->pathlen = pathlen;
+	memcpy(file->path, path, pathlen + 1);
+	return file;
+}
+
+static int shm_file_close(struct file *f)
+{
+	struct shm_file *file = (struct shm_file *)f;
+	if (file->section)
+		CloseHandle(file->section);
+	kfree(file, sizeof(struct shm_file) + file->pathlen + 1);
+	return 0;
+}
+
+static int shm_file_getpath(struct file *f, char *buf)
+{
+	struct shm_file *file = (struct shm_file *)f;
+	memcpy(buf, file->path, file->pathlen + 1);
+	return file->pathlen;
+}
+
+/* Pick up the current size and section of the object of a file, another process may have resized it
+ * A file of an unlinked or removed object keeps the content it has, as on Linux.
+ * Caller holds the shm mutex.
+ */
+static void sync_file_locked(struct shm_file *file)
+{
+	struct shm_object *obj = get_object(file->id);
+	if (!obj)
+	{
+		file->id = 0;
+		return;
+	}
+	if (!file->section && obj->capacity)
+	{
+		file->section = create_section(obj->id, obj->reserve, obj->capacity);
+		if (file->section)
+			file->reserve = obj->reserve;
+	}
+	/* The section is shared, pages committed by another process are already there */
+	if (file->section)
+		file->capacity = obj->capacity;
+	file->size = min(obj->size, file->capacity);
+}
+
+static void sync_file(struct shm_file *file)
+{
+	if (!file->id)
+		return;
+	shm_lock();
+	sync_file_locked(file);
+	shm_unlock();
+}
+
+/* Set the size of the object of a file, with grow_only it is never shrunk */
+static int resize_file(struct shm_file *file, uint64_t size, bool grow_only)
+{
+	int r = 0;
+	bool locked = file->id != 0;
+	if (locked)
+	{
+		shm_lock();
+		sync_file_locked(file);
+	}
+	if (grow_only && size <= file->size)
+		goto out;
+	if (size > file->capacity)
+	{
+		uint64_t capacity = get_capacity(size);
+		if (!file->section)
+		{
+			uint64_t reserve = max(capacity, SHM_RESERVE_SIZE);
+			file->section = create_section(file->id, reserve, capacity);
+			if (!file->section)
+			{
+				r = -ENOSPC;
+				goto out;
+			}
+			file->reserve = reserve;
+		}
+		else if (capacity > file->reserve)
+		{
+			/* A new section would not be seen by existing mappings */
+			r = -EFBIG;
+			goto out;
+		}
+		else if (!commit_section(file->section, file->capacity, capacity))
+		{
+			r = -ENOSPC;
+			goto out;
+		}
+		file->capacity = capacity;
+	}
+	else if (size < file->size)
+	{
+		/* Growing again later must expose zeroes */
+		access_section(file->section, size, NULL, (size_t)(file->size - size), SHM_ACCESS_ZERO);
+	}
+	file->size = size;
+	struct shm_object *obj = get_object(file->id);
+	if (obj)
+	{
+		obj->size = file->size;
+		obj->capacity = file->capacity;
+		obj->reserve = file->reserve;
+		obj->ctime = get_current_time();
+	}
+out:
+	if (locked)
+		shm_unlock();
+	return r;
+}
+
+static size_t shm_file_pread_internal(struct shm_file *file, void *buf, size_t count, loff_t offset)
+{
+	sync_file(file);
+	if (offset < 0)
+		return -EINVAL;
+	if ((uint64_t)offset >= file->size)
+		return 0;
+	count = (size_t)min((uint64_t)count, file->size - offset);
+	if (!access_section(file->section, offset, buf, count, SHM_ACCESS_READ))
+		return -EIO;
+	return count;
+}
+
+static size_t shm_file_pwrite_internal(struct shm_file *file, const void *buf, size_t count, loff_t offset)
+{
+	if (offset < 0)
+		return -EINVAL;
+	if (count == 0)
+		return 0;
+	int r = resize_file(file, offset + count, true);
+	if (r < 0)
+		return r;
+	if (!access_section(file->section, offset, (void *)buf, count, SHM_ACCESS_WRITE))
+		return -EIO;
+	return count;
+}
+
+static size_t shm_file_read(struct file *f, void *buf, size_t count)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct shm_file *file = (struct shm_file *)f;
+	size_t r = shm_file_pread_internal(file, buf, count, file->position);
+	if ((intptr_t)r > 0)
+		file->position += r;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static size_t shm_file_write(struct file *f, const void *buf, size_t count)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct shm_file *file = (struct shm_file *)f;
+	size_t r = shm_file_pwrite_internal(file, buf, count, file->position);
+	if ((intptr_t)r > 0)
+		file->position += r;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static size_t shm_file_pread(struct file *f, void *buf, size_t count, loff_t offset)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	size_t r = shm_file_pread_internal((struct shm_file *)f, buf, count, offset);
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static size_t shm_file_pwrite(struct file *f, const void *buf, size_t count, loff_t offset)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	size_t r = shm_file_pwrite_internal((struct shm_file *)f, buf, count, offset);
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+/* The section backing MAP_SHARED mappings, see map_shm_block() in mm.c */
+static HANDLE shm_file_get_shared_section(struct file *f)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct shm_file *file = (struct shm_file *)f;
+	sync_file(file);
+	HANDLE section = file->section;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return section;
+}
+
+static int shm_file_truncate(struct file *f, loff_t length)
+{
+	if (length < 0)
+		return -EINVAL;
+	AcquireSRWLockExclusive(&f->rw_lock);
+	int r = resize_file((struct shm_file *)f, length, false);
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static int shm_file_llseek(struct file *f, loff_t offset, loff_t *newoffset, int whence)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct shm_file *file = (struct shm_file *)f;
+	int r = 0;
+	loff_t target;
+	if (whence == SEEK_SET)
+		target = offset;
+	else if (whence == SEEK_CUR)
+		target = file->position + offset;
+	else if (whence == SEEK_END)
+	{
+		sync_file(file);
+		target = file->size + offset;
+	}
+	else
+	{
+		r = -EINVAL;
+		goto out;
+	}
+	if (target < 0)
+	{
+		r = -EINVAL;
+		goto out;
+	}
+	file->position = target;
+	*newoffset = target;
+out:
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static int shm_file_stat(struct file *f, struct newstat *buf)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct shm_file *file = (struct shm_file *)f;
+	sync_file(file);
+	INIT_STRUCT_NEWSTAT_PADDING(buf);
+	buf->st_dev = mkdev(0, 4);
+	buf->st_ino = file->id ? file->id : (uintptr_t)file;
+	buf->st_mode = S_IFREG + 0666;
+	buf->st_nlink = file->id ? 1 : 0;
+	buf->st_uid = 0;
+	buf->st_gid = 0;
+	buf->st_rdev = 0;
+	buf->st_size = file->size;
+	buf->st_blksize = PAGE_SIZE;
+	buf->st_blocks = file->capacity / 512;
+	buf->st_atime = 0;
+	buf->st_atime_nsec = 0;
+	buf->st_mtime = 0;
+	buf->st_mtime_nsec = 0;
+	buf->st_ctime = 0;
+	buf->st_ctime_nsec = 0;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return 0;
+}
+
+static const struct file_ops shm_file_ops =
+{
+	.close = shm_file_close,
+	.getpath = shm_file_getpath,
+	.read = shm_file_read,
+	.write = shm_file_write,
+	.pread = shm_file_pread,
+	.pwrite = shm_file_pwrite,
+	.get_shared_section = shm_file_get_shared_section,
+	.truncate = shm_file_truncate,
+	.llseek = shm_file_llseek,
+	.stat = shm_file_stat,
+};
+
+int shm_memfd_alloc(const char *name, int flags, struct file **fp)
+{
+	if (strlen(name) > SHM_NAME_MAX - 7)
+		return -EINVAL;
+	char path[SHM_NAME_MAX + 32];
+	ksprintf(path, "/memfd:%s (deleted)", name);
+	*fp = (struct file *)shm_file_alloc(path, O_RDWR);
+	return 0;
+}
+
+/* /dev/shm file system */
+
+struct shmfs_directory
+{
+	struct file base_file;
+	int position; /* 0: ".", 1: "..", others: object slot + 2 */
+};
+
+static int shmfs_directory_close(struct file *f)
+{
+	kfree(f, sizeof(struct shmfs_directory));
+	return 0;
+}
+
+static int shmfs_directory_getpath(struct file *f, char *buf)
+{
+	strcpy(buf, "/dev/shm");
+	return 8;
+}
+
+static int shmfs_directory_llseek(struct file *f, loff_t offset, loff_t *newoffset, int whence)
+{
+	if (whence != SEEK_SET || offset != 0)
+		return -EINVAL;
+	AcquireSRWLockExclusive(&f->rw_lock);
+	((struct shmfs_directory *)f)->position = 0;
+	*newoffset = 0;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return 0;
+}
+
+static int shmfs_directory_stat(struct file *f, struct newstat *buf)
+{
+	INIT_STRUCT_NEWSTAT_PADDING(buf);
+	buf->st_dev = mkdev(0, 4);
+	buf->st_ino = 0;
+	buf->st_mode = S_IFDIR + 01777;
+	buf->st_nlink = 2;
+	buf->st_uid = 0;
+	buf->st_gid = 0;
+	buf->st_rdev = 0;
+	buf->st_size = 0;
+	buf->st_blksize = PAGE_SIZE;
+	buf->st_blocks = 0;
+	buf->st_atime = 0;
+	buf->st_atime_nsec = 0;
+	buf->st_mtime = 0;
+	buf->st_mtime_nsec = 0;
+	buf->st_ctime = 0;
+	buf->st_ctime_nsec = 0;
+	return 0;
+}
+
+static int shmfs_directory_getdents(struct file *f, void *dirent, size_t count, getdents_callback *fill_callback)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct shmfs_directory *dir = (struct shmfs_directory *)f;
+	char *buf = (char *)dirent;
+	intptr_t size = 0;
+	for (; dir->position < SHM_MAX_COUNT + 2; dir->position++)
+	{
+		char name[SHM_NAME_MAX];
+		uint64_t inode = 0;
+		int type = DT_DIR;
+		if (dir->position == 0)
+			strcpy(name, ".");
+		else if (dir->position == 1)
+			strcpy(name, "..");
+		else
+		{
+			shm_lock();
+			struct shm_object *obj = &shm_shared->objects[dir->position - 2];
+			bool found = obj->type == SHM_TYPE_POSIX;
+			if (found)
+			{
+				strcpy(name, obj->name);
+				inode = obj->id;
+				type = DT_REG;
+			}
+			shm_unlock();
+			if (!found)
+				continue;
+		}
+		intptr_t r = (*fill_callback)(buf, inode, name, strlen(name), type, count, GETDENTS_UTF8);
+		if (r == GETDENTS_ERR_BUFFER_OVERFLOW)
+			break;
+		if (r < 0)
+		{
+			size = r;
+			break;
+		}
+		count -= r;
+		size += r;
+		buf += r;
+	}
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return (int)size;
+}
+
+static const struct file_ops shmfs_directory_ops =
+{
+	.close = shmfs_directory_close,
+	.getpath = shmfs_directory_getpath,
+	.llseek = shmfs_directory_llseek,
+	.stat = shmfs_directory_stat,
+	.getdents = shmfs_directory_getdents,
+};
+
+static int shmfs_open(struct file_system *fs, const char *path, int flags, int mode, struct file **fp, char *target, int buflen)
+{
+	if (*path == 0 || !strcmp(path, "."))
+	{
+		if (fp)
+		{
+			struct shmfs_directory *dir = (struct shmfs_directory *)kmalloc(sizeof(struct shmfs_directory));
+			file_init(&dir->base_file, &shmfs_directory_ops, O_RDONLY);
+			dir->position = 0;
+			*fp = (struct file *)dir;
+		}
+		return 0;
+	}
+	/* Subdirectories are not supported */
+	for (const char *p = path; *p; p++)
+		if (*p == '/')
+			return -ENOENT;
+	if (strlen(path) >= SHM_NAME_MAX)
+		return -ENAMETOOLONG;
+	int r = 0;
+	shm_lock();
+	struct shm_object *obj = find_named_object(path);
+	if (obj && (flags & O_CREAT) && (flags & O_EXCL))
+		r = -EEXIST;
+	else if (obj && (flags & O_DIRECTORY))
+		r = -ENOTDIR;
+	else if (!obj && !(flags & O_CREAT))
+		r = -ENOENT;
+	else if (!obj)
+	{
+		obj = alloc_object(SHM_TYPE_POSIX);
+		if (!obj)
+			r = -ENOSPC;
+		else
+		{
+			strcpy(obj->name, path);
+			obj->mode = mode & 0777;
+		}
+	}
+	struct shm_file *file = NULL;
+	if (r == 0 && fp)
+	{
+		char fullpath[SHM_NAME_MAX + 16];
+		ksprintf(fullpath, "/dev/shm/%s", path);
+		file = shm_file_alloc(fullpath, flags);
+		file->id = obj->id;
+	}
+	shm_unlock();
+	if (file)
+	{
+		if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY)
+			resize_file(file, 0, false);
+		*fp = (struct file *)file;
+	}
+	return r;
+}
+
+static int shmfs_unlink(struct file_system *fs, const char *pathname)
+{
+	int r = 0;
+	shm_lock();
+	struct shm_object *obj = find_named_object(pathname);
+	if (obj)
+		free_object(obj);
+	else
+		r = -ENOENT;
+	shm_unlock();
+	return r;
+}
+
+struct file_system *shmfs_alloc()
+{
+	struct file_system *fs = (struct file_system *)kmalloc(sizeof(struct file_system));
+	RtlZeroMemory(fs, sizeof(struct file_system));
+	fs->mountpoint = "/dev/shm";
+	fs->open = shmfs_open;
+	fs->unlink = shmfs_unlink;
+	return fs;
+}
+
+/* System V shared memory */
+
+/* Get the section of a segment, it is kept open until the process exits. Caller holds the shm mutex. */
+static HANDLE get_segment_section(struct shm_object *obj)
+{
+	int i = obj->id % SHM_MAX_COUNT;
+	if (shm->segment_ids[i] != obj->id)
+	{
+		if (shm->segments[i])
+			CloseHandle(shm->segments[i]);
+		shm->segments[i] = create_section(obj->id, obj->reserve, obj->capacity);
+		shm->segment_ids[i] = shm->segments[i] ? obj->id : 0;
+	}
+	return shm->segments[i];
+}
+
+/* Account a detach of an attached segment, caller holds the shm mutex */
+static void detach_segment(int id)
+{
+	struct shm_object *obj = get_object(id);
+	if (!obj)
+		return;
+	obj->nattch--;
+	obj->dtime = get_current_time();
+	obj->lpid = process_get_pid();
+	if (obj->removed && obj->nattch <= 0)
+		free_object(obj);
+}
+
+void shm_afterfork_child()
+{
+	shm = (struct shm_data *)mm_static_alloc(sizeof(struct shm_data));
+	shm_init_private();
+	/* Attached segments are inherited */
+	shm_lock();
+	for (int i = 0; i < SHM_MAX_ATTACH; i++)
+	{
+		struct shm_object *obj = shm->attaches[i].addr ? get_object(shm->attaches[i].id) : NULL;
+		if (obj)
+			obj->nattch++;
+	}
+	shm_unlock();
+}
+
+static void detach_all()
+{
+	shm_lock();
+	for (int i = 0; i < SHM_MAX_ATTACH; i++)
+		if (shm->attaches[i].addr)
+		{
+			detach_segment(shm->attaches[i].id);
+			shm->attaches[i].addr = NULL;
+		}
+	shm_unlock();
+}
+
+void shm_reset()
+{
+	detach_all();
+}
+
+void shm_shutdown()
+{
+	detach_all();
+}
+
+DEFINE_SYSCALL(shmget, key_t, key, size_t, size, int, shmflg)
+{
+	log_info("shmget(%d, %p, 0%o)\n", key, size, shmflg);
+	int r;
+	bool created = false;
+	shm_lock();
+	struct shm_object *obj = key == IPC_PRIVATE ? NULL : find_segment(key);
+	if (obj)
+	{
+		if ((shmflg & IPC_CREAT) && (shmflg & IPC_EXCL))
+			r = -EEXIST;
+		else if (size > obj->size)
+			r = -EINVAL;
+		else
+			r = obj->id;
+	}
+	else if (key != IPC_PRIVATE && !(shmflg & IPC_CREAT))
+		r = -ENOENT;
+	else if (size == 0)
+		r = -EINVAL;
+	else if (!(obj = alloc_object(SHM_TYPE_SYSV)))
+		r = -ENOSPC;
+	else
+	{
+		obj->key = key;
+		obj->mode = shmflg & 0777;
+		obj->size = size;
+		obj->capacity = get_capacity(size);
+		/* Segments never grow */
+		obj->reserve = obj->capacity;
+		obj->cpid = process_get_pid();
+		created = true;
+		r = obj->id;
+	}
+	if (r >= 0 && !get_segment_section(obj))
+	{
+		if (created)
+			free_object(obj);
+		r = -ENOMEM;
+	}
+	shm_unlock();
+	return r;
+}
+
+DEFINE_SYSCALL(shmat, int, shmid, void *, shmaddr, int, shmflg)
+{
+	log_info("shmat(%d, %p, 0%o)\n", shmid, shmaddr, shmflg);
+	if (shmaddr)
+	{
+		if (shmflg & SHM_RND)
+			shmaddr = (void *)((size_t)shmaddr & ~(size_t)(SHMLBA - 1));
+		else if ((size_t)shmaddr & (SHMLBA - 1))
+			return -EINVAL;
+	}
+	int slot;
+	for (slot = 0; slot < SHM_MAX_ATTACH; slot++)
+		if (!shm->attaches[slot].addr)
+			break;
+	if (slot == SHM_MAX_ATTACH)
+		return -EMFILE;
+	shm_lock();
+	struct shm_object *obj = get_object(shmid);
+	HANDLE section = obj && obj->type == SHM_TYPE_SYSV ? get_segment_section(obj) : NULL;
+	struct shm_file *file = NULL;
+	if (section)
+	{
+		/* The mapping owns its own file, which keeps the section alive as long as it is mapped */
+		char path[32];
+		ksprintf(path, "/SYSV%08x (deleted)", obj->key);
+		file = shm_file_alloc(path, O_RDWR);
+		file->id = obj->id;
+		file->size = obj->size;
+		file->capacity = obj->capacity;
+		file->reserve = obj->reserve;
+		DuplicateHandle(GetCurrentProcess(), section, GetCurrentProcess(), &file->section, 0, TRUE, DUPLICATE_SAME_ACCESS);
+	}
+	shm_unlock();
+	if (!file)
+		return obj ? -ENOMEM : -EINVAL;
+	int prot = (shmflg & SHM_RDONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+	if (shmflg & SHM_EXEC)
+		prot |= PROT_EXEC;
+	size_t size = (size_t)ALIGN_TO(file->size, PAGE_SIZE);
+	void *addr = mm_mmap(shmaddr, size, prot, MAP_SHARED | (shmaddr ? MAP_FIXED : 0),
+		(shmaddr && !(shmflg & SHM_REMAP)) ? INTERNAL_MAP_NOOVERWRITE : 0, (struct file *)file, 0);
+	vfs_release((struct file *)file);
+	if ((uintptr_t)addr >= (uintptr_t)-4095)
+		return (intptr_t)addr;
+	shm->attaches[slot].addr = addr;
+	shm->attaches[slot].size = size;
+	shm->attaches[slot].id = shmid;
+	shm_lock();
+	obj = get_object(shmid);
+	if (obj)
+	{
+		obj->nattch++;
+		obj->atime = get_current_time();
+		obj->lpid = process_get_pid();
+	}
+	shm_unlock();
+	return (intptr_t)addr;
+}
+
+DEFINE_SYSCALL(shmdt, void *, shmaddr)
+{
+	log_info("shmdt(%p)\n", shmaddr);
+	for (int i = 0; i < SHM_MAX_ATTACH; i++)
+		if (shmaddr && shm->attaches[i].addr == shmaddr)
+		{
+			mm_munmap(shmaddr, shm->attaches[i].size);
+			shm->attaches[i].addr = NULL;
+			shm_lock();
+			detach_segment(shm->attaches[i].id);
+			shm_unlock();
+			return 0;
+		}
+	return -EINVAL;
+}
+
+DEFINE_SYSCALL(shmctl, int, shmid, int, cmd, struct shmid64_ds *, buf)
+{
+	log_info("shmctl(%d, %d, %p)\n", shmid, cmd, buf);
+	/* Only the 64-bit structures are supported, as used by all current C libraries */
+	cmd &= ~IPC_64;
+	if ((cmd == IPC_STAT && !mm_check_write(buf, sizeof(struct shmid64_ds)))
+		|| (cmd == IPC_SET && !mm_check_read(buf, sizeof(struct shmid64_ds))))
+		return -EFAULT;
+	int r = 0;
+	shm_lock();
+	struct shm_object *obj = get_object(shmid);
+	if (!obj || obj->type != SHM_TYPE_SYSV)
+	{
+		r = -EINVAL;
+		goto out;
+	}
+	switch (cmd)
+	{
+	case IPC_STAT:
+		RtlZeroMemory(buf, sizeof(struct shmid64_ds));
+		buf->shm_perm.key = obj->key;
+		buf->shm_perm.mode = obj->mode | (obj->removed ? 01000 : 0); /* SHM_DEST */
+		buf->shm_perm.seq = (unsigned short)(obj->id / SHM_MAX_COUNT);
+		buf->shm_segsz = (size_t)obj->size;
+		buf->shm_atime = (uintptr_t)obj->atime;
+		buf->shm_dtime = (uintptr_t)obj->dtime;
+		buf->shm_ctime = (uintptr_t)obj->ctime;
+		buf->shm_cpid = obj->cpid;
+		buf->shm_lpid = obj->lpid;
+		buf->shm_nattch = obj->nattch;
+		break;
+
+	case IPC_SET:
+		obj->mode = buf->shm_perm.mode & 0777;
+		obj->ctime = get_current_time();
+		break;
+
+	case IPC_RMID:
+		/* The key is released right away, the segment itself on the last detach */
+		obj->removed = 1;
+		obj->key = IPC_PRIVATE;
+		if (obj->nattch <= 0)
+			free_object(obj);
+		break;
+
+	case SHM_LOCK:
+	case SHM_UNLOCK:
+		break;
+
+	default:
+		log_error("Unsupported shmctl command: %d\n", cmd);
+		r = -EINVAL;
+	}
+out:
+	shm_unlock();
+	return r;
+}
+
+/* System V IPC multiplexer on x86, only shared memory calls are supported */
+DEFINE_SYSCALL(ipc, unsigned int, call, int, first, uintptr_t, second, uintptr_t, third, void *, ptr, intptr_t, fifth)
+{
+	int version = call >> 16;
+	switch (call & 0xFFFF)
+	{
+	case SHMAT:
+	{
+		if (version == 1) /* iBCS2 entry point */
+			return -EINVAL;
+		if (!mm_check_write((void *)third, sizeof(uintptr_t)))
+			return -EFAULT;
+		intptr_t r = sys_shmat(first, ptr, (int)second);
+		if ((uintptr_t)r >= (uintptr_t)-4095)
+			return r;
+		*(uintptr_t *)third = r;
+		return 0;
+	}
+
+	case SHMDT:
+		return sys_shmdt(ptr);
+
+	case SHMGET:
+		return sys_shmget(first, second, (int)third);
+
+	case SHMCTL:
+		return sys_shmctl(first, (int)second, (struct shmid64_ds *)ptr);
+
+	default:
+		log_error("Unimplemented ipc call: %d\n", call);
+		return -ENOSYS;
+	}
+}
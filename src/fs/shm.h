@@ -0,0 +1,32 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <fs/file.h>
+
+void shm_init();
+void shm_afterfork_child();
+/* Detach all System V segments, on execve() */
+void shm_reset();
+/* Detach all System V segments, on process exit */
+void shm_shutdown();
+
+struct file_system *shmfs_alloc();
+int shm_memfd_alloc(const char *name, int flags, struct file **fp);
@@ -338,10 +338,18 @@ struct virtualfs_text
 	char text[];
 };
 
+/* Texts larger than the biggest kmalloc() pool (e.g. /proc/[pid]/smaps) are
+ * backed by their own anonymous mapping instead */
+#define VIRTUALFS_TEXT_KMALLOC_MAX	16384
+
 static int virtualfs_text_close(struct file *f)
 {
 	struct virtualfs_text *file = (struct virtualfs_text *)f;
-	kfree(file, sizeof(struct virtualfs_text) + file->buflen);
+	size_t size = sizeof(struct virtualfs_text) + file->buflen + 1;
+	if (size > VIRTUALFS_TEXT_KMALLOC_MAX)
+		mm_munmap(file, ALIGN_TO(size, BLOCK_SIZE));
+	else
+		kfree(file, size);
 	return 0;
 }
 
@@ -414,11 +422,21 @@ static const struct file_ops virtualfs_text_ops =
 
 static struct file *virtualfs_text_alloc(struct virtualfs_text_desc *desc, int tag)
 {
-	char buf[65536];
+	char buf[VIRTUALFS_TEXT_MAX_SIZE];
 	int len = desc->gettext(tag, buf);
 	if (len < 0)
 		return NULL;
-	struct virtualfs_text *file = (struct virtualfs_text *)kmalloc(sizeof(struct virtualfs_text) + len + 1);
+	size_t size = sizeof(struct virtualfs_text) + len + 1;
+	struct virtualfs_text *file;
+	if (size > VIRTUALFS_TEXT_KMALLOC_MAX)
+	{
+		file = (struct virtualfs_text *)mm_mmap(NULL, ALIGN_TO(size, BLOCK_SIZE), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+			INTERNAL_MAP_TOPDOWN | INTERNAL_MAP_NORESET | INTERNAL_MAP_COPYONFORK, NULL, 0);
+		if ((uintptr_t)file >= (uintptr_t)-4095) /* -errno */
+			return NULL;
+	}
+	else if (!(file = (struct virtualfs_text *)kmalloc(size)))
+		return NULL;
 	file_init(&file->base_file, &virtualfs_text_ops, O_RDONLY);
 	file->textlen = len;
 	memcpy(file->text, buf, len);
@@ -505,13 +523,40 @@ static size_t virtualfs_param_write(struct file *f, const void *buf, size_t coun
 		break;
 	}
 	case VIRTUALFS_PARAM_TYPE_INT:
-	{
-		log_error("Write to VIRTUALFS_PARAM_INT not implemented.\n");
-		break;
-	}
 	case VIRTUALFS_PARAM_TYPE_UINT:
 	{
-		log_error("Write to VIRTUALFS_PARAM_UINT not implemented.\n");
+		char nbuf[128];
+		if (count >= sizeof(nbuf))
+		{
+			r = -EINVAL;
+			goto out;
+		}
+		memcpy(nbuf, buf, count);
+		/* Strip trailing newline written by echo */
+		size_t len = count;
+		while (len > 0 && (nbuf[len - 1] == '\n' || nbuf[len - 1] == ' '))
+			len--;
+		nbuf[len] = 0;
+		if (file->desc->valtype == VIRTUALFS_PARAM_TYPE_INT)
+		{
+			int value;
+			if (!katoi(nbuf, &value))
+			{
+				r = -EINVAL;
+				goto out;
+			}
+			file->desc->set_int(file->tag, value);
+		}
+		else
+		{
+			unsigned int value;
+			if (!katou(nbuf, &value))
+			{
+				r = -EINVAL;
+				goto out;
+			}
+			file->desc->set_uint(file->tag, value);
+		}
 		break;
 	}
 	default:
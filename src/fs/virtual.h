@@ -109,6 +109,8 @@ struct virtualfs_char_desc
 	}
 
 /* VIRTUALFS_TYPE_TEXT */
+/* Size of the buffer passed to gettext(), generators must not write past it */
+#define VIRTUALFS_TEXT_MAX_SIZE	65536
 struct virtualfs_text_desc
 {
 	int type;
@@ -40,6 +40,7 @@ struct winfs_file
 {
 	struct file base_file;
 	HANDLE handle;
+	HANDLE section; /* File backed section object for mmap(), created on first use */
 	int restart_scan; /* for getdents() */
 	int pathlen;
 	char pathname[]; /* Not necessary null-terminated */
@@ -229,6 +230,8 @@ static int winfs_read_symlink(HANDLE hFile, char *target, int buflen)
 static int winfs_close(struct file *f)
 {
 	struct winfs_file *winfile = (struct winfs_file *)f;
+	if (winfile->section)
+		NtClose(winfile->section);
 	if (CloseHandle(winfile->handle))
 	{
 		kfree(winfile, sizeof(struct winfs_file) + winfile->pathlen);
@@ -367,6 +370,42 @@ static size_t winfs_pwrite(struct file *f, const void *buf, size_t count, loff_t
 	return num_written;
 }
 
+static HANDLE winfs_get_section(struct file *f)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct winfs_file *winfile = (struct winfs_file *) f;
+	if (!winfile->section)
+	{
+		/* The section must be executable to back code mappings, which needs execute access to the file */
+		HANDLE exec_handle = ReOpenFile(winfile->handle, GENERIC_READ | GENERIC_EXECUTE,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0);
+		if (exec_handle == INVALID_HANDLE_VALUE)
+		{
+			log_warning("ReOpenFile() failed, error code: %d\n", GetLastError());
+			goto out;
+		}
+		OBJECT_ATTRIBUTES attr;
+		attr.Length = sizeof(OBJECT_ATTRIBUTES);
+		attr.RootDirectory = NULL;
+		attr.ObjectName = NULL;
+		attr.Attributes = OBJ_INHERIT;
+		attr.SecurityDescriptor = NULL;
+		attr.SecurityQualityOfService = NULL;
+		NTSTATUS status = NtCreateSection(&winfile->section, SECTION_QUERY | SECTION_MAP_READ | SECTION_MAP_EXECUTE,
+			&attr, NULL, PAGE_EXECUTE_READ, SEC_COMMIT, exec_handle);
+		NtClose(exec_handle);
+		if (!NT_SUCCESS(status))
+		{
+			/* Empty files cannot be mapped */
+			log_warning("NtCreateSection() failed, status: %x\n", status);
+			winfile->section = NULL;
+		}
+	}
+out:
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return winfile->section;
+}
+
 static size_t winfs_readlink(struct file *f, char *target, size_t buflen)
 {
 	AcquireSRWLockShared(&f->rw_lock);
@@ -646,6 +685,7 @@ static struct file_ops winfs_ops =
 	.write = winfs_write,
 	.pread = winfs_pread,
 	.pwrite = winfs_pwrite,
+	.get_section = winfs_get_section,
 	.readlink = winfs_readlink,
 	.truncate = winfs_truncate,
 	.fsync = winfs_fsync,
@@ -1004,6 +1044,7 @@ static int winfs_open(struct file_system *fs, const char *pathname, int flags, i
 		struct winfs_file *file = (struct winfs_file *)kmalloc(sizeof(struct winfs_file) + pathlen);
 		file_init(&file->base_file, &winfs_ops, flags);
 		file->handle = handle;
+		file->section = NULL;
 		file->restart_scan = 1;
 		file->pathlen = pathlen;
 		memcpy(file->pathname, pathname, pathlen);
@@ -27,6 +27,13 @@
  * When allocating memory, we use the minimum sized pool which fit.
  * A pool is a chained list of bucket, each of a memory block size (64kB), at 
  * each bucket there is a header structure storing the status of the bucket.
+ *
+ * To keep threads from contending on the global heap lock, each thread gets a
+ * cache holding a few free objects of each size. Allocations and frees are served
+ * from the cache, which is refilled from or flushed to the pools in batches. Cached
+ * objects still count as allocated in their buckets. A cache is protected by its own
+ * lock, which is only contended by heap_fork(). Threads beyond HEAP_CACHE_COUNT use
+ * the pools directly.
  */
 
 struct bucket
@@ -43,13 +50,33 @@ struct pool
 };
 
 #define POOL_COUNT	11
+
+#define HEAP_CACHE_COUNT	64	/* Number of per-thread caches */
+#define HEAP_CACHE_SIZE		16	/* Maximum cached objects per size */
+#define HEAP_CACHE_BATCH	8	/* Objects moved between a cache and a pool at once */
+
+struct heap_cache
+{
+	SRWLOCK lock;
+	bool used;
+	int count[POOL_COUNT];
+	void *objects[POOL_COUNT][HEAP_CACHE_SIZE];
+};
+
 struct heap_data
 {
 	SRWLOCK rw_lock;
 	struct pool pools[POOL_COUNT];
+	/* Per-thread caches, in a copy on fork region */
+	struct heap_cache *caches;
+	/* Cache of the thread calling fork(), which becomes the main thread of the child */
+	struct heap_cache *fork_cache;
 };
 
 static struct heap_data *heap;
+/* Cache of current thread, NULL if not assigned yet, HEAP_NO_CACHE if none was available */
+static __declspec(thread) struct heap_cache *thread_cache;
+#define HEAP_NO_CACHE	((struct heap_cache *)-1)
 
 void heap_init()
 {
@@ -67,6 +94,12 @@ void heap_init()
 	heap->pools[8].objsize = 4096;		heap->pools[8].first = NULL;
 	heap->pools[9].objsize = 8192;		heap->pools[9].first = NULL;
 	heap->pools[10].objsize = 16384;	heap->pools[10].first = NULL;
+	/* Zero initialized, all caches are unused and empty */
+	heap->caches = mm_mmap(NULL, ALIGN_TO(sizeof(struct heap_cache) * HEAP_CACHE_COUNT, BLOCK_SIZE), PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, INTERNAL_MAP_TOPDOWN | INTERNAL_MAP_NORESET | INTERNAL_MAP_COPYONFORK, NULL, 0);
+	for (int i = 0; i < HEAP_CACHE_COUNT; i++)
+		InitializeSRWLock(&heap->caches[i].lock);
+	heap->fork_cache = NULL;
 	log_info("heap subsystem initialized.\n");
 }
 
@@ -74,21 +107,98 @@ void heap_shutdown()
 {
 }
 
+static void pool_free(int p, void *mem);
+
+/* Return all objects of a cache to the pools, the caller holds the heap lock */
+static void flush_cache(struct heap_cache *cache)
+{
+	for (int p = 0; p < POOL_COUNT; p++)
+	{
+		for (int i = 0; i < cache->count[p]; i++)
+			pool_free(p, cache->objects[p][i]);
+		cache->count[p] = 0;
+	}
+}
+
+/* Must be called before mm_fork(), the heap memory must not change while it is copied */
 int heap_fork(HANDLE process)
 {
+	for (int i = 0; i < HEAP_CACHE_COUNT; i++)
+		AcquireSRWLockShared(&heap->caches[i].lock);
 	AcquireSRWLockShared(&heap->rw_lock);
+	heap->fork_cache = thread_cache;
 	return 1;
 }
 
 void heap_afterfork_parent()
 {
 	ReleaseSRWLockShared(&heap->rw_lock);
+	for (int i = 0; i < HEAP_CACHE_COUNT; i++)
+		ReleaseSRWLockShared(&heap->caches[i].lock);
 }
 
 void heap_afterfork_child()
 {
 	heap = mm_static_alloc(sizeof(struct heap_data));
 	InitializeSRWLock(&heap->rw_lock);
+	/* Only the forking thread lives on, objects cached by the other threads go back to the pools */
+	for (int i = 0; i < HEAP_CACHE_COUNT; i++)
+	{
+		struct heap_cache *cache = &heap->caches[i];
+		InitializeSRWLock(&cache->lock);
+		if (cache->used && cache != heap->fork_cache)
+		{
+			flush_cache(cache);
+			cache->used = false;
+		}
+	}
+	thread_cache = heap->fork_cache;
+}
+
+void heap_thread_exit()
+{
+	struct heap_cache *cache = thread_cache;
+	if (!cache || cache == HEAP_NO_CACHE)
+		return;
+	AcquireSRWLockExclusive(&cache->lock);
+	AcquireSRWLockExclusive(&heap->rw_lock);
+	flush_cache(cache);
+	cache->used = false;
+	ReleaseSRWLockExclusive(&heap->rw_lock);
+	ReleaseSRWLockExclusive(&cache->lock);
+	thread_cache = NULL;
+}
+
+/* Get the cache of current thread, assign one on first use */
+static struct heap_cache *get_thread_cache()
+{
+	struct heap_cache *cache = thread_cache;
+	if (cache)
+		return cache == HEAP_NO_CACHE ? NULL : cache;
+	thread_cache = HEAP_NO_CACHE;
+	AcquireSRWLockExclusive(&heap->rw_lock);
+	for (int i = 0; i < HEAP_CACHE_COUNT; i++)
+		if (!heap->caches[i].used)
+		{
+			heap->caches[i].used = true;
+			thread_cache = &heap->caches[i];
+			break;
+		}
+	ReleaseSRWLockExclusive(&heap->rw_lock);
+	if (thread_cache == HEAP_NO_CACHE)
+	{
+		log_warning("No free heap cache, the thread uses the global pools.\n");
+		return NULL;
+	}
+	return thread_cache;
+}
+
+static int find_pool(int size)
+{
+	for (int i = 0; i < POOL_COUNT; i++)
+		if (size <= heap->pools[i].objsize)
+			return i;
+	return -1;
 }
 
 #define ALIGN(x, align) (((x) + ((align) - 1)) & -(align))
@@ -111,24 +221,9 @@ static struct bucket *alloc_bucket(int objsize)
 	return b;
 }
 
-void *kmalloc(int size)
+/* Allocate an object from pool p, the caller holds the heap lock */
+static void *pool_alloc(int p)
 {
-	AcquireSRWLockExclusive(&heap->rw_lock);
-	/* Find pool */
-	int p = -1;
-	for (int i = 0; i < POOL_COUNT; i++)
-		if (size <= heap->pools[i].objsize)
-		{
-			p = i;
-			break;
-		}
-	if (p == -1)
-	{
-		log_error("kmalloc(%d): size too large.\n", size);
-		ReleaseSRWLockExclusive(&heap->rw_lock);
-		return NULL;
-	}
-	
 	/* Find a bucket with a free object slot */
 	if (!heap->pools[p].first)
 		heap->pools[p].first = alloc_bucket(heap->pools[p].objsize);
@@ -137,11 +232,7 @@ void *kmalloc(int size)
 	for (;;)
 	{
 		if (!current)
-		{
-			log_error("kmalloc(%d): out of memory\n", size);
-			ReleaseSRWLockExclusive(&heap->rw_lock);
 			return NULL;
-		}
 
 		/* Current bucket has a free object, return it */
 		if (current->first_free)
@@ -149,7 +240,6 @@ void *kmalloc(int size)
 			void *c = current->first_free;
 			current->first_free = *(void**)c;
 			current->ref_cnt++;
-			ReleaseSRWLockExclusive(&heap->rw_lock);
 			return c;
 		}
 
@@ -162,27 +252,12 @@ void *kmalloc(int size)
 	}
 }
 
-void kfree(void *mem, int size)
+/* Free an object to pool p, the caller holds the heap lock */
+static void pool_free(int p, void *mem)
 {
-	AcquireSRWLockExclusive(&heap->rw_lock);
 	/* Find memory bucket */
 	void *bucket_addr = (void *)((size_t) mem & (-BLOCK_SIZE));
 
-	/* Find pool */
-	int p = -1;
-	for (int i = 0; i < POOL_COUNT; i++)
-		if (size <= heap->pools[i].objsize)
-		{
-			p = i;
-			break;
-		}
-	if (p == -1)
-	{
-		log_error("kfree(): Invalid size: %x\n", mem);
-		ReleaseSRWLockExclusive(&heap->rw_lock);
-		return;
-	}
-
 	/* Loop over the chain to find the corresponding bucket */
 	struct bucket *previous = NULL;
 	struct bucket *current = heap->pools[p].first;
@@ -208,9 +283,79 @@ void kfree(void *mem, int size)
 				previous->next_bucket = current->next_bucket;
 			mm_munmap(current, BLOCK_SIZE);
 		}
+		return;
+	}
+	log_error("kfree(): Invalid memory pointer or size: (%p, %d)\n", mem, heap->pools[p].objsize);
+}
+
+void *kmalloc(int size)
+{
+	/* Find pool */
+	int p = find_pool(size);
+	if (p == -1)
+	{
+		log_error("kmalloc(%d): size too large.\n", size);
+		return NULL;
+	}
+
+	void *c;
+	struct heap_cache *cache = get_thread_cache();
+	if (cache)
+	{
+		AcquireSRWLockExclusive(&cache->lock);
+		if (!cache->count[p])
+		{
+			/* Refill a batch of objects */
+			AcquireSRWLockExclusive(&heap->rw_lock);
+			while (cache->count[p] < HEAP_CACHE_BATCH && (c = pool_alloc(p)))
+				cache->objects[p][cache->count[p]++] = c;
+			ReleaseSRWLockExclusive(&heap->rw_lock);
+		}
+		c = cache->count[p] ? cache->objects[p][--cache->count[p]] : NULL;
+		ReleaseSRWLockExclusive(&cache->lock);
+	}
+	else
+	{
+		AcquireSRWLockExclusive(&heap->rw_lock);
+		c = pool_alloc(p);
 		ReleaseSRWLockExclusive(&heap->rw_lock);
+	}
+	if (!c)
+		log_error("kmalloc(%d): out of memory\n", size);
+	return c;
+}
+
+void kfree(void *mem, int size)
+{
+	/* Find pool */
+	int p = find_pool(size);
+	if (p == -1)
+	{
+		log_error("kfree(): Invalid size: %x\n", mem);
 		return;
 	}
-	log_error("kfree(): Invalid memory pointer or size: (%x, %d)\n", mem, size);
-	ReleaseSRWLockExclusive(&heap->rw_lock);
+
+	struct heap_cache *cache = get_thread_cache();
+	if (cache)
+	{
+		AcquireSRWLockExclusive(&cache->lock);
+		if (cache->count[p] == HEAP_CACHE_SIZE)
+		{
+			/* Flush a batch of objects, the least recently freed ones */
+			AcquireSRWLockExclusive(&heap->rw_lock);
+			for (int i = 0; i < HEAP_CACHE_BATCH; i++)
+				pool_free(p, cache->objects[p][i]);
+			ReleaseSRWLockExclusive(&heap->rw_lock);
+			cache->count[p] -= HEAP_CACHE_BATCH;
+			RtlMoveMemory(cache->objects[p], cache->objects[p] + HEAP_CACHE_BATCH, cache->count[p] * sizeof(void *));
+		}
+		cache->objects[p][cache->count[p]++] = mem;
+		ReleaseSRWLockExclusive(&cache->lock);
+	}
+	else
+	{
+		AcquireSRWLockExclusive(&heap->rw_lock);
+		pool_free(p, mem);
+		ReleaseSRWLockExclusive(&heap->rw_lock);
+	}
 }
@@ -27,6 +27,8 @@ void heap_shutdown();
 int heap_fork(HANDLE process);
 void heap_afterfork_parent();
 void heap_afterfork_child();
+/* Return the objects cached by current thread, on thread exit */
+void heap_thread_exit();
 
 void *kmalloc(int size);
 void kfree(void *mem, int size);
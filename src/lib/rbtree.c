@@ -54,6 +54,12 @@ static __forceinline void rb_left_rotate(struct rb_tree *tree, struct rb_node *n
 		rb_set_parent(p->right, p);
 	n->left = p;
 	rb_set_parent(p, n);
+	/* The subtree of n now has the same nodes as the subtree of p had */
+	if (tree->augment)
+	{
+		tree->augment(p);
+		tree->augment(n);
+	}
 }
 
 static __forceinline void rb_right_rotate(struct rb_tree *tree, struct rb_node *n)
@@ -81,6 +87,11 @@ static __forceinline void rb_right_rotate(struct rb_tree *tree, struct rb_node *
 		rb_set_parent(p->left, p);
 	n->right = p;
 	rb_set_parent(p, n);
+	if (tree->augment)
+	{
+		tree->augment(p);
+		tree->augment(n);
+	}
 }
 
 static void rb_exchange(struct rb_tree *tree, struct rb_node *victim, struct rb_node *replacement)
@@ -119,6 +130,14 @@ static void rb_exchange(struct rb_tree *tree, struct rb_node *victim, struct rb_
 		rb_set_parent(replacement->right, replacement);
 }
 
+void rb_augment_path(struct rb_tree *tree, struct rb_node *node)
+{
+	if (!tree->augment)
+		return;
+	for (; node; node = rb_parent(node))
+		tree->augment(node);
+}
+
 static void rb_add_fixup(struct rb_tree *tree, struct rb_node *n)
 {
 	struct rb_node *p = rb_parent(n); /* parent */
@@ -215,6 +234,7 @@ void rb_add(struct rb_tree *tree, struct rb_node *node, rb_cmp *cmp)
 	{
 		tree->root = node;
 		rb_set_parent_and_color(node, NULL, RB_BLACK);
+		rb_augment_path(tree, node);
 		return;
 	}
 
@@ -243,6 +263,7 @@ void rb_add(struct rb_tree *tree, struct rb_node *node, rb_cmp *cmp)
 			cur = cur->right;
 		}
 	}
+	rb_augment_path(tree, node);
 	rb_add_fixup(tree, node);
 }
 
@@ -417,6 +438,8 @@ void rb_remove(struct rb_tree *tree, struct rb_node *node)
 		else
 			p->right = n;
 	}
+	/* Rotations in fixup keep ancestors of p as ancestors of p */
+	rb_augment_path(tree, p);
 }
 
 struct rb_node *rb_find(struct rb_tree *tree, const struct rb_node *value, rb_cmp *cmp)
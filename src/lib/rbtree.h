@@ -11,13 +11,17 @@ struct rb_node
 #define rb_entry(node, type, member) \
 	container_of(node, type, member)
 
+typedef int rb_cmp(const struct rb_node *left, const struct rb_node *right);
+
+/* Recompute augmented data of a node from its own data and its children */
+typedef void rb_augment(struct rb_node *node);
+
 struct rb_tree
 {
 	struct rb_node *root;
+	rb_augment *augment; /* NULL if the tree is not augmented */
 };
 
-typedef int rb_cmp(const struct rb_node *left, const struct rb_node *right);
-
 /* Test if the tree is empty */
 #define rb_empty(tree)	((tree)->root == NULL)
 
@@ -25,8 +29,19 @@ typedef int rb_cmp(const struct rb_node *left, const struct rb_node *right);
 #define rb_init(tree)	\
 	do { \
 		(tree)->root = NULL; \
+		(tree)->augment = NULL; \
 	} while (0)
 
+/* Initialize an augmented tree, augment is called on every node whose subtree changes */
+#define rb_init_augmented(tree, augment_func) \
+	do { \
+		(tree)->root = NULL; \
+		(tree)->augment = (augment_func); \
+	} while (0)
+
+/* Recompute augmented data from a node up to the root, used when data of the node changes */
+void rb_augment_path(struct rb_tree *tree, struct rb_node *node);
+
 /* Add a node to a tree */
 void rb_add(struct rb_tree *tree, struct rb_node *node, rb_cmp *cmp);
 
@@ -491,6 +491,25 @@ NTSYSAPI NTSTATUS NTAPI NtUnmapViewOfSection(
 	_In_opt_	PVOID BaseAddress
 	);
 
+typedef enum _SECTION_INFORMATION_CLASS {
+	SectionBasicInformation,
+	SectionImageInformation
+} SECTION_INFORMATION_CLASS;
+
+typedef struct _SECTION_BASIC_INFORMATION {
+	PVOID           BaseAddress;
+	ULONG           AllocationAttributes;
+	LARGE_INTEGER   MaximumSize;
+} SECTION_BASIC_INFORMATION, *PSECTION_BASIC_INFORMATION;
+
+NTSYSAPI NTSTATUS NTAPI NtQuerySection(
+	_In_		HANDLE SectionHandle,
+	_In_		SECTION_INFORMATION_CLASS InformationClass,
+	_Out_		PVOID InformationBuffer,
+	_In_		SIZE_T InformationBufferSize,
+	_Out_opt_	PSIZE_T ResultLength
+	);
+
 /* Thread */
 typedef struct _CLIENT_ID {
 	HANDLE UniqueProcess;
@@ -24,6 +24,7 @@
 #include <dbt/x86.h>
 #include <fs/winfs.h>
 #include <syscall/exec.h>
+#include <syscall/fork.h>
 #include <syscall/mm.h>
 #include <syscall/process.h>
 #include <syscall/syscall.h>
@@ -134,6 +135,54 @@ static void run(struct binfmt *binary, int argc, char *argv[], int env_size, cha
 	dbt_run(entrypoint, (size_t)stack);
 }
 
+/* Map a PT_LOAD segment at vaddr
+ * The file part is mapped as a private file mapping and the rest of .bss as anonymous memory, both are
+ * populated on demand, so exec only pays for the pages actually touched. The .bss part of the last file
+ * page is zeroed right away. A segment whose file offset is not congruent to its address, or a read only
+ * one with such a partial .bss page, is read into anonymous memory instead.
+ */
+static int load_elf_segment(struct file *f, Elf_Phdr *ph, size_t vaddr, int prot)
+{
+	size_t start = vaddr & ~(size_t)(PAGE_SIZE - 1);
+	size_t file_end = vaddr + ph->p_filesz;
+	size_t mem_end = vaddr + ph->p_memsz;
+	size_t file_map_end = ALIGN_TO(file_end, PAGE_SIZE);
+	size_t mem_map_end = ALIGN_TO(mem_end, PAGE_SIZE);
+	bool partial_bss = mem_end > file_end && file_map_end > file_end;
+	/* Executable pages are readable on x86, the translator reads the code as well */
+	if (prot & PROT_EXEC)
+		prot |= PROT_READ;
+	void *r;
+	if ((vaddr - ph->p_offset) % PAGE_SIZE || (partial_bss && !(prot & PROT_WRITE)))
+	{
+		log_info("Segment at %p cannot be mapped from the file, reading it.\n", vaddr);
+		r = mm_mmap((void*)start, mem_end - start, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, 0, NULL, 0);
+		if ((uintptr_t)r >= (uintptr_t)-4095)
+			return (int)(intptr_t)r;
+		mm_check_write((void*)vaddr, ph->p_filesz); /* Populate the memory, otherwise pread() will fail */
+		f->op_vtable->pread(f, (void*)vaddr, ph->p_filesz, ph->p_offset);
+		return 0;
+	}
+	if (file_map_end > start)
+	{
+		r = mm_mmap((void*)start, file_map_end - start, prot, MAP_PRIVATE | MAP_FIXED, 0, f,
+			(off_t)((ph->p_offset - (vaddr - start)) / PAGE_SIZE));
+		if ((uintptr_t)r >= (uintptr_t)-4095)
+			return (int)(intptr_t)r;
+		/* The rest of the last file page holds whatever follows the segment in the file */
+		if (partial_bss)
+			RtlZeroMemory((void*)file_end, min(file_map_end, mem_end) - file_end);
+	}
+	if (mem_map_end > file_map_end)
+	{
+		r = mm_mmap((void*)file_map_end, mem_map_end - file_map_end, prot, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, 0, NULL, 0);
+		if ((uintptr_t)r >= (uintptr_t)-4095)
+			return (int)(intptr_t)r;
+	}
+	return 0;
+}
+
 static int load_elf(struct file *f, struct binfmt *binary)
 {
 	Elf_Ehdr eh;
@@ -204,16 +253,14 @@ static int load_elf(struct file *f, struct binfmt *binary)
 #endif
 
 	/* Map executable segments */
-	/* TODO: Directly use mmap() */
 	int load_base_set = 0;
 	for (int i = 0; i < eh.e_phnum; i++)
 	{
 		Elf_Phdr *ph = (Elf_Phdr *)&elf->pht[eh.e_phentsize * i];
 		if (ph->p_type == PT_LOAD)
 		{
-			size_t addr = ph->p_vaddr & 0xFFFFF000;
-			size_t size = ph->p_memsz + (ph->p_vaddr & 0x00000FFF);
-			off_t offset_pages = ph->p_offset / PAGE_SIZE;
+			size_t addr = ph->p_vaddr & ~(size_t)(PAGE_SIZE - 1);
+			size_t size = ph->p_memsz + (ph->p_vaddr & (PAGE_SIZE - 1));
 
 			/* Note: In ET_DYN executables, all address are based upon elf->load_base.
 			 * But in ET_EXEC executables, all address are absolute.
@@ -225,15 +272,18 @@ static int load_elf(struct file *f, struct binfmt *binary)
 				prot |= PROT_WRITE;
 			if (ph->p_flags & PF_X)
 				prot |= PROT_EXEC;
+			size_t vaddr = ph->p_vaddr;
 			if (eh.e_type == ET_DYN)
+			{
 				addr += elf->load_base;
-			mm_mmap((void*)addr, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-				MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, 0, NULL, 0);
-			char *vaddr = (char *)ph->p_vaddr;
-			if (eh.e_type == ET_DYN)
 				vaddr += elf->load_base;
-			mm_check_write(vaddr, ph->p_filesz); /* Populate the memory, otherwise pread() will fail */
-			f->op_vtable->pread(f, vaddr, ph->p_filesz, ph->p_offset);
+			}
+			int r = load_elf_segment(f, ph, vaddr, prot);
+			if (r < 0)
+			{
+				log_error("Mapping PT_LOAD segment at %p failed.\n", vaddr);
+				return r;
+			}
 			if (!binary->interpreter) /* This is not interpreter */
 				mm_update_brk((void*)(addr + size));
 			if (eh.e_type == ET_EXEC && !load_base_set)
@@ -332,6 +382,41 @@ static int load_script(struct file *f, struct binfmt *binary)
 	return load_elf(fe, binary);
 }
 
+/* Open an executable file and read its magic */
+static int open_executable(const char *filename, struct file **f, char *magic)
+{
+	int r = vfs_openat(AT_FDCWD, filename, O_RDONLY, 0, f);
+	if (r < 0)
+		return r;
+	if (!winfs_is_winfile(*f))
+	{
+		vfs_release(*f);
+		return -EACCES;
+	}
+	r = (*f)->op_vtable->pread(*f, magic, 4, 0);
+	if (r < 4)
+	{
+		vfs_release(*f);
+		return -EACCES;
+	}
+	return 0;
+}
+
+int exec_check(const char *filename)
+{
+	struct file *f;
+	char magic[4];
+	int r = open_executable(filename, &f, magic);
+	if (r < 0)
+		return r;
+	vfs_release(f);
+	if (magic[0] == ELFMAG0 && magic[1] == ELFMAG1 && magic[2] == ELFMAG2 && magic[3] == ELFMAG3)
+		return 0;
+	if (magic[0] == '#' && magic[1] == '!')
+		return 0;
+	return -EACCES;
+}
+
 int do_execve(const char *filename, int argc, char *argv[], int env_size, char *envp[], char *buffer_base,
 	void (*initialize_routine)())
 {
@@ -341,17 +426,9 @@ int do_execve(const char *filename, int argc, char *argv[], int env_size, char *
 	int r;
 	char magic[4];
 	struct file *f;
-	r = vfs_openat(AT_FDCWD, filename, O_RDONLY, 0, &f);
+	r = open_executable(filename, &f, magic);
 	if (r < 0)
 		return r;
-	if (!winfs_is_winfile(f))
-	{
-		vfs_release(f);
-		return -EACCES;
-	}
-	r = f->op_vtable->pread(f, magic, 4, 0);
-	if (r < 4)
-		return -EACCES;
 
 	struct binfmt binary;
 	binary.argv0 = NULL;
@@ -379,6 +456,7 @@ int do_execve(const char *filename, int argc, char *argv[], int env_size, char *
 	else
 	{
 		log_error("Unknown binary magic: %c%c%c%c", magic[0], magic[1], magic[2], magic[3]);
+		vfs_release(f);
 		return -EACCES;
 	}
 	vfs_release(f);
@@ -389,6 +467,7 @@ int do_execve(const char *filename, int argc, char *argv[], int env_size, char *
 	}
 
 	/* Execute file */
+	process_set_comm(filename);
 	if (binary.replace_argv0)
 		argv[0] = (char *)filename;
 	run(&binary, argc, argv, env_size, envp);
@@ -405,6 +484,14 @@ static void execve_initialize_routine()
 	dbt_reset();
 }
 
+void exec_vfork_child(const char *filename, int argc, char *argv[], int env_size, char *envp[], char *buffer_base)
+{
+	do_execve(filename, argc, argv, env_size, envp, buffer_base, execve_initialize_routine);
+	/* The file was checked by the parent, but it could have been changed since then */
+	log_error("execve() in vfork child failed.\n");
+	process_exit(127, 0);
+}
+
 static char *flip_startup_base()
 {
 	if (*(uintptr_t*)startup)
@@ -473,7 +560,19 @@ DEFINE_SYSCALL(execve, const char *, filename, char **, argv, char **, envp)
 
 	base = (char *)(new_envp + env_size + 1);
 
-	int r = do_execve(filename, argc, new_argv, env_size, new_envp, base, execve_initialize_routine);
+	int r;
+	if (vfork_is_child())
+	{
+		/* Start the program in a new process, then let the parent of vfork() continue */
+		r = vfork_exec(filename, argc, new_argv, env_size, new_envp, base);
+		if (r > 0)
+		{
+			flip_startup_base();
+			vfork_return(r);
+		}
+	}
+	else
+		r = do_execve(filename, argc, new_argv, env_size, new_envp, base, execve_initialize_routine);
 	if (r < 0) /* Should always be the case */
 	{
 		log_warning("execve() failed.\n");
@@ -25,4 +25,9 @@
 int do_execve(const char *filename, int argc, char *argv[], int env_size, char *envp[], char *buffer_base,
 	void(*initialize_routine)());
 
+/* Check whether a file can be executed, returns 0 or a negative error code */
+int exec_check(const char *filename);
+/* Run the program given to execve() by a vfork() child, called in the newly created process */
+__declspec(noreturn) void exec_vfork_child(const char *filename, int argc, char *argv[], int env_size, char *envp[], char *buffer_base);
+
 int exec_fork(HANDLE process);
@@ -17,15 +17,19 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <common/errno.h>
 #include <common/sched.h>
 #include <common/types.h>
 #include <common/ptrace.h>
 #include <dbt/x86.h>
+#include <syscall/exec.h>
 #include <syscall/fork.h>
 #include <syscall/mm.h>
 #include <syscall/process.h>
+#include <syscall/sig.h>
 #include <syscall/syscall.h>
 #include <syscall/tls.h>
+#include <syscall/vfs.h>
 #include <heap.h>
 #include <log.h>
 
@@ -36,11 +40,24 @@
  *
  * 1. Create a process using CreateProcessW() and set command line to the special "/?/fork"
  * 2. Call mm_fork() to initialize memory mappings in the child process
+ *    Call dbt_fork() to let the child inherit the translated code cache
  * 3. Set up fork_info
  * 4. Copy thread stack
  * 5. Wake up child process, it will use fork_info to restore context
  */
 
+/* What a vfork() child does in the new process: run a program or just exit */
+struct vfork_exec
+{
+	const char *filename; /* NULL if the child exited without calling execve() */
+	int argc;
+	char **argv;
+	int env_size;
+	char **envp;
+	char *buffer_base;
+	int exit_code;
+};
+
 struct fork_info
 {
 	struct syscall_context context;
@@ -50,10 +67,19 @@ struct fork_info
 	pid_t pid;
 	int gs;
 	struct user_desc tls_data;
+	bool vfork;
+	struct vfork_exec exec;
 } _fork;
 
 static struct fork_info *fork = &_fork;
 
+/* Path of our executable, fork children are created from it
+ * There is no pool of pre-created children: they would inherit the handles which are
+ * inheritable at creation time instead of at fork time, so they could miss newly opened files
+ * and keep other ends of pipes open long after the parent has closed them.
+ */
+static wchar_t fork_filename[MAX_PATH];
+
 __declspec(noreturn) static void fork_child()
 {
 	install_syscall_handler();
@@ -64,6 +90,13 @@ __declspec(noreturn) static void fork_child()
 	tls_afterfork_child();
 	vfs_afterfork_child();
 	dbt_init();
+	if (fork->vfork)
+	{
+		if (fork->exec.filename)
+			exec_vfork_child(fork->exec.filename, fork->exec.argc, fork->exec.argv,
+				fork->exec.env_size, fork->exec.envp, fork->exec.buffer_base);
+		process_exit(fork->exec.exit_code, 0);
+	}
 	if (fork->ctid)
 		*(pid_t *)fork->ctid = fork->pid;
 	dbt_restore_fork_context(&fork->context);
@@ -71,6 +104,7 @@ __declspec(noreturn) static void fork_child()
 
 void fork_init()
 {
+	GetModuleFileNameW(NULL, fork_filename, sizeof(fork_filename) / sizeof(fork_filename[0]));
 	if (!strcmp(GetCommandLineA(), "/?/fork"))
 	{
 		/* We're a fork child */
@@ -105,12 +139,10 @@ void fork_init()
 		{
 			/* Not good, create a child process and hope this time we can do it better */
 			log_warning("The address %p is occupied, we have to create another process to proceed.\n", region_start);
-			wchar_t filename[MAX_PATH];
-			GetModuleFileNameW(NULL, filename, sizeof(filename) / sizeof(filename[0]));
 			PROCESS_INFORMATION info;
 			STARTUPINFOW si = { 0 };
 			si.cb = sizeof(si);
-			if (!CreateProcessW(filename, GetCommandLineW(), NULL, NULL, TRUE, CREATE_SUSPENDED, NULL, NULL, &si, &info))
+			if (!CreateProcessW(fork_filename, GetCommandLineW(), NULL, NULL, TRUE, CREATE_SUSPENDED, NULL, NULL, &si, &info))
 			{
 				log_error("CreateProcessW() failed, error code: %d\n", GetLastError());
 				process_exit(1, 0);
@@ -154,15 +186,18 @@ void fork_init()
  o CLONE_NEWNET
  o CLONE_IO
 */
-static pid_t fork_process(struct syscall_context *context, unsigned long flags, void *ptid, void *ctid)
+/* If exec is not NULL, the process is created for a vfork() child which calls execve() or exits
+ * Only kernel memory is duplicated and the child does not restore any user context
+ */
+static pid_t fork_process(struct syscall_context *context, unsigned long flags, void *ptid, void *ctid,
+	const struct vfork_exec *exec)
 {
-	wchar_t filename[MAX_PATH];
-	GetModuleFileNameW(NULL, filename, sizeof(filename) / sizeof(filename[0]));
-	
+	/* CreateProcessW() may modify the command line, it cannot be a string literal */
+	wchar_t cmdline[] = L"/?/fork";
 	PROCESS_INFORMATION info;
 	STARTUPINFOW si = { 0 };
 	si.cb = sizeof(si);
-	if (!CreateProcessW(filename, L"/?/fork", NULL, NULL, TRUE, CREATE_SUSPENDED, NULL, NULL, &si, &info))
+	if (!CreateProcessW(fork_filename, cmdline, NULL, NULL, TRUE, CREATE_SUSPENDED, NULL, NULL, &si, &info))
 	{
 		log_warning("fork(): CreateProcessW() failed.\n");
 		return -1;
@@ -171,38 +206,55 @@ static pid_t fork_process(struct syscall_context *context, unsigned long flags,
 	if (!tls_fork(info.hProcess))
 		goto fail;
 
-	if (!mm_fork(info.hProcess))
-		goto fail;
-
+	/* The heap lives in copy on fork memory, it is locked before mm_fork() copies it */
 	if (!heap_fork(info.hProcess))
-		goto fail;
+		goto fail_tls;
+
+	if (!(exec? mm_fork_kernel(info.hProcess): mm_fork(info.hProcess)))
+		goto fail_heap;
 
 	if (!signal_fork(info.hProcess))
-		goto fail;
+		goto fail_mm;
 
 	if (!process_fork(info.hProcess))
-		goto fail;
+		goto fail_signal;
 
 	if (!vfs_fork(info.hProcess))
-		goto fail;
+		goto fail_process;
 
 	if (!exec_fork(info.hProcess))
-		goto fail;
+		goto fail_vfs;
+
+	/* The code cache is useless to a child which is going to exec */
+	if (!exec)
+		dbt_fork(info.hProcess);
 
 	pid_t pid = process_init_child(info.dwProcessId, info.dwThreadId, info.hProcess);
+	if (exec && (vfork_pgid || vfork_sid))
+		process_set_child_ids(pid, vfork_pgid < 0 ? pid : vfork_pgid, vfork_sid < 0 ? pid : vfork_sid);
 
 	/* Set up fork_info in child process */
 	void *stack_base = process_get_stack_base();
-	WriteProcessMemory(info.hProcess, &fork->context, context, sizeof(struct syscall_context), NULL);
 	WriteProcessMemory(info.hProcess, &fork->stack_base, &stack_base, sizeof(stack_base), NULL);
 	WriteProcessMemory(info.hProcess, &fork->pid, &pid, sizeof(pid_t), NULL);
-	if (flags & CLONE_CHILD_SETTID)
-		WriteProcessMemory(info.hProcess, &fork->ctid, &ctid, sizeof(void*), NULL);
-
-	/* Copy stack */
 	VirtualAllocEx(info.hProcess, stack_base, STACK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE);
-	WriteProcessMemory(info.hProcess, (LPVOID)context->esp, (LPCVOID)context->esp,
-		(SIZE_T)((char *)stack_base + STACK_SIZE - context->esp), NULL);
+	if (exec)
+	{
+		bool vfork = true;
+		WriteProcessMemory(info.hProcess, &fork->vfork, &vfork, sizeof(bool), NULL);
+		WriteProcessMemory(info.hProcess, &fork->exec, exec, sizeof(struct vfork_exec), NULL);
+	}
+	else
+	{
+		WriteProcessMemory(info.hProcess, &fork->context, context, sizeof(struct syscall_context), NULL);
+		if (flags & CLONE_CHILD_SETTID)
+			WriteProcessMemory(info.hProcess, &fork->ctid, &ctid, sizeof(void*), NULL);
+
+		/* Copy stack, a child stack given to clone() is ordinary memory already duplicated by mm_fork() */
+		if ((char *)context->esp >= (char *)stack_base && (char *)context->esp < (char *)stack_base + STACK_SIZE)
+			WriteProcessMemory(info.hProcess, (LPVOID)context->esp, (LPCVOID)context->esp,
+				(SIZE_T)((char *)stack_base + STACK_SIZE - context->esp), NULL);
+	}
 	ResumeThread(info.hThread);
 	CloseHandle(info.hThread);
 
@@ -211,12 +263,25 @@ static pid_t fork_process(struct syscall_context *context, unsigned long flags,
 	tls_afterfork_parent();
 	process_afterfork_parent();
 	signal_afterfork_parent();
-	heap_afterfork_parent();
 	mm_afterfork_parent();
+	heap_afterfork_parent();
 
 	log_info("Child pid: %d, win_pid: %d\n", pid, info.dwProcessId);
 	return pid;
 
+	/* Every successful *_fork() call keeps its subsystem locked, release them in reverse order */
+fail_vfs:
+	vfs_afterfork_parent();
+fail_process:
+	process_afterfork_parent();
+fail_signal:
+	signal_afterfork_parent();
+fail_mm:
+	mm_afterfork_parent();
+fail_heap:
+	heap_afterfork_parent();
+fail_tls:
+	tls_afterfork_parent();
 fail:
 	TerminateProcess(info.hProcess, 0);
 	CloseHandle(info.hThread);
@@ -264,16 +329,126 @@ static pid_t fork_thread(struct syscall_context *context, void *child_stack, uns
 	return pid;
 }
 
+/* vfork()
+ *
+ * Like Linux, the child of vfork() runs on the parent's address space and the parent is suspended
+ * until the child calls execve() or exits. Here the child simply runs in the calling thread, after
+ * the parent's context, file descriptor table and signal state are saved. No address space
+ * duplication is done at all.
+ *
+ * When the child calls execve(), a new process is created with only kernel memory duplicated
+ * (mm_fork_kernel()), which directly loads the program with the argument and environment data
+ * the child prepared in the startup area. Then the saved state is put back and the parent continues
+ * with the pid of the new process as the return value of vfork(). If the child exits instead, the new
+ * process just exits with the same code so the parent can still wait for it.
+ *
+ * Until then the child sees the parent's pid. Other threads of the parent would keep running and see
+ * the file descriptor and signal changes of the child, so a multithreaded process does a normal fork.
+ * Process group and session changes of the child are recorded and applied to the new process.
+ */
+static SRWLOCK vfork_lock = SRWLOCK_INIT;
+static struct syscall_context vfork_context;
+static __declspec(thread) bool vfork_child;
+/* Process group and session of the new process, 0 if unchanged, -1 for its own pid */
+static pid_t vfork_pgid, vfork_sid;
+
+static pid_t vfork_process(struct syscall_context *context, void *child_stack)
+{
+	if (vfork_child || process_get_thread_count() > 1)
+	{
+		/* Nested vfork(), the saved state is in use, or other threads may observe the child, just do a normal fork */
+		if (child_stack)
+		{
+			struct syscall_context child_context = *context;
+			child_context.esp = (DWORD)child_stack;
+			return fork_process(&child_context, 0, NULL, NULL, NULL);
+		}
+		return fork_process(context, 0, NULL, NULL, NULL);
+	}
+	AcquireSRWLockExclusive(&vfork_lock);
+	vfork_context = *context;
+	vfork_pgid = 0;
+	vfork_sid = 0;
+	vfs_vfork_save();
+	signal_vfork_save();
+	vfork_child = true;
+	if (child_stack)
+	{
+		/* clone() with a separate child stack, used by posix_spawn() */
+		struct syscall_context child_context = *context;
+		child_context.esp = (DWORD)child_stack;
+		child_context.eax = 0;
+		dbt_resume_context(&child_context);
+	}
+	return 0;
+}
+
+bool vfork_is_child()
+{
+	return vfork_child;
+}
+
+pid_t vfork_exec(const char *filename, int argc, char *argv[], int env_size, char *envp[], char *buffer_base)
+{
+	/* Errors are reported to the child, the new process has no way back */
+	int r = exec_check(filename);
+	if (r < 0)
+		return r;
+	struct vfork_exec exec;
+	exec.filename = filename;
+	exec.argc = argc;
+	exec.argv = argv;
+	exec.env_size = env_size;
+	exec.envp = envp;
+	exec.buffer_base = buffer_base;
+	exec.exit_code = 0;
+	pid_t pid = fork_process(NULL, 0, NULL, NULL, &exec);
+	if (pid < 0)
+		return -EAGAIN;
+	return pid;
+}
+
+__declspec(noreturn) void vfork_return(pid_t pid)
+{
+	struct syscall_context context = vfork_context;
+	context.eax = pid;
+	signal_vfork_restore();
+	vfs_vfork_restore();
+	vfork_child = false;
+	ReleaseSRWLockExclusive(&vfork_lock);
+	log_info("vfork(): Resuming parent, child pid: %d\n", pid);
+	dbt_resume_context(&context);
+}
+
+void vfork_setpgid(pid_t pgid)
+{
+	vfork_pgid = pgid ? pgid : -1;
+}
+
+void vfork_setsid()
+{
+	vfork_pgid = -1;
+	vfork_sid = -1;
+}
+
+__declspec(noreturn) void vfork_exit(int status)
+{
+	struct vfork_exec exec = { 0 };
+	exec.exit_code = status;
+	pid_t pid = fork_process(NULL, 0, NULL, NULL, &exec);
+	vfork_return(pid < 0? -EAGAIN: pid);
+}
+
 int sys_fork_imp(struct syscall_context *context)
 {
 	log_info("fork()\n");
-	return fork_process(context, 0, NULL, NULL);
+	return fork_process(context, 0, NULL, NULL, NULL);
 }
 
 int sys_vfork_imp(struct syscall_context *context)
 {
 	log_info("vfork()\n");
-	return fork_process(context, 0, NULL, NULL);
+	return vfork_process(context, NULL);
 }
 
 #ifdef _WIN64
@@ -285,6 +460,8 @@ int sys_clone_imp(struct syscall_context *context, unsigned long flags, void *ch
 	log_info("sys_clone(flags=%x, child_stack=%p, ptid=%p, ctid=%p)\n", flags, child_stack, ptid, ctid);
 	if (flags & CLONE_THREAD)
 		return fork_thread(context, child_stack, flags, ptid, ctid);
+	else if ((flags & (CLONE_VM | CLONE_VFORK)) == (CLONE_VM | CLONE_VFORK))
+		return vfork_process(context, child_stack);
 	else
-		return fork_process(context, flags, ptid, ctid);
+		return fork_process(context, flags, ptid, ctid, NULL);
 }
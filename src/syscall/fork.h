@@ -19,4 +19,20 @@
 
 #pragma once
 
+#include <common/types.h>
+
+#include <stdbool.h>
+
 void fork_init();
+
+/* Whether the current thread is running the child of vfork() */
+bool vfork_is_child();
+/* execve() in a vfork() child, returns the pid of the new process or a negative error code */
+pid_t vfork_exec(const char *filename, int argc, char *argv[], int env_size, char *envp[], char *buffer_base);
+/* Resume the parent of vfork(), with pid as the return value */
+__declspec(noreturn) void vfork_return(pid_t pid);
+/* exit() in a vfork() child */
+__declspec(noreturn) void vfork_exit(int status);
+/* setpgid(0, pgid) and setsid() in a vfork() child, applied to the new process instead of the parent */
+void vfork_setpgid(pid_t pgid);
+void vfork_setsid();
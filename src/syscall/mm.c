@@ -25,8 +25,10 @@
 #include <syscall/syscall.h>
 #include <syscall/vfs.h>
 #include <log.h>
+#include <str.h>
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
@@ -87,6 +89,9 @@
 
 #define GET_SECTION_TABLE(i) ((i) / SECTION_HANDLE_PER_TABLE)
 
+/* Number of block locks for page faults, blocks are assigned to them round robin */
+#define FAULT_LOCK_COUNT 256
+
 /* Helper macros */
 #define IS_ALIGNED(addr, alignment) ((size_t) (addr) % (size_t) (alignment) == 0)
 #define ALIGN_TO_BLOCK(addr) (((size_t) addr + BLOCK_SIZE - 1) & (-BLOCK_SIZE))
@@ -117,6 +122,11 @@ struct map_entry
 			int prot, flags;
 			struct file *f;
 			off_t offset_pages;
+			/* Fault-around state, see fault_around() */
+			size_t fault_next_block; /* Block of the next fault if access is sequential */
+			size_t fault_window; /* Number of blocks populated ahead on next sequential fault */
+			/* Free pages between the previous entry and this one, and the largest such gap in the subtree */
+			size_t gap, max_gap;
 		};
 	};
 };
@@ -133,6 +143,17 @@ static int map_entry_cmp(const struct rb_node *l, const struct rb_node *r)
 		return 1;
 }
 
+static void map_entry_augment(struct rb_node *node)
+{
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	size_t max_gap = e->gap;
+	if (node->left)
+		max_gap = max(max_gap, rb_entry(node->left, struct map_entry, tree)->max_gap);
+	if (node->right)
+		max_gap = max(max_gap, rb_entry(node->right, struct map_entry, tree)->max_gap);
+	e->max_gap = max_gap;
+}
+
 struct mm_data
 {
 	/* RW lock for multi-threading protection */
@@ -140,6 +161,9 @@ struct mm_data
 
 	/* Program break address, brk() will use this */
 	void *brk;
+	size_t brk_start; /* Initial program break */
+	size_t brk_mapped; /* End of the heap mapping, pages between brk and it are kept after shrinking */
+	size_t brk_limit; /* End of the brk arena */
 
 	/* Used for mm_static_alloc() */
 	void *static_alloc_begin, *static_alloc_end;
@@ -151,13 +175,93 @@ struct mm_data
 	/* Information for all existing mappings */
 	struct rb_tree entry_tree;
 	struct slist entry_free_list;
-	struct map_entry entries[MAX_MMAP_COUNT];
+	size_t entry_count; /* Number of entries ever handed out, the rest of entries[] is never touched */
+	/* Entry found by the last find_map_entry(), updated concurrently by page faults under the shared lock
+	 * Entries are only removed with rw_lock held exclusively, which also clears the cache */
+	struct map_entry *volatile find_cache;
 
 	/* Section handle count for each table */
 	uint16_t section_table_handle_count[SECTION_TABLE_COUNT];
+
+	/* Page faults hold rw_lock shared and serialize on the lock of the faulting block, see get_fault_lock() */
+	SRWLOCK fault_lock[FAULT_LOCK_COUNT];
+
+	/* Maximum number of blocks populated ahead of a sequential on demand fault, 0 to disable */
+	unsigned int fault_around_max;
+
+	/* Large page backing, see MM_HUGEPAGE_* */
+	unsigned int hugepage_mode;
+	size_t hugepage_size; /* Large page size, 0 if large pages are not available, -1 if not determined yet */
+	size_t hugepage_usage; /* Bytes of memory currently backed by large pages */
+
+	/* Statistics */
+	struct mm_stats
+	{
+		uint64_t on_demand_faults; /* Faults on blocks without a section */
+		uint64_t cow_faults; /* Write faults on shared sections */
+		uint64_t duplicated_blocks; /* Blocks copied to a new section by CoW faults, mprotect() or munmap() */
+		uint64_t cow_pages; /* Pages copied individually by CoW faults, see copy_page_on_write() */
+		uint64_t private_merges; /* Blocks with individually copied pages merged back to a section */
+		uint64_t fault_around_hits; /* Faults on the block predicted by fault-around */
+		uint64_t fault_around_misses; /* Faults breaking a sequential pattern */
+		uint64_t fault_around_blocks; /* Blocks populated ahead by fault-around */
+		uint64_t writeback_writes; /* Writes issued for dirty MAP_SHARED file pages */
+		uint64_t writeback_pages; /* Dirty MAP_SHARED file pages written back */
+		uint64_t forks; /* Number of mm_fork() calls */
+		uint64_t exec_forks; /* Number of mm_fork_kernel() calls */
+		uint64_t fork_data_us; /* Time spent copying mm_data and section handle tables */
+		uint64_t fork_map_us; /* Time spent mapping sections in the child */
+		uint64_t fork_protect_us; /* Time spent changing page protection in both processes */
+		uint64_t fork_copy_us; /* Time spent copying copy on fork regions */
+		uint64_t dontneed_blocks; /* Blocks released by madvise(MADV_DONTNEED) */
+		uint64_t dontneed_pages; /* Pages refilled in place by madvise(MADV_DONTNEED) */
+		uint64_t reset_pages; /* Pages discarded by madvise(MADV_FREE) or munmap() */
+		uint64_t hugepage_allocs; /* Mappings backed by large pages */
+		uint64_t hugepage_fallbacks; /* Failed large page allocations which fell back to ordinary blocks */
+		uint64_t hugepage_splits; /* Large page backed mappings moved to ordinary blocks */
+		uint64_t brk_grows; /* brk() calls which extended the heap mapping in place */
+		uint64_t brk_trims; /* brk() calls which unmapped unused heap pages */
+		uint64_t protect_ranges; /* Page ranges submitted to the protection planner, see struct prot_plan */
+		uint64_t protect_calls; /* VirtualProtectEx() calls issued by the protection planner */
+		uint64_t mprotect_calls; /* Number of mprotect() calls */
+		uint64_t mprotect_protect_calls; /* Protection calls issued by mprotect() */
+		uint64_t munmap_calls; /* Number of unmap operations, including those done by mmap(), mremap() and brk() */
+		uint64_t munmap_protect_calls; /* Protection calls issued by unmap operations */
+		uint64_t fork_protect_calls; /* Protection calls issued by fork() in both processes */
+		uint64_t mremap_protect_calls; /* Protection calls issued by mremap() for moved mappings */
+	} stats;
+
+	/* Background write back thread for msync(MS_ASYNC), created on first use */
+	HANDLE flusher_thread, flusher_event;
+
+	/* Map entry storage, must be the last member, mm_fork() only copies live entries
+	 * Entries are handed out in order as needed, so untouched pages of it are never committed
+	 */
+	struct map_entry entries[MAX_MMAP_COUNT];
 } _mm;
 static struct mm_data *const mm = &_mm;
+
+/* Update a statistics counter from the page fault path, which runs concurrently in multiple threads */
+#define FAULT_STAT_ADD(counter, value) InterlockedExchangeAdd64((volatile LONG64 *)&mm->stats.counter, (LONG64)(value))
+#define FAULT_STAT_INC(counter) FAULT_STAT_ADD(counter, 1)
+
+static __forceinline SRWLOCK *get_fault_lock(size_t block)
+{
+	return &mm->fault_lock[block % FAULT_LOCK_COUNT];
+}
 static HANDLE *mm_section_handle;
+/* Dirty page mask of each block in MAP_SHARED file mappings, committed along with section handle tables */
+static uint16_t *mm_block_dirty;
+/* Mask of pages of each private block copied into our own view by Windows, see copy_page_on_write()
+ * Committed along with section handle tables as well */
+static uint16_t *mm_block_private;
+#define DIRTY_MASK_TABLE_SIZE (SECTION_HANDLE_PER_TABLE * sizeof(uint16_t))
+/* Kind of section of each block, set when the block is mapped and committed along with section handle tables */
+#define BLOCK_TYPE_ANONYMOUS	0 /* Anonymous section, see allocate_block() */
+#define BLOCK_TYPE_FILE			1 /* View of a file, see map_file_block() */
+#define BLOCK_TYPE_SHM			2 /* View of a shared memory object, see map_shm_block() */
+static uint8_t *mm_block_type;
+#define BLOCK_TYPE_TABLE_SIZE (SECTION_HANDLE_PER_TABLE * sizeof(uint8_t))
 
 static __forceinline HANDLE get_section_handle(size_t i)
 {
@@ -168,35 +272,69 @@ static __forceinline HANDLE get_section_handle(size_t i)
 		return NULL;
 }
 
-static __forceinline void add_section_handle(size_t i, HANDLE handle)
+/* Page faults on different blocks add section handles concurrently, while tables are only released
+ * with rw_lock held exclusively. The tables are committed before the count is raised, so a nonzero
+ * count always means a usable table. Committing a table twice when racing on its first handle is harmless.
+ */
+static __forceinline void add_section_handle(size_t i, HANDLE handle, int type)
 {
 	size_t t = GET_SECTION_TABLE(i);
-	if (mm->section_table_handle_count[t]++)
-		mm_section_handle[i] = handle;
-	else
+	if (!mm->section_table_handle_count[t])
 	{
 		VirtualAlloc(&mm_section_handle[t * SECTION_HANDLE_PER_TABLE], BLOCK_SIZE, MEM_COMMIT, PAGE_READWRITE);
-		mm_section_handle[i] = handle;
+		VirtualAlloc(&mm_block_dirty[t * SECTION_HANDLE_PER_TABLE], DIRTY_MASK_TABLE_SIZE, MEM_COMMIT, PAGE_READWRITE);
+		VirtualAlloc(&mm_block_private[t * SECTION_HANDLE_PER_TABLE], DIRTY_MASK_TABLE_SIZE, MEM_COMMIT, PAGE_READWRITE);
+		VirtualAlloc(&mm_block_type[t * SECTION_HANDLE_PER_TABLE], BLOCK_TYPE_TABLE_SIZE, MEM_COMMIT, PAGE_READWRITE);
 	}
+	InterlockedIncrement16((volatile SHORT *)&mm->section_table_handle_count[t]);
+	mm_block_type[i] = (uint8_t)type;
+	mm_section_handle[i] = handle;
 }
 
+/* The block is moved to a new anonymous section, see take_block_ownership() */
 static __forceinline void replace_section_handle(size_t i, HANDLE handle)
 {
 	mm_section_handle[i] = handle;
+	mm_block_private[i] = 0;
+	mm_block_type[i] = BLOCK_TYPE_ANONYMOUS;
 }
 
 static __forceinline void remove_section_handle(size_t i)
 {
 	mm_section_handle[i] = NULL;
+	mm_block_dirty[i] = 0;
+	mm_block_private[i] = 0;
+	mm_block_type[i] = BLOCK_TYPE_ANONYMOUS;
 	size_t t = GET_SECTION_TABLE(i);
 	if (--mm->section_table_handle_count[t] == 0)
+	{
 		VirtualFree(&mm_section_handle[t * SECTION_HANDLE_PER_TABLE], BLOCK_SIZE, MEM_DECOMMIT);
+		VirtualFree(&mm_block_dirty[t * SECTION_HANDLE_PER_TABLE], DIRTY_MASK_TABLE_SIZE, MEM_DECOMMIT);
+		VirtualFree(&mm_block_private[t * SECTION_HANDLE_PER_TABLE], DIRTY_MASK_TABLE_SIZE, MEM_DECOMMIT);
+		VirtualFree(&mm_block_type[t * SECTION_HANDLE_PER_TABLE], BLOCK_TYPE_TABLE_SIZE, MEM_DECOMMIT);
+	}
+}
+
+/* Whether a populated block is a view of a file (see map_file_block()) */
+static __forceinline bool is_file_block(size_t i)
+{
+	return mm_block_type[i] == BLOCK_TYPE_FILE;
+}
+
+/* Whether a populated block is a view of a file or shared memory object, which is mapped at a section offset */
+static __forceinline bool is_object_block(size_t i)
+{
+	return mm_block_type[i] != BLOCK_TYPE_ANONYMOUS;
 }
 
 static struct map_entry *new_map_entry()
 {
 	if (slist_empty(&mm->entry_free_list))
-		return NULL;
+	{
+		if (mm->entry_count == MAX_MMAP_COUNT)
+			return NULL;
+		return &mm->entries[mm->entry_count++];
+	}
 	struct map_entry *entry = slist_next_entry(&mm->entry_free_list, struct map_entry, free_list);
 	slist_remove(&mm->entry_free_list, &entry->free_list);
 	return entry;
@@ -207,6 +345,54 @@ static void free_map_entry(struct map_entry *entry)
 	slist_add(&mm->entry_free_list, &entry->free_list);
 }
 
+/* First page after an entry which can be used by another entry */
+static size_t entry_next_free_page(struct map_entry *e)
+{
+	size_t page = e->end_page + 1;
+	/* MAP_SHARED entries always occupy entire blocks */
+	if (e->flags & INTERNAL_MAP_SHARED)
+		page = (page + PAGES_PER_BLOCK - 1) & -PAGES_PER_BLOCK;
+	/* The brk arena is reserved for the heap */
+	if (e->flags & INTERNAL_MAP_BRK)
+		page = max(page, GET_PAGE(mm->brk_limit));
+	return page;
+}
+
+/* Recompute the gap before an entry */
+static void update_entry_gap(struct map_entry *e)
+{
+	struct rb_node *prev = rb_prev(&e->tree);
+	size_t gap_start = prev? entry_next_free_page(rb_entry(prev, struct map_entry, tree)): GET_PAGE(ADDRESS_SPACE_LOW);
+	e->gap = e->start_page > gap_start? e->start_page - gap_start: 0;
+	rb_augment_path(&mm->entry_tree, &e->tree);
+}
+
+/* Recompute the gap after an entry, called when its end changes */
+static void update_next_gap(struct map_entry *e)
+{
+	struct rb_node *next = rb_next(&e->tree);
+	if (next)
+		update_entry_gap(rb_entry(next, struct map_entry, tree));
+}
+
+static void insert_map_entry(struct map_entry *e)
+{
+	e->gap = 0;
+	rb_add(&mm->entry_tree, &e->tree, map_entry_cmp);
+	update_entry_gap(e);
+	update_next_gap(e);
+}
+
+static void remove_map_entry(struct map_entry *e)
+{
+	struct rb_node *next = rb_next(&e->tree);
+	if (mm->find_cache == e)
+		mm->find_cache = NULL;
+	rb_remove(&mm->entry_tree, &e->tree);
+	if (next)
+		update_entry_gap(rb_entry(next, struct map_entry, tree));
+}
+
 static struct rb_node *start_node(size_t start_page)
 {
 	struct map_entry probe;
@@ -221,11 +407,21 @@ static struct map_entry *find_map_entry(void *addr)
 {
 	struct map_entry probe, *entry;
 	size_t page = GET_PAGE(addr);
+	/* Faults tend to hit the same entry repeatedly */
+	entry = mm->find_cache;
+	if (entry && page >= entry->start_page && page <= entry->end_page)
+		return entry;
 	probe.start_page = page;
-	entry = rb_entry(rb_upper_bound(&mm->entry_tree, &probe.tree, map_entry_cmp), struct map_entry, tree);
+	struct rb_node *node = rb_upper_bound(&mm->entry_tree, &probe.tree, map_entry_cmp);
+	if (!node)
+		return NULL;
+	entry = rb_entry(node, struct map_entry, tree);
 	/* upper bound condition: block->start_page <= page */
 	if (page <= entry->end_page)
+	{
+		InterlockedExchangePointer((PVOID volatile *)&mm->find_cache, entry);
 		return entry;
+	}
 	return NULL;
 }
 
@@ -240,15 +436,97 @@ static void split_map_entry(struct map_entry *e, size_t last_page_of_first_entry
 		ne->offset_pages = e->offset_pages + (ne->start_page - e->start_page);
 	}
 	ne->prot = e->prot;
+	ne->flags = e->flags;
+	ne->fault_next_block = 0;
+	ne->fault_window = 0;
 	e->end_page = last_page_of_first_entry;
-	rb_add(&mm->entry_tree, &ne->tree, map_entry_cmp);
+	insert_map_entry(ne);
+}
+
+/* Protection change planner
+ * Callers describe the protection of page ranges in ascending address order, adjacent ranges with
+ * the same protection are merged and issued with a single VirtualProtectEx() call. A call cannot span
+ * multiple mapped views, and every block is a view of its own, so ranges are merged up to a block.
+ * The number of calls issued is added to a statistics counter to tell the cost of each syscall.
+ */
+struct prot_plan
+{
+	HANDLE process;
+	uint64_t *counter;
+	size_t start_page, end_page; /* Pending range, empty if start_page > end_page */
+	DWORD protection;
+};
+
+static void prot_plan_init(struct prot_plan *plan, HANDLE process, uint64_t *counter)
+{
+	plan->process = process;
+	plan->counter = counter;
+	plan->start_page = 1;
+	plan->end_page = 0;
+	plan->protection = 0;
+}
+
+/* Issue the pending protection change */
+static bool prot_plan_flush(struct prot_plan *plan)
+{
+	if (plan->start_page > plan->end_page)
+		return true;
+	size_t start_page = plan->start_page, end_page = plan->end_page;
+	plan->start_page = 1;
+	plan->end_page = 0;
+	(*plan->counter)++;
+	mm->stats.protect_calls++;
+	DWORD oldProtect;
+	if (!VirtualProtectEx(plan->process, GET_PAGE_ADDRESS(start_page), PAGE_SIZE * (end_page - start_page + 1), plan->protection, &oldProtect))
+	{
+		log_error("VirtualProtectEx(0x%p, 0x%p) failed, error code: %d.\n", GET_PAGE_ADDRESS(start_page),
+			PAGE_SIZE * (end_page - start_page + 1), GetLastError());
+		return false;
+	}
+	return true;
+}
+
+/* Change protection of pages [start_page, end_page], which must be inside a single block */
+static bool prot_plan_add(struct prot_plan *plan, size_t start_page, size_t end_page, DWORD protection)
+{
+	mm->stats.protect_ranges++;
+	if (plan->start_page <= plan->end_page && start_page == plan->end_page + 1 && protection == plan->protection
+		&& GET_BLOCK_OF_PAGE(start_page) == GET_BLOCK_OF_PAGE(plan->end_page))
+	{
+		plan->end_page = end_page;
+		return true;
+	}
+	if (!prot_plan_flush(plan))
+		return false;
+	plan->start_page = start_page;
+	plan->end_page = end_page;
+	plan->protection = protection;
+	return true;
+}
+
+/* The block is about to be unmapped, a pending change inside it is pointless and dropped */
+static bool prot_plan_unmap_block(struct prot_plan *plan, size_t block)
+{
+	if (plan->start_page <= plan->end_page && GET_BLOCK_OF_PAGE(plan->start_page) == block)
+	{
+		plan->start_page = 1;
+		plan->end_page = 0;
+		return true;
+	}
+	return prot_plan_flush(plan);
 }
 
-static void free_map_entry_blocks(struct map_entry *e)
+static bool is_block_exclusive(size_t block);
+static void reset_pages(size_t start_page, size_t end_page);
+
+/* Release the blocks of a map entry, protection changes of blocks shared with other entries go to plan */
+static void free_map_entry_blocks(struct map_entry *e, struct prot_plan *plan)
 {
 	if (e->flags & INTERNAL_MAP_COPYONFORK)
 	{
 		VirtualFree(GET_PAGE_ADDRESS(e->start_page), 0, MEM_RELEASE);
+		if (e->flags & INTERNAL_MAP_HUGEPAGE)
+			mm->hugepage_usage -= (e->end_page - e->start_page + 1) * PAGE_SIZE;
 		return;
 	}
 	if (e->f)
@@ -259,21 +537,25 @@ static void free_map_entry_blocks(struct map_entry *e)
 	size_t end_block = GET_BLOCK_OF_PAGE(e->end_page);
 
 	/* The first block and last block may be shared with previous/next entry
-	 * We should mark corresponding pages in such blocks as PAGE_NOACCESS instead of free them */
+	 * We should mark corresponding pages in such blocks as PAGE_NOACCESS instead of free them
+	 * If nobody else references the section, the content of these pages is discarded as well */
 	if (prev && GET_BLOCK_OF_PAGE(rb_entry(prev, struct map_entry, tree)->end_page) == start_block)
 	{
 		/* First block is shared, just make it inaccessible */
 		size_t last_page = GET_LAST_PAGE_OF_BLOCK(GET_BLOCK_OF_PAGE(e->start_page));
 		last_page = min(last_page, e->end_page); /* The entry may occupy only a block */
-		DWORD oldProtect;
-		VirtualProtect(GET_PAGE_ADDRESS(e->start_page), (last_page - e->start_page + 1) * PAGE_SIZE, PAGE_NOACCESS, &oldProtect);
+		prot_plan_add(plan, e->start_page, last_page, PAGE_NOACCESS);
+		if (get_section_handle(start_block) && is_block_exclusive(start_block))
+			reset_pages(e->start_page, last_page);
 		start_block++;
 	}
 	if (end_block >= start_block && next && GET_BLOCK_OF_PAGE(rb_entry(next, struct map_entry, tree)->start_page) == end_block)
 	{
 		/* Last block is shared, just make it inaccessible */
-		DWORD oldProtect;
-		VirtualProtect(GET_BLOCK_ADDRESS(end_block), GET_SIZE_OF_BLOCK_TO_PAGE(e->end_page + 1), PAGE_NOACCESS, &oldProtect);
+		size_t first_page = max(e->start_page, GET_FIRST_PAGE_OF_BLOCK(end_block));
+		prot_plan_add(plan, first_page, e->end_page, PAGE_NOACCESS);
+		if (get_section_handle(end_block) && is_block_exclusive(end_block))
+			reset_pages(first_page, e->end_page);
 		end_block--;
 	}
 	/* Unmap non-shared full blocks */
@@ -282,6 +564,7 @@ static void free_map_entry_blocks(struct map_entry *e)
 		HANDLE handle = get_section_handle(i);
 		if (handle)
 		{
+			prot_plan_unmap_block(plan, i);
 			NtUnmapViewOfSection(NtCurrentProcess(), GET_BLOCK_ADDRESS(i));
 			NtClose(handle);
 			remove_section_handle(i);
@@ -305,14 +588,26 @@ void mm_init()
 {
 	/* Initialize RW lock */
 	InitializeSRWLock(&mm->rw_lock);
+	for (int i = 0; i < FAULT_LOCK_COUNT; i++)
+		InitializeSRWLock(&mm->fault_lock[i]);
 	/* Initialize mapping info freelist */
-	rb_init(&mm->entry_tree);
+	rb_init_augmented(&mm->entry_tree, map_entry_augment);
 	slist_init(&mm->entry_free_list);
-	for (size_t i = 0; i + 1 < MAX_MMAP_COUNT; i++)
-		slist_add(&mm->entry_free_list, &mm->entries[i].free_list);
+	mm->entry_count = 0;
+	mm->find_cache = NULL;
 	mm->brk = 0;
+	mm->brk_start = mm->brk_mapped = mm->brk_limit = 0;
+	mm->fault_around_max = MM_FAULT_AROUND_DEFAULT;
+	mm->hugepage_mode = MM_HUGEPAGE_DEFAULT;
+	mm->hugepage_size = (size_t)-1;
+	mm->hugepage_usage = 0;
 	/* Initialize section handle table */
 	mm_section_handle = VirtualAlloc(NULL, BLOCK_COUNT * sizeof(HANDLE), MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	mm_block_dirty = VirtualAlloc(NULL, BLOCK_COUNT * sizeof(uint16_t), MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	mm_block_private = VirtualAlloc(NULL, BLOCK_COUNT * sizeof(uint16_t), MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	mm_block_type = VirtualAlloc(NULL, BLOCK_COUNT * sizeof(uint8_t), MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	mm->flusher_thread = NULL;
+	mm->flusher_event = NULL;
 	/* Initialize static alloc */
 	mm->static_alloc_begin = mm_mmap(NULL, MM_STATIC_ALLOC_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS,
 		INTERNAL_MAP_TOPDOWN | INTERNAL_MAP_NORESET | INTERNAL_MAP_COPYONFORK, NULL, 0);
@@ -335,6 +630,8 @@ void mm_init()
 	map_global_shared_section();
 }
 
+static void writeback_range(struct map_entry *e, size_t start_page, size_t end_page);
+
 void mm_reset()
 {
 	/* Release all user memory */
@@ -349,7 +646,18 @@ void mm_reset()
 			cur = rb_next(cur);
 			continue;
 		}
+		writeback_range(e, e->start_page, e->end_page);
 
+		if (e->flags & INTERNAL_MAP_COPYONFORK)
+		{
+			/* Large page backed region, released as a whole without protection changes */
+			free_map_entry_blocks(e, NULL);
+			struct rb_node *next = rb_next(cur);
+			remove_map_entry(e);
+			free_map_entry(e);
+			cur = next;
+			continue;
+		}
 		if (start_block == last_block)
 			start_block++;
 		for (size_t i = start_block; i <= end_block; i++)
@@ -366,12 +674,13 @@ void mm_reset()
 
 		if (e->f)
 			vfs_release(e->f);
-		free_map_entry(e);
 		struct rb_node *next = rb_next(cur);
-		rb_remove(&mm->entry_tree, cur);
+		remove_map_entry(e);
+		free_map_entry(e);
 		cur = next;
 	}
 	mm->brk = 0;
+	mm->brk_start = mm->brk_mapped = mm->brk_limit = 0;
 }
 
 void mm_shutdown()
@@ -387,6 +696,9 @@ void mm_shutdown()
 		}
 	}
 	VirtualFree(mm_section_handle, 0, MEM_RELEASE);
+	VirtualFree(mm_block_dirty, 0, MEM_RELEASE);
+	VirtualFree(mm_block_private, 0, MEM_RELEASE);
+	VirtualFree(mm_block_type, 0, MEM_RELEASE);
 }
 
 void *mm_static_alloc(size_t size)
@@ -425,59 +737,101 @@ void mm_update_brk(void *brk)
 #else
 	mm->brk = (void*)max((size_t)mm->brk, ALIGN_TO_PAGE(brk));
 #endif
+	mm->brk_start = mm->brk_mapped = (size_t)mm->brk;
+	mm->brk_limit = mm->brk_start + MM_BRK_ARENA_SIZE;
 }
 
-/* Find 'count' consecutive free pages, return 0 if not found */
-static size_t find_free_pages(size_t count, bool block_align)
+/* Find the lowest 'count' consecutive free pages in the gaps before entries in a subtree, return 0 if not found */
+static size_t find_free_pages_subtree(struct rb_node *node, size_t count, bool block_align)
 {
-	size_t last = GET_PAGE(ADDRESS_ALLOCATION_LOW);
-	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
+	if (!node)
+		return 0;
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	if (e->max_gap < count)
+		return 0;
+	/* Gaps in the left subtree and before this entry lie below e->start_page */
+	if (e->start_page > GET_PAGE(ADDRESS_ALLOCATION_LOW))
 	{
-		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
-		if (e->start_page >= last && e->start_page - last >= count)
-			return last;
-		else if (e->end_page >= last)
+		size_t page = find_free_pages_subtree(node->left, count, block_align);
+		if (page)
+			return page;
+		if (e->gap >= count)
 		{
-			last = e->end_page + 1;
-			/* MAP_SHARED entries always occupy entire blocks */
-			if (block_align || (e->flags & INTERNAL_MAP_SHARED))
-				last = (last + PAGES_PER_BLOCK - 1) & -PAGES_PER_BLOCK;
+			size_t start = max(e->start_page - e->gap, GET_PAGE(ADDRESS_ALLOCATION_LOW));
+			if (block_align)
+				start = (start + PAGES_PER_BLOCK - 1) & -PAGES_PER_BLOCK;
+			size_t end = min(e->start_page, GET_PAGE(ADDRESS_ALLOCATION_HIGH));
+			if (start < end && end - start >= count)
+				return start;
 		}
-		if (last >= GET_PAGE(ADDRESS_ALLOCATION_HIGH))
-			return 0;
 	}
-	if (GET_PAGE(ADDRESS_ALLOCATION_HIGH) > last && GET_PAGE(ADDRESS_ALLOCATION_HIGH) - last >= count)
-		return last;
+	/* Gaps in the right subtree lie above e->end_page */
+	if (e->end_page < GET_PAGE(ADDRESS_ALLOCATION_HIGH))
+		return find_free_pages_subtree(node->right, count, block_align);
+	return 0;
+}
+
+/* First page after all entries */
+static size_t get_last_free_page()
+{
+	struct rb_node *last = rb_last(&mm->entry_tree);
+	return last? entry_next_free_page(rb_entry(last, struct map_entry, tree)): GET_PAGE(ADDRESS_SPACE_LOW);
+}
+
+/* Find 'count' consecutive free pages, return 0 if not found */
+static size_t find_free_pages(size_t count, bool block_align)
+{
+	size_t page = find_free_pages_subtree(mm->entry_tree.root, count, block_align);
+	if (page)
+		return page;
+	/* Try the free pages after the last entry */
+	size_t start = max(get_last_free_page(), GET_PAGE(ADDRESS_ALLOCATION_LOW));
+	if (block_align)
+		start = (start + PAGES_PER_BLOCK - 1) & -PAGES_PER_BLOCK;
+	if (GET_PAGE(ADDRESS_ALLOCATION_HIGH) > start && GET_PAGE(ADDRESS_ALLOCATION_HIGH) - start >= count)
+		return start;
 	else
 		return 0;
 }
 
-/* Find 'count' consecutive free pages at the highest possible address with, return 0 if not found */
-static size_t find_free_pages_topdown(size_t count, bool block_align)
+/* Find the highest 'count' consecutive free pages in the gaps before entries in a subtree, return 0 if not found */
+static size_t find_free_pages_topdown_subtree(struct rb_node *node, size_t count, bool block_align)
 {
-	size_t last = GET_PAGE(ADDRESS_ALLOCATION_HIGH);
-	for (struct rb_node *cur = rb_last(&mm->entry_tree); cur; cur = rb_prev(cur))
+	if (!node)
+		return 0;
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	if (e->max_gap < count)
+		return 0;
+	if (e->end_page < GET_PAGE(ADDRESS_ALLOCATION_HIGH))
 	{
-		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
-		size_t end_page = e->end_page;
-		/* MAP_SHARED entries always occupy entire blocks */
-		if (e->flags & INTERNAL_MAP_SHARED)
-			end_page = (end_page & -PAGES_PER_BLOCK) + (PAGES_PER_BLOCK - 1);
-		if (e->end_page < last && e->end_page + count < last)
-			return last - count;
-		else if (e->start_page < last)
+		size_t page = find_free_pages_topdown_subtree(node->right, count, block_align);
+		if (page)
+			return page;
+	}
+	if (e->start_page > GET_PAGE(ADDRESS_ALLOCATION_LOW))
+	{
+		if (e->gap >= count)
 		{
-			last = e->start_page;
+			size_t end = min(e->start_page, GET_PAGE(ADDRESS_ALLOCATION_HIGH));
 			if (block_align)
-				last &= -PAGES_PER_BLOCK;
+				end &= -PAGES_PER_BLOCK;
+			size_t start = max(e->start_page - e->gap, GET_PAGE(ADDRESS_ALLOCATION_LOW));
+			if (start < end && end - start >= count)
+				return end - count;
 		}
-		if (last <= GET_PAGE(ADDRESS_ALLOCATION_LOW))
-			return 0;
+		return find_free_pages_topdown_subtree(node->left, count, block_align);
 	}
-	if (GET_PAGE(ADDRESS_ALLOCATION_LOW) < last && GET_PAGE(ADDRESS_ALLOCATION_LOW) + count < last)
-		return last - count;
-	else
-		return 0;
+	return 0;
+}
+
+/* Find 'count' consecutive free pages at the highest possible address with, return 0 if not found */
+static size_t find_free_pages_topdown(size_t count, bool block_align)
+{
+	/* Try the free pages after the last entry first */
+	size_t start = max(get_last_free_page(), GET_PAGE(ADDRESS_ALLOCATION_LOW));
+	if (GET_PAGE(ADDRESS_ALLOCATION_HIGH) > start && GET_PAGE(ADDRESS_ALLOCATION_HIGH) - start >= count)
+		return GET_PAGE(ADDRESS_ALLOCATION_HIGH) - count;
+	return find_free_pages_topdown_subtree(mm->entry_tree.root, count, block_align);
 }
 
 size_t mm_find_free_pages(size_t count_bytes)
@@ -571,7 +925,143 @@ static void map_entry_range(struct map_entry *e, size_t start_page, size_t end_p
 		RtlSecureZeroMemory(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE);
 }
 
-static int mm_change_protection(HANDLE process, size_t start_page, size_t end_page, int prot)
+/* Whether map entry e is a MAP_SHARED mapping of a shared memory object (see fs/shm.c)
+ * Its blocks are views of the object section itself, there is nothing to write back.
+ */
+static __forceinline bool is_shm_entry(struct map_entry *e)
+{
+	return (e->flags & INTERNAL_MAP_SHARED) && e->f && e->f->op_vtable->get_shared_section;
+}
+
+/* Protection of freshly populated pages of a map entry
+ * MAP_SHARED file pages are write protected, the first write to each page marks it dirty.
+ */
+static int get_populate_prot(struct map_entry *e)
+{
+	if ((e->flags & INTERNAL_MAP_SHARED) && e->f && !is_shm_entry(e))
+		return e->prot & ~PROT_WRITE;
+	return e->prot;
+}
+
+static __forceinline bool is_page_dirty(size_t page)
+{
+	size_t block = GET_BLOCK_OF_PAGE(page);
+	return get_section_handle(block) && (mm_block_dirty[block] & (1 << GET_PAGE_IN_BLOCK(page)));
+}
+
+static __forceinline void set_page_dirty(size_t page)
+{
+	mm_block_dirty[GET_BLOCK_OF_PAGE(page)] |= 1 << GET_PAGE_IN_BLOCK(page);
+}
+
+static __forceinline void clear_page_dirty(size_t page)
+{
+	mm_block_dirty[GET_BLOCK_OF_PAGE(page)] &= ~(1 << GET_PAGE_IN_BLOCK(page));
+}
+
+/* Write a run of dirty pages [start_page, end_page] of a MAP_SHARED file mapping back to the file */
+static void writeback_pages(struct map_entry *e, size_t start_page, size_t end_page, uint64_t file_size)
+{
+	size_t len = (end_page - start_page + 1) * PAGE_SIZE;
+	DWORD oldProtect;
+	VirtualProtect(GET_PAGE_ADDRESS(start_page), len, PAGE_READONLY, &oldProtect);
+	/* Pages beyond end of file are never written to the file */
+	uint64_t offset = (uint64_t)(e->offset_pages + (off_t)(start_page - e->start_page)) * PAGE_SIZE;
+	if (offset < file_size)
+	{
+		size_t count = (size_t)min((uint64_t)len, file_size - offset);
+		size_t r = e->f->op_vtable->pwrite(e->f, GET_PAGE_ADDRESS(start_page), count, offset);
+		if (r != count)
+			log_warning("Write back of [%p, %p) failed, written: %p\n", GET_PAGE_ADDRESS(start_page), (char*)GET_PAGE_ADDRESS(start_page) + count, r);
+		mm->stats.writeback_writes++;
+		mm->stats.writeback_pages += end_page - start_page + 1;
+	}
+	/* Write protect the pages again to catch further modifications */
+	VirtualProtect(GET_PAGE_ADDRESS(start_page), len, prot_linux2win(e->prot & ~PROT_WRITE), &oldProtect);
+}
+
+/* Write back dirty pages in [start_page, end_page] of a MAP_SHARED file mapping
+ * Contiguous dirty pages are coalesced into a single write.
+ */
+static void writeback_range(struct map_entry *e, size_t start_page, size_t end_page)
+{
+	if (!(e->flags & INTERNAL_MAP_SHARED) || !e->f || !e->f->op_vtable->pwrite || is_shm_entry(e))
+		return;
+	uint64_t file_size = ~0ULL;
+	struct newstat stat;
+	if (e->f->op_vtable->stat && e->f->op_vtable->stat(e->f, &stat) == 0)
+		file_size = stat.st_size;
+	size_t run_start = 0;
+	bool in_run = false;
+	for (size_t page = start_page; page <= end_page + 1; page++)
+	{
+		if (page <= end_page && is_page_dirty(page))
+		{
+			clear_page_dirty(page);
+			if (!in_run)
+			{
+				run_start = page;
+				in_run = true;
+			}
+		}
+		else if (in_run)
+		{
+			writeback_pages(e, run_start, page - 1, file_size);
+			in_run = false;
+		}
+	}
+}
+
+/* Write back all dirty MAP_SHARED file pages */
+static void writeback_all()
+{
+	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		writeback_range(e, e->start_page, e->end_page);
+	}
+}
+
+static DWORD WINAPI flusher_thread(LPVOID parameter)
+{
+	for (;;)
+	{
+		WaitForSingleObject(mm->flusher_event, INFINITE);
+		AcquireSRWLockExclusive(&mm->rw_lock);
+		writeback_all();
+		ReleaseSRWLockExclusive(&mm->rw_lock);
+	}
+}
+
+/* Ask the background flusher to write back all dirty pages */
+static void schedule_writeback()
+{
+	if (!mm->flusher_thread)
+	{
+		mm->flusher_event = CreateEventW(NULL, FALSE, FALSE, NULL);
+		mm->flusher_thread = CreateThread(NULL, 0, flusher_thread, NULL, 0, NULL);
+		if (!mm->flusher_thread)
+		{
+			log_error("Flusher thread creation failed, error code: %d.\n", GetLastError());
+			CloseHandle(mm->flusher_event);
+			mm->flusher_event = NULL;
+			/* Fall back to synchronous write back */
+			writeback_all();
+			return;
+		}
+	}
+	SetEvent(mm->flusher_event);
+}
+
+void mm_writeback_shared()
+{
+	AcquireSRWLockExclusive(&mm->rw_lock);
+	writeback_all();
+	ReleaseSRWLockExclusive(&mm->rw_lock);
+}
+
+/* Change protection of populated blocks in pages [start_page, end_page], the changes go to plan */
+static int mm_change_protection(struct prot_plan *plan, size_t start_page, size_t end_page, int prot)
 {
 	DWORD protection = prot_linux2win(prot);
 	size_t start_block = GET_BLOCK_OF_PAGE(start_page);
@@ -583,12 +1073,13 @@ static int mm_change_protection(HANDLE process, size_t start_page, size_t end_pa
 		{
 			size_t range_start = max(GET_FIRST_PAGE_OF_BLOCK(i), start_page);
 			size_t range_end = min(GET_LAST_PAGE_OF_BLOCK(i), end_page);
-			DWORD oldProtect;
-			if (!VirtualProtectEx(process, GET_PAGE_ADDRESS(range_start), PAGE_SIZE * (range_end - range_start + 1), protection, &oldProtect))
+			DWORD block_protection = protection;
+			/* File views are never writable, the first write copies the block in the CoW fault handler */
+			if ((prot & PROT_WRITE) && is_file_block(i))
+				block_protection = prot_linux2win(prot & ~PROT_WRITE);
+			if (!prot_plan_add(plan, range_start, range_end, block_protection))
 			{
-				log_error("VirtualProtect(0x%p, 0x%p) failed, error code: %d\n", GET_PAGE_ADDRESS(range_start),
-					PAGE_SIZE * (range_end - range_start + 1), GetLastError());
-				mm_dump_windows_memory_mappings(process);
+				mm_dump_windows_memory_mappings(plan->process);
 				return 0;
 			}
 		}
@@ -648,10 +1139,110 @@ static int allocate_block(size_t i)
 		mm_dump_windows_memory_mappings(NtCurrentProcess());
 		return 0;
 	}
-	add_section_handle(i, handle);
+	add_section_handle(i, handle, BLOCK_TYPE_ANONYMOUS);
 	return 1;
 }
 
+/* File offset of a file view block of map entry e */
+static uint64_t get_file_block_offset(struct map_entry *e, size_t block)
+{
+	return ((int64_t)e->offset_pages + (intptr_t)GET_FIRST_PAGE_OF_BLOCK(block) - (intptr_t)e->start_page) * PAGE_SIZE;
+}
+
+/* Map a block of a MAP_SHARED mapping of a shared memory object as a view of the object section
+ * Every process mapping the object maps the same pages, writes are visible everywhere without any
+ * copying or write back. mmap() ensures the entry starts at the same in-block offset in the address
+ * space and in the object. The rest of the last block is reserved for the entry, it is made inaccessible.
+ * Returns false if the block is beyond the end of the object.
+ */
+static bool map_shm_block(struct map_entry *e, size_t block)
+{
+	HANDLE section = e->f->op_vtable->get_shared_section(e->f);
+	if (!section)
+		return false;
+	HANDLE handle;
+	if (!DuplicateHandle(GetCurrentProcess(), section, GetCurrentProcess(), &handle, 0, TRUE, DUPLICATE_SAME_ACCESS))
+	{
+		log_error("DuplicateHandle() failed, error code: %d\n", GetLastError());
+		return false;
+	}
+	PVOID base_addr = GET_BLOCK_ADDRESS(block);
+	SIZE_T view_size = BLOCK_SIZE;
+	LARGE_INTEGER offset;
+	offset.QuadPart = get_file_block_offset(e, block);
+	NTSTATUS status = NtMapViewOfSection(handle, NtCurrentProcess(), &base_addr, 0, BLOCK_SIZE, &offset, &view_size, ViewUnmap, 0, PAGE_EXECUTE_READWRITE);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("Block %p is beyond the end of the shared memory object.\n", block);
+		NtClose(handle);
+		return false;
+	}
+	add_section_handle(block, handle, BLOCK_TYPE_SHM);
+	size_t end_page = min(GET_LAST_PAGE_OF_BLOCK(block), e->end_page);
+	DWORD oldProtect;
+	if (e->prot != (PROT_READ | PROT_WRITE | PROT_EXEC))
+		VirtualProtect(base_addr, (end_page - GET_FIRST_PAGE_OF_BLOCK(block) + 1) * PAGE_SIZE, prot_linux2win(e->prot), &oldProtect);
+	if (end_page < GET_LAST_PAGE_OF_BLOCK(block))
+		VirtualProtect(GET_PAGE_ADDRESS(end_page + 1), (GET_LAST_PAGE_OF_BLOCK(block) - end_page) * PAGE_SIZE, PAGE_NOACCESS, &oldProtect);
+	return true;
+}
+
+/* Map a block directly from the backing file of its map entry, without copying
+ * This is only possible if a single non-writable entry covers the whole block, and the
+ * block starts at a 64kB aligned file offset. Since a file view is never written to, its
+ * content always equals the file content and it can be shared with forked processes as is.
+ * Writing to it (after mprotect()) goes through the CoW fault path, which copies the block
+ * to an anonymous section (see take_block_ownership()).
+ * Returns false if the block must be populated by map_entry_range() instead.
+ */
+static bool map_file_block(size_t block)
+{
+	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(block);
+	size_t end_page = GET_LAST_PAGE_OF_BLOCK(block);
+	struct rb_node *node = start_node(start_page);
+	if (!node)
+		return false;
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	if (is_shm_entry(e) && e->start_page <= start_page && e->end_page >= start_page)
+		return map_shm_block(e, block);
+	if (e->start_page > start_page || e->end_page < end_page)
+		return false;
+	if (!e->f || !e->f->op_vtable->get_section || (e->prot & PROT_WRITE) || (e->flags & (INTERNAL_MAP_COPYONFORK | INTERNAL_MAP_SHARED)))
+		return false;
+	off_t offset_pages = e->offset_pages + (off_t)(start_page - e->start_page);
+	if (offset_pages % PAGES_PER_BLOCK)
+		return false;
+	HANDLE file_section = e->f->op_vtable->get_section(e->f);
+	if (!file_section)
+		return false;
+
+	/* Each block owns a handle to the section, as anonymous blocks do */
+	HANDLE handle;
+	if (!DuplicateHandle(GetCurrentProcess(), file_section, GetCurrentProcess(), &handle, 0, TRUE, DUPLICATE_SAME_ACCESS))
+	{
+		log_error("DuplicateHandle() failed, error code: %d\n", GetLastError());
+		return false;
+	}
+	PVOID base_addr = GET_BLOCK_ADDRESS(block);
+	SIZE_T view_size = BLOCK_SIZE;
+	LARGE_INTEGER offset;
+	offset.QuadPart = (uint64_t)offset_pages * PAGE_SIZE;
+	NTSTATUS status = NtMapViewOfSection(handle, NtCurrentProcess(), &base_addr, 0, BLOCK_SIZE, &offset, &view_size, ViewUnmap, 0, PAGE_EXECUTE_READ);
+	if (!NT_SUCCESS(status))
+	{
+		/* The block reaches beyond the end of file */
+		NtClose(handle);
+		return false;
+	}
+	add_section_handle(block, handle, BLOCK_TYPE_FILE);
+	if (e->prot != (PROT_READ | PROT_EXEC))
+	{
+		DWORD oldProtect;
+		VirtualProtect(base_addr, BLOCK_SIZE, prot_linux2win(e->prot), &oldProtect);
+	}
+	return true;
+}
+
 static HANDLE duplicate_section(HANDLE source, void *source_addr)
 {
 	HANDLE dest;
@@ -715,21 +1306,17 @@ static int take_block_ownership(size_t block)
 		log_error("NtQueryObject() on block %p failed, status: 0x%x.\n", block, status);
 		return 0;
 	}
-	if (info.HandleCount == 1)
-	{
-		log_info("We're the only owner.\n");
+	/* A file view is never writable, always copy it */
+	if (info.HandleCount == 1 && !is_file_block(block))
 		return 1;
-	}
 	
-	/* We are not the only one holding the section, duplicate it */
-	log_info("Duplicating section %p...\n", block);
+	/* We are not the only one holding the section, or it is a file view, duplicate it */
 	HANDLE new_section;
 	if (!(new_section = duplicate_section(handle, GET_BLOCK_ADDRESS(block))))
 	{
 		log_error("Duplicating section failed.\n");
 		return 0;
 	}
-	log_info("Duplicating section succeeded. Remapping...\n");
 	status = NtUnmapViewOfSection(NtCurrentProcess(), GET_BLOCK_ADDRESS(block));
 	if (!NT_SUCCESS(status))
 	{
@@ -751,28 +1338,13 @@ static int take_block_ownership(size_t block)
 		return 0;
 	}
 	replace_section_handle(block, new_section);
+	FAULT_STAT_INC(duplicated_blocks);
 	return 1;
 }
 
-static int handle_cow_page_fault(void *addr)
+/* Set protection of all map entry pages in an owned private block to their desired protection */
+static bool protect_block_entries(size_t block)
 {
-	struct map_entry *entry = find_map_entry(addr);
-	if (entry == NULL)
-	{
-		log_warning("No corresponding map entry found.\n");
-		return 0;
-	}
-	if ((entry->prot & PROT_WRITE) == 0)
-	{
-		log_warning("Address %p (page %p) not writable.\n", addr, GET_PAGE(addr));
-		return 0;
-	}
-	size_t block = GET_BLOCK(addr);
-
-	if (!take_block_ownership(block))
-		return 0;
-
-	/* We're the only owner of the section now, change page protection flags */
 	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(block);
 	size_t end_page = GET_LAST_PAGE_OF_BLOCK(block);
 	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
@@ -787,108 +1359,629 @@ static int handle_cow_page_fault(void *addr)
 			if (range_start > range_end)
 				continue;
 			DWORD oldProtect;
-			if (!VirtualProtect(GET_PAGE_ADDRESS(range_start), PAGE_SIZE * (range_end - range_start + 1), prot_linux2win(e->prot), &oldProtect))
+			if (!VirtualProtect(GET_PAGE_ADDRESS(range_start), PAGE_SIZE * (range_end - range_start + 1), prot_linux2win(get_populate_prot(e)), &oldProtect))
 			{
 				log_error("VirtualProtect(0x%p, 0x%p) failed, error code: %d.\n", GET_PAGE_ADDRESS(range_start),
 					PAGE_SIZE * (range_end - range_start + 1), GetLastError());
-				return 0;
+				return false;
 			}
 		}
 	}
-	log_info("CoW section %p successfully duplicated.\n", block);
-	return 1;
+	return true;
 }
 
-static int handle_on_demand_page_fault(void *addr)
+/* Whether the section of a populated block is an anonymous section only referenced by us
+ * Such a block is not shared with any forked process, so discarding its content affects nobody else.
+ */
+static bool is_block_exclusive(size_t block)
 {
-	size_t block = GET_BLOCK(addr);
-	size_t page = GET_PAGE(addr);
-	/* Map all map entries in the block */
-	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(block);
-	size_t end_page = GET_LAST_PAGE_OF_BLOCK(block);
-	struct map_entry *p, *e;
-	int found = 0;
-	allocate_block(block);
-	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	HANDLE handle = get_section_handle(block);
+	OBJECT_BASIC_INFORMATION info;
+	if (!NT_SUCCESS(NtQueryObject(handle, ObjectBasicInformation, &info, sizeof(OBJECT_BASIC_INFORMATION), NULL)))
+		return false;
+	return info.HandleCount == 1 && !is_file_block(block);
+}
+
+/* Page granular copy on write for a write fault on page of private map entry e
+ * A block still shared with forked processes is not copied as a whole on the first write to it.
+ * Instead the faulting page gets write copy protection, and the retried write makes Windows copy
+ * just that page into private memory of our view. The section itself is left untouched, so the pages
+ * copied this way are recorded in mm_block_private, see merge_private_pages().
+ * Returns false if the block has to be taken over by take_block_ownership() instead.
+ */
+static bool copy_page_on_write(struct map_entry *e, size_t page)
+{
+	size_t block = GET_BLOCK_OF_PAGE(page);
+	uint16_t mask = 1 << GET_PAGE_IN_BLOCK(page);
+	DWORD protection;
+	if (mm_block_private[block] & mask)
 	{
-		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
-		if (end_page < e->start_page)
-			break;
-		else
-		{
-			size_t range_start = max(start_page, e->start_page);
-			size_t range_end = min(end_page, e->end_page);
-			if (range_start > range_end)
+		/* Already our own copy, write protected again by mprotect() */
+		protection = prot_linux2win(e->prot);
+	}
+	else
+	{
+		/* File views are not writable at all, exclusive blocks need no copy */
+		if (is_file_block(block) || is_block_exclusive(block))
+			return false;
+		protection = (e->prot & PROT_EXEC) ? PAGE_EXECUTE_WRITECOPY : PAGE_WRITECOPY;
+	}
+	DWORD oldProtect;
+	if (!VirtualProtect(GET_PAGE_ADDRESS(page), PAGE_SIZE, protection, &oldProtect))
+	{
+		log_warning("VirtualProtect(0x%p) failed, error code: %d\n", GET_PAGE_ADDRESS(page), GetLastError());
+		return false;
+	}
+	mm_block_private[block] |= mask;
+	FAULT_STAT_INC(cow_pages);
+	return true;
+}
+
+/* Write privately copied pages of a block back to a section, to make the section hold the whole block content again
+ * If we are the only owner of the section, only the copied pages are written to it. Otherwise other processes
+ * still use the old content, and the block is moved to a new section.
+ */
+static bool merge_private_pages(size_t block)
+{
+	mm->stats.private_merges++;
+	if (!is_block_exclusive(block))
+		return take_block_ownership(block) && protect_block_entries(block);
+
+	HANDLE handle = get_section_handle(block);
+	PVOID view = NULL;
+	SIZE_T view_size = BLOCK_SIZE;
+	NTSTATUS status = NtMapViewOfSection(handle, NtCurrentProcess(), &view, 0, BLOCK_SIZE, NULL, &view_size, ViewUnmap, 0, PAGE_READWRITE);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("NtMapViewOfSection() failed, status: %x\n", status);
+		return false;
+	}
+	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(block);
+	for (size_t i = 0; i < PAGES_PER_BLOCK; i++)
+		if (mm_block_private[block] & (1 << i))
+		{
+			/* The page may have been made inaccessible by mprotect() */
+			DWORD oldProtect;
+			VirtualProtect(GET_PAGE_ADDRESS(start_page + i), PAGE_SIZE, PAGE_READONLY, &oldProtect);
+			CopyMemory((char *)view + i * PAGE_SIZE, GET_PAGE_ADDRESS(start_page + i), PAGE_SIZE);
+		}
+	NtUnmapViewOfSection(NtCurrentProcess(), view);
+	/* Replace our view with a plain view of the section */
+	PVOID base_addr = GET_BLOCK_ADDRESS(block);
+	view_size = BLOCK_SIZE;
+	NtUnmapViewOfSection(NtCurrentProcess(), base_addr);
+	status = NtMapViewOfSection(handle, NtCurrentProcess(), &base_addr, 0, BLOCK_SIZE, NULL, &view_size, ViewUnmap, 0, PAGE_EXECUTE_READWRITE);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("Remapping failed, status: %x\n", status);
+		return false;
+	}
+	mm_block_private[block] = 0;
+	return protect_block_entries(block);
+}
+
+/* Let the system discard content of pages [start_page, end_page] instead of paging them out
+ * The pages stay committed, writing to them again keeps the new content.
+ */
+static void reset_pages(size_t start_page, size_t end_page)
+{
+	void *addr = GET_PAGE_ADDRESS(start_page);
+	size_t size = (end_page - start_page + 1) * PAGE_SIZE;
+	if (!VirtualAlloc(addr, size, MEM_RESET, PAGE_NOACCESS))
+	{
+		log_warning("VirtualAlloc(%p, %p, MEM_RESET) failed, error code: %d\n", addr, size, GetLastError());
+		return;
+	}
+	/* The pages are not locked, this fails but removes them from the working set right away */
+	VirtualUnlock(addr, size);
+	mm->stats.reset_pages += end_page - start_page + 1;
+}
+
+/* Large page size usable for mappings, 0 if large pages are not available
+ * Large pages need the SeLockMemoryPrivilege, which is enabled on first use. Forked processes
+ * inherit the enabled privilege along with the token.
+ */
+static size_t get_hugepage_size()
+{
+	if (mm->hugepage_size != (size_t)-1)
+		return mm->hugepage_size;
+	mm->hugepage_size = 0;
+	size_t size = GetLargePageMinimum();
+	if (size == 0 || size % BLOCK_SIZE)
+		return 0;
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return 0;
+	TOKEN_PRIVILEGES privileges;
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	/* AdjustTokenPrivileges() succeeds with ERROR_NOT_ALL_ASSIGNED if the privilege is not held */
+	bool enabled = LookupPrivilegeValueW(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL)
+		&& GetLastError() == ERROR_SUCCESS;
+	CloseHandle(token);
+	if (!enabled)
+	{
+		log_warning("Lock pages in memory privilege not held, large pages are not available.\n");
+		return 0;
+	}
+	log_info("Large pages available, size: %p\n", size);
+	return mm->hugepage_size = size;
+}
+
+/* Whether an anonymous private mapping of the given size may be backed by large pages
+ * requested: The mapping asked for large pages by MAP_HUGETLB or madvise(MADV_HUGEPAGE)
+ */
+static bool want_hugepage(size_t length, bool requested)
+{
+	if (mm->hugepage_mode == MM_HUGEPAGE_NEVER)
+		return false;
+	if (!requested && mm->hugepage_mode != MM_HUGEPAGE_ALWAYS)
+		return false;
+	size_t size = get_hugepage_size();
+	return size && length >= size && length % size == 0;
+}
+
+/* Back a large page aligned map entry without populated blocks by a single large page allocation
+ * The entry is then handled like a INTERNAL_MAP_COPYONFORK region.
+ * Returns false if the allocation failed, the entry stays populated on demand in that case.
+ */
+static bool make_hugepage_entry(struct map_entry *e)
+{
+	void *addr = GET_PAGE_ADDRESS(e->start_page);
+	size_t size = (e->end_page - e->start_page + 1) * PAGE_SIZE;
+	if (!VirtualAlloc(addr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, prot_linux2win(e->prot)))
+	{
+		log_info("VirtualAlloc(%p, %p, MEM_LARGE_PAGES) failed, error code: %d\n", addr, size, GetLastError());
+		mm->stats.hugepage_fallbacks++;
+		return false;
+	}
+	e->flags |= INTERNAL_MAP_COPYONFORK | INTERNAL_MAP_HUGEPAGE;
+	mm->hugepage_usage += size;
+	mm->stats.hugepage_allocs++;
+	return true;
+}
+
+/* Drop the large page allocation of a map entry without keeping its content
+ * The entry is populated on demand afterwards.
+ */
+static void release_hugepage_entry(struct map_entry *e)
+{
+	VirtualFree(GET_PAGE_ADDRESS(e->start_page), 0, MEM_RELEASE);
+	e->flags &= ~(INTERNAL_MAP_COPYONFORK | INTERNAL_MAP_HUGEPAGE);
+	mm->hugepage_usage -= (e->end_page - e->start_page + 1) * PAGE_SIZE;
+}
+
+/* Move a large page backed map entry to ordinary blocks with its current content
+ * Large pages cannot be partially unmapped, protected, remapped or discarded, this must be done before.
+ */
+static bool split_hugepage_entry(struct map_entry *e)
+{
+	void *addr = GET_PAGE_ADDRESS(e->start_page);
+	size_t size = (e->end_page - e->start_page + 1) * PAGE_SIZE;
+	char *copy = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!copy)
+	{
+		log_error("VirtualAlloc(%p) failed, error code: %d\n", size, GetLastError());
+		return false;
+	}
+	DWORD oldProtect;
+	if (!(e->prot & PROT_READ))
+		VirtualProtect(addr, size, PAGE_READONLY, &oldProtect);
+	CopyMemory(copy, addr, size);
+	release_hugepage_entry(e);
+	mm->stats.hugepage_splits++;
+	size_t start_block = GET_BLOCK_OF_PAGE(e->start_page);
+	size_t end_block = GET_BLOCK_OF_PAGE(e->end_page);
+	for (size_t i = start_block; i <= end_block; i++)
+	{
+		if (!allocate_block(i))
+		{
+			log_error("Allocating block %p failed, content of the rest of the mapping is lost.\n", i);
+			VirtualFree(copy, 0, MEM_RELEASE);
+			return false;
+		}
+		CopyMemory(GET_BLOCK_ADDRESS(i), copy + (i - start_block) * BLOCK_SIZE, BLOCK_SIZE);
+		if (e->prot != (PROT_READ | PROT_WRITE | PROT_EXEC))
+			VirtualProtect(GET_BLOCK_ADDRESS(i), BLOCK_SIZE, prot_linux2win(e->prot), &oldProtect);
+	}
+	VirtualFree(copy, 0, MEM_RELEASE);
+	return true;
+}
+
+static int handle_cow_page_fault(void *addr)
+{
+	struct map_entry *entry = find_map_entry(addr);
+	if (entry == NULL)
+	{
+		log_warning("No corresponding map entry found.\n");
+		return 0;
+	}
+	if ((entry->prot & PROT_WRITE) == 0)
+	{
+		log_warning("Address %p (page %p) not writable.\n", addr, GET_PAGE(addr));
+		return 0;
+	}
+	if (entry->flags & INTERNAL_MAP_SHARED)
+	{
+		/* MAP_SHARED memory is never copied, the page is write protected to track modifications */
+		size_t page = GET_PAGE(addr);
+		if (entry->f && !is_shm_entry(entry))
+			set_page_dirty(page);
+		DWORD oldProtect;
+		VirtualProtect(GET_PAGE_ADDRESS(page), PAGE_SIZE, prot_linux2win(entry->prot), &oldProtect);
+		return 1;
+	}
+	size_t block = GET_BLOCK(addr);
+	if (copy_page_on_write(entry, GET_PAGE(addr)))
+		return 1;
+
+	if (!take_block_ownership(block))
+		return 0;
+
+	/* We're the only owner of the section now, change page protection flags */
+	if (!protect_block_entries(block))
+		return 0;
+	return 1;
+}
+
+/* Populate unallocated blocks [start_block, end_block] entirely covered by map entry e
+ * Blocks which cannot be mapped from the file directly are read in one batch per contiguous run.
+ */
+static void populate_entry_blocks(struct map_entry *e, size_t start_block, size_t end_block)
+{
+	size_t batch_start = start_block;
+	for (size_t i = start_block; i <= end_block + 1; i++)
+	{
+		if (i <= end_block && !map_file_block(i))
+		{
+			if (allocate_block(i))
 				continue;
-			if (page >= range_start && page <= range_end)
-				found = 1;
+		}
+		/* End of a run of allocated blocks */
+		if (batch_start < i)
+		{
+			size_t range_start = GET_FIRST_PAGE_OF_BLOCK(batch_start);
+			size_t range_end = GET_LAST_PAGE_OF_BLOCK(i - 1);
 			map_entry_range(e, range_start, range_end);
-			if (e->prot != PROT_READ | PROT_WRITE | PROT_EXEC)
+			int prot = get_populate_prot(e);
+			if (prot != (PROT_READ | PROT_WRITE | PROT_EXEC))
 			{
 				DWORD oldProtect;
-				VirtualProtect(GET_PAGE_ADDRESS(range_start), (range_end - range_start + 1) * PAGE_SIZE, prot_linux2win(e->prot), &oldProtect);
+				VirtualProtect(GET_PAGE_ADDRESS(range_start), (range_end - range_start + 1) * PAGE_SIZE, prot_linux2win(prot), &oldProtect);
 			}
 		}
+		batch_start = i + 1;
+	}
+}
+
+/* Fault-around: detect sequential on demand faults in a map entry and populate blocks ahead of them
+ * The window starts at one block and doubles on each fault which continues the sequence, up to
+ * mm->fault_around_max blocks. A fault anywhere else resets it.
+ * The sequence state is updated by concurrent faults without synchronization, a lost update only
+ * costs a wrong prediction.
+ */
+static void fault_around(size_t block, size_t page)
+{
+	struct map_entry *e = find_map_entry(GET_PAGE_ADDRESS(page));
+	if (!e)
+		return;
+	if (e->fault_next_block == block)
+	{
+		FAULT_STAT_INC(fault_around_hits);
+		e->fault_window = e->fault_window ? min(e->fault_window * 2, mm->fault_around_max) : min(1, mm->fault_around_max);
 	}
-	/* TODO: Mark unmapped pages as PAGE_NOACCESS */
-	if (!found)
-		log_error("Block 0x%p not mapped.\n", GET_BLOCK(addr));
 	else
-		log_info("On demand block 0x%p loaded.\n", GET_BLOCK(addr));
+	{
+		if (e->fault_next_block)
+			FAULT_STAT_INC(fault_around_misses);
+		e->fault_window = 0;
+	}
+	/* Only populate blocks entirely inside this entry, the last block may be shared with the next one
+	 * Blocks are locked as well, the run stops at a block another thread is faulting on */
+	size_t last_block = GET_BLOCK_OF_PAGE(e->end_page + 1) - 1;
+	size_t end_block = min(block + e->fault_window, last_block);
+	size_t i;
+	for (i = block + 1; i <= end_block; i++)
+	{
+		if (!TryAcquireSRWLockExclusive(get_fault_lock(i)))
+			break;
+		if (get_section_handle(i))
+		{
+			ReleaseSRWLockExclusive(get_fault_lock(i));
+			break;
+		}
+	}
+	if (i > block + 1)
+	{
+		populate_entry_blocks(e, block + 1, i - 1);
+		FAULT_STAT_ADD(fault_around_blocks, i - block - 1);
+		for (size_t j = block + 1; j < i; j++)
+			ReleaseSRWLockExclusive(get_fault_lock(j));
+	}
+	e->fault_next_block = i;
+}
+
+/* Allocate an anonymous section for a block and set up content of all map entries in it
+ * Pages not covered by any map entry are made inaccessible.
+ * Returns whether the given page is covered by any map entry.
+ */
+static int populate_block(size_t block, size_t page)
+{
+	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(block);
+	size_t end_page = GET_LAST_PAGE_OF_BLOCK(block);
+	size_t unmapped_page = start_page;
+	int found = 0;
+	DWORD oldProtect;
+	if (!allocate_block(block))
+		return 0;
+	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (end_page < e->start_page)
+			break;
+		else
+		{
+			size_t range_start = max(start_page, e->start_page);
+			size_t range_end = min(end_page, e->end_page);
+			if (range_start > range_end)
+				continue;
+			if (page >= range_start && page <= range_end)
+				found = 1;
+			if (unmapped_page < range_start)
+				VirtualProtect(GET_PAGE_ADDRESS(unmapped_page), (range_start - unmapped_page) * PAGE_SIZE, PAGE_NOACCESS, &oldProtect);
+			unmapped_page = range_end + 1;
+			map_entry_range(e, range_start, range_end);
+			int prot = get_populate_prot(e);
+			if (prot != (PROT_READ | PROT_WRITE | PROT_EXEC))
+				VirtualProtect(GET_PAGE_ADDRESS(range_start), (range_end - range_start + 1) * PAGE_SIZE, prot_linux2win(prot), &oldProtect);
+		}
+	}
+	if (unmapped_page <= end_page)
+		VirtualProtect(GET_PAGE_ADDRESS(unmapped_page), (end_page - unmapped_page + 1) * PAGE_SIZE, PAGE_NOACCESS, &oldProtect);
 	return found;
 }
 
+static int handle_on_demand_page_fault(void *addr)
+{
+	size_t block = GET_BLOCK(addr);
+	size_t page = GET_PAGE(addr);
+	int found;
+	FAULT_STAT_INC(on_demand_faults);
+	/* Map all map entries in the block */
+	if (map_file_block(block))
+		found = 1;
+	else
+		found = populate_block(block, page);
+	if (!found)
+	{
+		log_error("Block 0x%p not mapped.\n", GET_BLOCK(addr));
+		return 0;
+	}
+	fault_around(block, page);
+	return 1;
+}
+
+/* Whether a page is writable now, i.e. a write fault on it has been resolved */
+static bool is_page_writable(void *addr)
+{
+	MEMORY_BASIC_INFORMATION info;
+	if (!VirtualQuery(addr, &info, sizeof(info)) || info.State != MEM_COMMIT)
+		return false;
+	switch (info.Protect & 0xFF)
+	{
+	case PAGE_READWRITE:
+	case PAGE_WRITECOPY:
+	case PAGE_EXECUTE_READWRITE:
+	case PAGE_EXECUTE_WRITECOPY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Page faults only read the map entry tree, they run with rw_lock held shared. Everything they
+ * change belongs to the faulting block (and blocks populated by fault-around), which is protected
+ * by its fault lock. Thus faults on different blocks are handled in parallel.
+ * When multiple threads fault on the same block, the later ones find the fault already resolved
+ * after getting the block lock and just retry the access.
+ */
 int mm_handle_page_fault(void *addr)
 {
-	log_info("Handling page fault at address %p (page %p)\n", addr, GET_PAGE(addr));
 	if ((size_t)addr < ADDRESS_SPACE_LOW || (size_t)addr >= ADDRESS_SPACE_HIGH)
 	{
 		log_warning("Address %p outside of valid usermode address space.\n", addr);
 		return 0;
 	}
-	AcquireSRWLockExclusive(&mm->rw_lock);
+	size_t block = GET_BLOCK(addr);
+	AcquireSRWLockShared(&mm->rw_lock);
+	/* Whether the block was populated at the time of the fault, checked before waiting on the block */
+	bool populated = get_section_handle(block) != NULL;
+	SRWLOCK *lock = get_fault_lock(block);
+	AcquireSRWLockExclusive(lock);
 	int r;
-	if (get_section_handle(GET_BLOCK(addr)))
-		r = handle_cow_page_fault(addr);
-	else
+	if (!get_section_handle(block))
 		r = handle_on_demand_page_fault(addr);
-	ReleaseSRWLockExclusive(&mm->rw_lock);
+	else if (!populated)
+		r = 1; /* Populated by another thread meanwhile */
+	else if (is_page_writable(addr))
+		r = 1; /* Copied by another thread meanwhile */
+	else
+	{
+		FAULT_STAT_INC(cow_faults);
+		r = handle_cow_page_fault(addr);
+	}
+	ReleaseSRWLockExclusive(lock);
+	ReleaseSRWLockShared(&mm->rw_lock);
 	return r;
 }
 
-int mm_fork(HANDLE process)
+/* Mark indices of live map entries in a bitmap of MAX_MMAP_COUNT bits */
+static void get_live_entries(uint8_t *live)
 {
-	AcquireSRWLockShared(&mm->rw_lock);
-	/* Copy mm_data struct */
-	if (!WriteProcessMemory(process, mm, mm, sizeof(struct mm_data), NULL))
+	RtlZeroMemory(live, (mm->entry_count + 7) / 8);
+	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
+	{
+		size_t i = rb_entry(cur, struct map_entry, tree) - mm->entries;
+		live[i / 8] |= 1 << (i % 8);
+	}
+}
+
+#define IS_ENTRY_LIVE(live, i) ((live)[(i) / 8] & (1 << ((i) % 8)))
+
+static uint64_t get_time_us()
+{
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t)(counter.QuadPart * 1000000 / frequency.QuadPart);
+}
+
+/* Protection of a map entry in a forked child
+ * Private writable memory is copy on write, shared file memory starts with no dirty pages.
+ */
+static int get_fork_prot(struct map_entry *e)
+{
+	if ((e->flags & INTERNAL_MAP_SHARED) && (!e->f || is_shm_entry(e)))
+		return e->prot;
+	return e->prot & ~PROT_WRITE;
+}
+
+/* Copy mm_data to the child, with only the live map entries */
+static bool fork_copy_mm_data(HANDLE process)
+{
+	if (!WriteProcessMemory(process, mm, mm, offsetof(struct mm_data, entries), NULL))
 	{
 		log_error("mm_fork(): Write mm_data structure failed, error code: %d\n", GetLastError());
-		return 0;
+		return false;
 	}
+	/* Runs of live entries are copied together, short gaps of free entries are copied along */
+	static uint8_t live[(MAX_MMAP_COUNT + 7) / 8];
+	get_live_entries(live);
+	size_t run_start = 0, run_end = 0; /* [run_start, run_end) */
+	size_t count = mm->entry_count;
+	for (size_t i = 0; i <= count; i++)
+	{
+		if (i < count && !IS_ENTRY_LIVE(live, i))
+			continue;
+		if (run_end > run_start && (i == count || i - run_end > 16))
+		{
+			if (!WriteProcessMemory(process, &mm->entries[run_start], &mm->entries[run_start], (run_end - run_start) * sizeof(struct map_entry), NULL))
+			{
+				log_error("mm_fork(): Write map entries failed, error code: %d\n", GetLastError());
+				return false;
+			}
+			run_start = run_end;
+		}
+		if (i < count)
+		{
+			if (run_end == run_start)
+				run_start = i;
+			run_end = i + 1;
+		}
+	}
+	return true;
+}
+
+/* Set up child page protection of all map entries in a block */
+static bool fork_protect_block(struct prot_plan *plan, size_t block, bool file_view)
+{
+	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(block);
+	size_t end_page = GET_LAST_PAGE_OF_BLOCK(block);
+	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (end_page < e->start_page)
+			break;
+		size_t range_start = max(start_page, e->start_page);
+		size_t range_end = min(end_page, e->end_page);
+		if (range_start > range_end)
+			continue;
+		int prot = get_fork_prot(e);
+		if (file_view)
+			prot &= ~PROT_WRITE;
+		if (!prot_plan_add(plan, range_start, range_end, prot_linux2win(prot)))
+			return false;
+	}
+	return prot_plan_flush(plan);
+}
+
+/* Allocate a table of the child and store its address to the table pointer variable in the child */
+static void *fork_alloc_table(HANDLE process, void *table_ptr, size_t size)
+{
+	void *table = VirtualAllocEx(process, NULL, size, MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	if (!table)
+	{
+		log_error("mm_fork(): Reserve table failed, error code: %d\n", GetLastError());
+		return NULL;
+	}
+	if (!WriteProcessMemory(process, table_ptr, &table, sizeof(void *), NULL))
+	{
+		log_error("mm_fork(): Write table pointer failed, error code: %d\n", GetLastError());
+		return NULL;
+	}
+	return table;
+}
+
+/* Duplicate the address space to the child, called with mm->rw_lock held */
+static int fork_address_space_locked(HANDLE process, bool kernel_only)
+{
+	if (kernel_only)
+		mm->stats.exec_forks++;
+	else
+		mm->stats.forks++;
+	uint64_t time = get_time_us();
+	/* Copy mm_data struct */
+	if (!fork_copy_mm_data(process))
+		return 0;
 	/* Copy section handle tables */
-	HANDLE *forked_section_handle = VirtualAllocEx(process, NULL, BLOCK_COUNT * sizeof(HANDLE), MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
-	WriteProcessMemory(process, &mm_section_handle, &forked_section_handle, sizeof(HANDLE *), NULL);
+	HANDLE *forked_section_handle = fork_alloc_table(process, &mm_section_handle, BLOCK_COUNT * sizeof(HANDLE));
+	/* The child starts with no dirty pages, its dirty mask tables are just committed zeroed */
+	uint16_t *forked_block_dirty = fork_alloc_table(process, &mm_block_dirty, BLOCK_COUNT * sizeof(uint16_t));
+	/* All blocks of the child are fresh views of their sections, no page is privately copied */
+	uint16_t *forked_block_private = fork_alloc_table(process, &mm_block_private, BLOCK_COUNT * sizeof(uint16_t));
+	/* Block types are inherited along with section handles */
+	uint8_t *forked_block_type = fork_alloc_table(process, &mm_block_type, BLOCK_COUNT * sizeof(uint8_t));
+	if (!forked_section_handle || !forked_block_dirty || !forked_block_private || !forked_block_type)
+		return 0;
 	for (size_t i = 0; i < SECTION_TABLE_COUNT; i++)
 		if (mm->section_table_handle_count[i])
 		{
 			size_t j = i * SECTION_HANDLE_PER_TABLE;
-			if (!VirtualAllocEx(process, &forked_section_handle[j], BLOCK_SIZE, MEM_COMMIT, PAGE_READWRITE))
+			if (!VirtualAllocEx(process, &forked_section_handle[j], BLOCK_SIZE, MEM_COMMIT, PAGE_READWRITE)
+				|| !VirtualAllocEx(process, &forked_block_dirty[j], DIRTY_MASK_TABLE_SIZE, MEM_COMMIT, PAGE_READWRITE)
+				|| !VirtualAllocEx(process, &forked_block_private[j], DIRTY_MASK_TABLE_SIZE, MEM_COMMIT, PAGE_READWRITE)
+				|| !VirtualAllocEx(process, &forked_block_type[j], BLOCK_TYPE_TABLE_SIZE, MEM_COMMIT, PAGE_READWRITE))
 			{
 				log_error("mm_fork(): Allocate section table 0x%p failed, error code: %d\n", i, GetLastError());
 				return 0;
 			}
-			if (!WriteProcessMemory(process, &forked_section_handle[j], &mm_section_handle[j], BLOCK_SIZE, NULL))
+			if (!WriteProcessMemory(process, &forked_section_handle[j], &mm_section_handle[j], BLOCK_SIZE, NULL)
+				|| !WriteProcessMemory(process, &forked_block_type[j], &mm_block_type[j], BLOCK_TYPE_TABLE_SIZE, NULL))
 			{
 				log_error("mm_fork(): Write section table 0x%p failed, error code: %d\n", i, GetLastError());
 				return 0;
 			}
 		}
+	uint64_t now = get_time_us();
+	mm->stats.fork_data_us += now - time;
+	time = now;
+
 	size_t last_block = 0;
 	size_t section_object_count = 0;
+	/* Adjacent copy on fork regions are copied with a single WriteProcessMemory() */
+	size_t copy_start = 0, copy_end = 0; /* [copy_start, copy_end) in blocks */
+	/* Write protection of adjacent entries in the current process is merged across entry boundaries */
+	struct prot_plan child_plan, parent_plan;
+	prot_plan_init(&child_plan, process, &mm->stats.fork_protect_calls);
+	prot_plan_init(&parent_plan, GetCurrentProcess(), &mm->stats.fork_protect_calls);
 	log_info("Mapping and changing memory protection...\n");
 	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
 	{
 		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		/* User memory is left out, the child releases the entries in mm_reset() without ever touching them */
+		if (kernel_only && !(e->flags & INTERNAL_MAP_NORESET))
+			continue;
 		/* Map section */
 		size_t start_block = GET_BLOCK_OF_PAGE(e->start_page);
 		size_t end_block = GET_BLOCK_OF_PAGE(e->end_page);
@@ -896,22 +1989,35 @@ int mm_fork(HANDLE process)
 			start_block++;
 		if (e->flags & INTERNAL_MAP_COPYONFORK)
 		{
-			/* Copy on fork memory region */
-			if (!VirtualAllocEx(process, GET_BLOCK_ADDRESS(start_block), (end_block - start_block + 1) * BLOCK_SIZE, MEM_RESERVE | MEM_COMMIT, prot_linux2win(e->prot)))
+			/* Copy on fork memory region, each one is a separate allocation as it is freed separately
+			 * Large page backed regions fall back to ordinary pages if the child cannot get large pages */
+			void *base_addr = GET_BLOCK_ADDRESS(start_block);
+			size_t size = (end_block - start_block + 1) * BLOCK_SIZE;
+			if (!((e->flags & INTERNAL_MAP_HUGEPAGE) && VirtualAllocEx(process, base_addr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, prot_linux2win(e->prot)))
+				&& !VirtualAllocEx(process, base_addr, size, MEM_RESERVE | MEM_COMMIT, prot_linux2win(e->prot)))
 			{
 				log_error("VirtualAllocEx() failed, error code: %d\n", GetLastError());
 				mm_dump_windows_memory_mappings(process);
 				return 0;
 			}
-			/* Copy memory content to child process */
-			SIZE_T written;
-			if (!WriteProcessMemory(process, GET_BLOCK_ADDRESS(start_block), GET_BLOCK_ADDRESS(start_block),
-				(end_block - start_block + 1) * BLOCK_SIZE, &written))
+			if (start_block != copy_end)
 			{
-				log_error("WriteProcessMemory() failed, error code: %d\n", GetLastError());
-				mm_dump_windows_memory_mappings(process);
-				return 0;
+				/* Copy memory content of previous run to child process */
+				SIZE_T written;
+				if (copy_end > copy_start && !WriteProcessMemory(process, GET_BLOCK_ADDRESS(copy_start), GET_BLOCK_ADDRESS(copy_start),
+					(copy_end - copy_start) * BLOCK_SIZE, &written))
+				{
+					log_error("WriteProcessMemory() failed, error code: %d\n", GetLastError());
+					mm_dump_windows_memory_mappings(process);
+					return 0;
+				}
+				copy_start = start_block;
 			}
+			copy_end = end_block + 1;
+			last_block = end_block;
+			now = get_time_us();
+			mm->stats.fork_copy_us += now - time;
+			time = now;
 			continue;
 		}
 		for (size_t i = start_block; i <= end_block; i++)
@@ -919,10 +2025,33 @@ int mm_fork(HANDLE process)
 			HANDLE handle = get_section_handle(i);
 			if (handle)
 			{
+				/* The child maps the section, which lacks the pages we copied privately */
+				if (mm_block_private[i])
+				{
+					if (!merge_private_pages(i))
+						return 0;
+					handle = get_section_handle(i);
+				}
 				PVOID base_addr = GET_BLOCK_ADDRESS(i);
 				SIZE_T view_size = BLOCK_SIZE;
+				LARGE_INTEGER offset, *section_offset = NULL;
+				bool file_view = is_file_block(i);
+				bool object_view = is_object_block(i);
+				/* The protection of a view can never be raised above the one it is mapped with, the CoW
+				 * fault handler must be able to make the pages writable again. The final protection is
+				 * applied afterwards, unless the block lies entirely inside an entry which already has it.
+				 */
+				ULONG protection = file_view ? PAGE_EXECUTE_READ : PAGE_EXECUTE_READWRITE;
+				bool whole_block = GET_FIRST_PAGE_OF_BLOCK(i) >= e->start_page && GET_LAST_PAGE_OF_BLOCK(i) <= e->end_page;
+				bool protect = !whole_block || prot_linux2win(file_view ? get_fork_prot(e) & ~PROT_WRITE : get_fork_prot(e)) != protection;
+				if (object_view)
+				{
+					/* File or shared memory object view, map the same part of the file */
+					offset.QuadPart = get_file_block_offset(e, i);
+					section_offset = &offset;
+				}
 				NTSTATUS status;
-				status = NtMapViewOfSection(handle, process, &base_addr, 0, BLOCK_SIZE, NULL, &view_size, ViewUnmap, 0, PAGE_EXECUTE_READWRITE);
+				status = NtMapViewOfSection(handle, process, &base_addr, 0, BLOCK_SIZE, section_offset, &view_size, ViewUnmap, 0, protection);
 				if (!NT_SUCCESS(status))
 				{
 					log_error("mm_fork(): Map failed: %p, status code: %x\n", base_addr, status);
@@ -930,35 +2059,93 @@ int mm_fork(HANDLE process)
 					return 0;
 				}
 				section_object_count++;
+				now = get_time_us();
+				mm->stats.fork_map_us += now - time;
+				time = now;
+				if (protect)
+				{
+					if (!fork_protect_block(&child_plan, i, file_view))
+						return 0;
+					now = get_time_us();
+					mm->stats.fork_protect_us += now - time;
+					time = now;
+				}
 			}
 		}
 		last_block = end_block;
 		/* Disable write permission on current process */
 		if (!(e->flags & INTERNAL_MAP_SHARED) && (e->prot & PROT_WRITE) > 0)
 		{
-			if (!mm_change_protection(process, e->start_page, e->end_page, e->prot & ~PROT_WRITE))
-				return 0;
-			if (!mm_change_protection(GetCurrentProcess(), e->start_page, e->end_page, e->prot & ~PROT_WRITE))
+			if (!mm_change_protection(&parent_plan, e->start_page, e->end_page, e->prot & ~PROT_WRITE))
 				return 0;
+			now = get_time_us();
+			mm->stats.fork_protect_us += now - time;
+			time = now;
 		}
-		else
+	}
+	if (!prot_plan_flush(&parent_plan))
+		return 0;
+	if (copy_end > copy_start)
+	{
+		SIZE_T written;
+		if (!WriteProcessMemory(process, GET_BLOCK_ADDRESS(copy_start), GET_BLOCK_ADDRESS(copy_start),
+			(copy_end - copy_start) * BLOCK_SIZE, &written))
 		{
-			if (!mm_change_protection(process, e->start_page, e->end_page, e->prot))
-				return 0;
+			log_error("WriteProcessMemory() failed, error code: %d\n", GetLastError());
+			mm_dump_windows_memory_mappings(process);
+			return 0;
 		}
 	}
+	mm->stats.fork_copy_us += get_time_us() - time;
 	log_info("Total section objects: %d\n", section_object_count);
 	return 1;
 }
 
+/* Duplicate the address space to the child, with kernel_only only kernel memory which survives execve() is duplicated
+ * On success mm->rw_lock is held until mm_afterfork_parent()
+ */
+static int fork_address_space(HANDLE process, bool kernel_only)
+{
+	/* Exclusive, page faults of other threads must not change blocks while they are duplicated */
+	AcquireSRWLockExclusive(&mm->rw_lock);
+	if (!fork_address_space_locked(process, kernel_only))
+	{
+		ReleaseSRWLockExclusive(&mm->rw_lock);
+		return 0;
+	}
+	return 1;
+}
+
+int mm_fork(HANDLE process)
+{
+	return fork_address_space(process, false);
+}
+
+int mm_fork_kernel(HANDLE process)
+{
+	return fork_address_space(process, true);
+}
+
 void mm_afterfork_parent()
 {
-	ReleaseSRWLockShared(&mm->rw_lock);
+	ReleaseSRWLockExclusive(&mm->rw_lock);
 }
 
 void mm_afterfork_child()
 {
 	InitializeSRWLock(&mm->rw_lock);
+	for (int i = 0; i < FAULT_LOCK_COUNT; i++)
+		InitializeSRWLock(&mm->fault_lock[i]);
+	/* Only live map entries were copied by mm_fork(), rebuild the free list */
+	static uint8_t live[(MAX_MMAP_COUNT + 7) / 8];
+	get_live_entries(live);
+	slist_init(&mm->entry_free_list);
+	for (size_t i = 0; i < mm->entry_count; i++)
+		if (!IS_ENTRY_LIVE(live, i))
+			slist_add(&mm->entry_free_list, &mm->entries[i].free_list);
+	RtlZeroMemory(&mm->stats, sizeof(mm->stats));
+	mm->flusher_thread = NULL;
+	mm->flusher_event = NULL;
 	mm->static_alloc_begin = (uint8_t *)mm->static_alloc_end - MM_STATIC_ALLOC_SIZE;
 	/* Remap global shared area */
 	/* TODO: Move this to mm_fork(), since parent may already be terminated at this point */
@@ -984,12 +2171,21 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		log_error("MAP_FILE with bad file descriptor.\n");
 		return (void*)-EBADF;
 	}
+	if ((flags & MAP_SHARED) && f && f->op_vtable->get_shared_section && (offset_pages % PAGES_PER_BLOCK))
+	{
+		/* Blocks are mapped as views of the object, they must start at a block boundary in it */
+		log_error("MAP_SHARED of a shared memory object at non-64kB aligned offset is unsupported.\n");
+		return (void*)-EINVAL;
+	}
 	if ((internal_flags & INTERNAL_MAP_COPYONFORK) &&
 		(!IS_ALIGNED(addr, BLOCK_SIZE) || !IS_ALIGNED(length, BLOCK_SIZE)))
 	{
 		log_error("INTERNAL_MAP_COPYONFORK memory regions must be aligned on entire blocks.\n");
 		return (void*)-EINVAL;
 	}
+	/* Whether to try backing the mapping with large pages */
+	bool hugepage = f == NULL && !(flags & MAP_SHARED) && !(internal_flags & (INTERNAL_MAP_COPYONFORK | INTERNAL_MAP_BRK))
+		&& want_hugepage(length, (flags & MAP_HUGETLB) != 0);
 	if ((flags & MAP_FIXED))
 	{
 		if ((flags & MAP_SHARED) && !IS_ALIGNED(addr, BLOCK_SIZE))
@@ -1029,10 +2225,17 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 			block_align = true;
 		}
 		size_t alloc_page;
+		size_t alloc_length = length;
+		if (hugepage)
+		{
+			/* Find a range with enough room for aligning it on a large page */
+			block_align = true;
+			alloc_length += mm->hugepage_size - BLOCK_SIZE;
+		}
 		if (internal_flags & INTERNAL_MAP_TOPDOWN)
-			alloc_page = find_free_pages_topdown(GET_PAGE(ALIGN_TO_PAGE(length)), block_align);
+			alloc_page = find_free_pages_topdown(GET_PAGE(ALIGN_TO_PAGE(alloc_length)), block_align);
 		else
-			alloc_page = find_free_pages(GET_PAGE(ALIGN_TO_PAGE(length)), block_align);
+			alloc_page = find_free_pages(GET_PAGE(ALIGN_TO_PAGE(alloc_length)), block_align);
 		if (!alloc_page)
 		{
 			log_error("Cannot find free pages.\n");
@@ -1040,7 +2243,11 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		}
 
 		addr = GET_PAGE_ADDRESS(alloc_page);
+		if (hugepage)
+			addr = (void *)ALIGN_TO((size_t)addr, mm->hugepage_size);
 	}
+	if (hugepage && !IS_ALIGNED(addr, mm->hugepage_size))
+		hugepage = false;
 	if ((flags & MAP_SHARED))
 	{
 		/* Allocate memory for now */
@@ -1086,6 +2293,8 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 	entry->f = f;
 	entry->offset_pages = offset_pages;
 	entry->prot = prot;
+	entry->fault_next_block = 0;
+	entry->fault_window = 0;
 	if (f)
 		vfs_ref(f);
 	entry->flags = 0;
@@ -1093,9 +2302,18 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		entry->flags |= INTERNAL_MAP_NORESET;
 	if (internal_flags & INTERNAL_MAP_COPYONFORK)
 		entry->flags |= INTERNAL_MAP_COPYONFORK;
+	if (flags & MAP_SHARED)
+		entry->flags |= INTERNAL_MAP_SHARED;
+	if (internal_flags & INTERNAL_MAP_BRK)
+		entry->flags |= INTERNAL_MAP_BRK;
 
-	rb_add(&mm->entry_tree, &entry->tree, map_entry_cmp);
+	insert_map_entry(entry);
 
+	if (hugepage && make_hugepage_entry(entry))
+	{
+		log_info("Allocated memory with large pages: [%p, %p)\n", addr, (size_t)addr + length);
+		return addr;
+	}
 	if (internal_flags & INTERNAL_MAP_COPYONFORK)
 	{
 		/* Allocate the memory now */
@@ -1122,8 +2340,8 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		DWORD oldProtect;
 		VirtualProtect(GET_PAGE_ADDRESS(start_page), (last_page - start_page + 1) * PAGE_SIZE, prot_linux2win(prot | PROT_WRITE), &oldProtect);
 		map_entry_range(entry, start_page, last_page);
-		if ((prot & PROT_WRITE) == 0)
-			VirtualProtect(GET_PAGE_ADDRESS(start_page), (last_page - start_page + 1) * PAGE_SIZE, prot_linux2win(prot), &oldProtect);
+		if ((get_populate_prot(entry) & PROT_WRITE) == 0)
+			VirtualProtect(GET_PAGE_ADDRESS(start_page), (last_page - start_page + 1) * PAGE_SIZE, prot_linux2win(get_populate_prot(entry)), &oldProtect);
 		start_block++;
 	}
 	if (end_block >= start_block && get_section_handle(end_block))
@@ -1137,16 +2355,13 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		DWORD oldProtect;
 		VirtualProtect(GET_PAGE_ADDRESS(first_page), (end_page - first_page + 1) * PAGE_SIZE, prot_linux2win(prot | PROT_WRITE), &oldProtect);
 		map_entry_range(entry, first_page, end_page);
-		if ((prot & PROT_WRITE) == 0)
-			VirtualProtect(GET_PAGE_ADDRESS(first_page), (end_page - first_page + 1) * PAGE_SIZE, prot_linux2win(prot), &oldProtect);
+		if ((get_populate_prot(entry) & PROT_WRITE) == 0)
+			VirtualProtect(GET_PAGE_ADDRESS(first_page), (end_page - first_page + 1) * PAGE_SIZE, prot_linux2win(get_populate_prot(entry)), &oldProtect);
 		end_block--;
 	}
-	if ((flags & MAP_POPULATE) && start_block < end_block)
+	if ((flags & MAP_POPULATE) && start_block <= end_block)
 	{
-		for (size_t i = start_block; i <= end_block; i++)
-			allocate_block(i);
-		map_entry_range(entry, GET_FIRST_PAGE_OF_BLOCK(start_block), GET_LAST_PAGE_OF_BLOCK(end_block));
-		mm_change_protection(GetCurrentProcess(), GET_FIRST_PAGE_OF_BLOCK(start_block), GET_LAST_PAGE_OF_BLOCK(end_block), prot);
+		populate_entry_blocks(entry, start_block, end_block);
 	}
 	log_info("Allocated memory: [%p, %p)\n", addr, (size_t)addr + length);
 	return addr;
@@ -1154,7 +2369,6 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 
 static int munmap_internal(void *addr, size_t length)
 {
-	/* TODO: We should mark NOACCESS for munmap()-ed but not VirtualFree()-ed pages */
 	if (!IS_ALIGNED(addr, PAGE_SIZE))
 		return -EINVAL;
 	length = ALIGN_TO_PAGE(length);
@@ -1167,6 +2381,10 @@ static int munmap_internal(void *addr, size_t length)
 
 	size_t start_page = GET_PAGE(addr);
 	size_t end_page = GET_PAGE((size_t)addr + length - 1);
+	mm->stats.munmap_calls++;
+	/* Inaccessible tails of blocks shared by adjacent unmapped entries are merged */
+	struct prot_plan plan;
+	prot_plan_init(&plan, GetCurrentProcess(), &mm->stats.munmap_protect_calls);
 	for (struct rb_node *cur = start_node(start_page); cur;)
 	{
 		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
@@ -1181,6 +2399,7 @@ static int munmap_internal(void *addr, size_t length)
 				cur = rb_next(cur);
 				continue;
 			}
+			writeback_range(e, range_start, range_end);
 			if (range_start == e->start_page && range_end == e->end_page)
 			{
 				/* That's good, the current entry is fully overlapped */
@@ -1190,20 +2409,25 @@ static int munmap_internal(void *addr, size_t length)
 					dbt_code_changed((size_t)GET_PAGE_ADDRESS(e->start_page), (e->end_page - e->start_page + 1) * PAGE_SIZE);
 				}
 				struct rb_node *next = rb_next(cur);
-				free_map_entry_blocks(e);
-				rb_remove(&mm->entry_tree, cur);
+				free_map_entry_blocks(e, &plan);
+				remove_map_entry(e);
 				free_map_entry(e);
 				cur = next;
 			}
 			else
 			{
 				/* Not so good, part of current entry is overlapped */
+				if ((e->flags & INTERNAL_MAP_HUGEPAGE) && !split_hugepage_entry(e))
+				{
+					prot_plan_flush(&plan);
+					return -ENOMEM;
+				}
 				if (range_start == e->start_page)
 				{
 					split_map_entry(e, range_end);
 					struct rb_node *next = rb_next(cur);
-					free_map_entry_blocks(e);
-					rb_remove(&mm->entry_tree, cur);
+					free_map_entry_blocks(e, &plan);
+					remove_map_entry(e);
 					free_map_entry(e);
 					cur = next;
 				}
@@ -1216,7 +2440,338 @@ static int munmap_internal(void *addr, size_t length)
 			}
 		}
 	}
-	return 0;
+	prot_plan_flush(&plan);
+	return 0;
+}
+
+/* Whether map entry e can grow into pages [start_page, end_page]
+ * The pages must not be used or reserved by any other entry, see entry_next_free_page(). The brk arena
+ * is only available to the heap.
+ */
+static bool pages_free(struct map_entry *e, size_t start_page, size_t end_page)
+{
+	/* MAP_SHARED entries always occupy entire blocks */
+	if (e->flags & INTERNAL_MAP_SHARED)
+		end_page = GET_LAST_PAGE_OF_BLOCK(GET_BLOCK_OF_PAGE(end_page));
+	if (!(e->flags & INTERNAL_MAP_BRK) && mm->brk_limit > mm->brk_start
+		&& start_page < GET_PAGE(mm->brk_limit) && end_page >= GET_PAGE(mm->brk_start))
+		return false;
+	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *other = rb_entry(cur, struct map_entry, tree);
+		if (other->start_page > end_page)
+			break;
+		if (other != e && entry_next_free_page(other) > start_page)
+			return false;
+	}
+	return true;
+}
+
+/* Set up content of pages [start_page, end_page] of map entry e which lie in already populated blocks
+ * Other blocks are populated on demand as usual.
+ */
+static bool fill_populated_pages(struct map_entry *e, size_t start_page, size_t end_page)
+{
+	for (size_t i = GET_BLOCK_OF_PAGE(start_page); i <= GET_BLOCK_OF_PAGE(end_page); i++)
+	{
+		if (!get_section_handle(i))
+			continue;
+		if (!take_block_ownership(i))
+		{
+			log_error("Taking ownership of block %p failed.\n", i);
+			return false;
+		}
+		size_t range_start = max(start_page, GET_FIRST_PAGE_OF_BLOCK(i));
+		size_t range_end = min(end_page, GET_LAST_PAGE_OF_BLOCK(i));
+		DWORD oldProtect;
+		VirtualProtect(GET_PAGE_ADDRESS(range_start), (range_end - range_start + 1) * PAGE_SIZE, prot_linux2win(e->prot | PROT_WRITE), &oldProtect);
+		map_entry_range(e, range_start, range_end);
+		if ((get_populate_prot(e) & PROT_WRITE) == 0)
+			VirtualProtect(GET_PAGE_ADDRESS(range_start), (range_end - range_start + 1) * PAGE_SIZE, prot_linux2win(get_populate_prot(e)), &oldProtect);
+	}
+	return true;
+}
+
+/* Whether MAP_SHARED map entry e can grow into pages [start_page, end_page] without breaking sharing
+ * The section of a populated file block holds file content written back on msync(), its new pages must be
+ * read from the file. That is only safe if no forked process uses the section.
+ */
+static bool can_grow_shared_entry(struct map_entry *e, size_t start_page, size_t end_page)
+{
+	if (!e->f || is_shm_entry(e))
+		return true;
+	for (size_t i = GET_BLOCK_OF_PAGE(start_page); i <= GET_BLOCK_OF_PAGE(end_page); i++)
+		if (get_section_handle(i) && !is_block_exclusive(i))
+			return false;
+	return true;
+}
+
+/* Set up pages [start_page, end_page] a MAP_SHARED map entry e has grown into
+ * Populated blocks keep their sections: views of a shared memory object and shared anonymous sections
+ * already hold the content of the new pages. Other blocks are populated right away, as mmap() does for
+ * MAP_SHARED, so later forked processes share them.
+ */
+static bool fill_shared_pages(struct map_entry *e, size_t start_page, size_t end_page)
+{
+	size_t start_block = GET_BLOCK_OF_PAGE(start_page);
+	size_t end_block = GET_BLOCK_OF_PAGE(end_page);
+	for (size_t i = start_block; i <= end_block; i++)
+	{
+		if (!get_section_handle(i))
+			continue;
+		size_t range_start = max(start_page, GET_FIRST_PAGE_OF_BLOCK(i));
+		size_t range_end = min(end_page, GET_LAST_PAGE_OF_BLOCK(i));
+		DWORD oldProtect;
+		if (e->f && !is_shm_entry(e))
+		{
+			VirtualProtect(GET_PAGE_ADDRESS(range_start), (range_end - range_start + 1) * PAGE_SIZE, PAGE_READWRITE, &oldProtect);
+			map_entry_range(e, range_start, range_end);
+		}
+		VirtualProtect(GET_PAGE_ADDRESS(range_start), (range_end - range_start + 1) * PAGE_SIZE, prot_linux2win(get_populate_prot(e)), &oldProtect);
+	}
+	/* Blocks after the last populated one */
+	while (start_block <= end_block && get_section_handle(start_block))
+		start_block++;
+	if (start_block <= end_block)
+		populate_entry_blocks(e, start_block, end_block);
+	return true;
+}
+
+/* Move the section of block src to block dst, which belongs to map entry e */
+static bool move_block(struct map_entry *e, size_t src, size_t dst)
+{
+	/* Privately copied pages only live in our view, which is going away */
+	if (mm_block_private[src] && !merge_private_pages(src))
+		return false;
+	HANDLE handle = get_section_handle(src);
+	int type = mm_block_type[src];
+	PVOID base_addr = GET_BLOCK_ADDRESS(dst);
+	SIZE_T view_size = BLOCK_SIZE;
+	LARGE_INTEGER offset, *section_offset = NULL;
+	ULONG protection = is_file_block(src) ? PAGE_EXECUTE_READ : PAGE_EXECUTE_READWRITE;
+	if (is_object_block(src))
+	{
+		offset.QuadPart = get_file_block_offset(e, dst);
+		section_offset = &offset;
+	}
+	NtUnmapViewOfSection(NtCurrentProcess(), GET_BLOCK_ADDRESS(src));
+	remove_section_handle(src);
+	NTSTATUS status = NtMapViewOfSection(handle, NtCurrentProcess(), &base_addr, 0, BLOCK_SIZE, section_offset, &view_size, ViewUnmap, 0, protection);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("NtMapViewOfSection() failed. Address: %p, Status: %x\n", base_addr, status);
+		NtClose(handle);
+		mm_dump_windows_memory_mappings(NtCurrentProcess());
+		return false;
+	}
+	add_section_handle(dst, handle, type);
+	return true;
+}
+
+/* Move pages [old_start_page, old_start_page + old_pages) of map entry e to new_start_page, resizing it to new_pages
+ * The destination must be free. Whole blocks at the same in-block offset are moved by remapping their
+ * sections, only pages in partial blocks are copied.
+ */
+static void *move_mapping(struct map_entry *e, size_t old_start_page, size_t old_pages, size_t new_start_page, size_t new_pages)
+{
+	struct map_entry *ne = new_map_entry();
+	if (!ne)
+		return (void*)-ENOMEM;
+	/* Dirty state is not moved, write back dirty pages now */
+	writeback_range(e, old_start_page, old_start_page + old_pages - 1);
+	ne->start_page = new_start_page;
+	ne->end_page = new_start_page + new_pages - 1;
+	if ((ne->f = e->f))
+	{
+		vfs_ref(ne->f);
+		ne->offset_pages = e->offset_pages + (off_t)(old_start_page - e->start_page);
+	}
+	ne->prot = e->prot;
+	ne->flags = e->flags;
+	ne->fault_next_block = 0;
+	ne->fault_window = 0;
+	insert_map_entry(ne);
+
+	size_t delta = new_start_page - old_start_page;
+	size_t moved_end_page = new_start_page + min(old_pages, new_pages) - 1;
+	/* Make source pages readable for copying, they are unmapped afterwards anyway */
+	size_t old_end_page = old_start_page + old_pages - 1;
+	for (size_t i = GET_BLOCK_OF_PAGE(old_start_page); i <= GET_BLOCK_OF_PAGE(old_end_page); i++)
+		if (get_section_handle(i))
+		{
+			size_t range_start = max(old_start_page, GET_FIRST_PAGE_OF_BLOCK(i));
+			size_t range_end = min(old_end_page, GET_LAST_PAGE_OF_BLOCK(i));
+			DWORD oldProtect;
+			VirtualProtect(GET_PAGE_ADDRESS(range_start), (range_end - range_start + 1) * PAGE_SIZE, PAGE_READONLY, &oldProtect);
+		}
+
+	void *r = GET_PAGE_ADDRESS(new_start_page);
+	for (size_t i = GET_BLOCK_OF_PAGE(ne->start_page); i <= GET_BLOCK_OF_PAGE(ne->end_page); i++)
+	{
+		size_t range_start = max(ne->start_page, GET_FIRST_PAGE_OF_BLOCK(i));
+		size_t range_end = min(ne->end_page, GET_LAST_PAGE_OF_BLOCK(i));
+		if (delta % PAGES_PER_BLOCK == 0 && range_start == GET_FIRST_PAGE_OF_BLOCK(i) && range_end == GET_LAST_PAGE_OF_BLOCK(i)
+			&& range_end <= moved_end_page && !get_section_handle(i))
+		{
+			size_t src = GET_BLOCK_OF_PAGE(GET_FIRST_PAGE_OF_BLOCK(i) - delta);
+			if (get_section_handle(src) && !move_block(ne, src, i))
+			{
+				r = (void*)-ENOMEM;
+				break;
+			}
+			/* Unpopulated blocks are populated on demand */
+			continue;
+		}
+		/* Partial block, copy populated source pages */
+		bool populated = get_section_handle(i) != NULL;
+		bool copy = false;
+		for (size_t page = range_start; page <= min(range_end, moved_end_page); page++)
+			if (get_section_handle(GET_BLOCK_OF_PAGE(page - delta)))
+			{
+				copy = true;
+				break;
+			}
+		if (!copy)
+		{
+			/* Nothing to copy, just set up the content of new pages in an already populated block */
+			if (populated && !fill_populated_pages(ne, range_start, range_end))
+			{
+				r = (void*)-ENOMEM;
+				break;
+			}
+			continue;
+		}
+		if (populated)
+		{
+			if (!take_block_ownership(i))
+			{
+				log_error("Taking ownership of block %p failed.\n", i);
+				r = (void*)-ENOMEM;
+				break;
+			}
+		}
+		else if (!populate_block(i, range_start))
+		{
+			r = (void*)-ENOMEM;
+			break;
+		}
+		DWORD oldProtect;
+		VirtualProtect(GET_PAGE_ADDRESS(range_start), (range_end - range_start + 1) * PAGE_SIZE, PAGE_READWRITE, &oldProtect);
+		for (size_t page = range_start; page <= range_end; page++)
+		{
+			if (page <= moved_end_page && get_section_handle(GET_BLOCK_OF_PAGE(page - delta)))
+				RtlCopyMemory(GET_PAGE_ADDRESS(page), GET_PAGE_ADDRESS(page - delta), PAGE_SIZE);
+			else if (populated) /* Freshly populated blocks already have the content */
+				map_entry_range(ne, page, page);
+		}
+	}
+	if (r != GET_PAGE_ADDRESS(new_start_page))
+	{
+		munmap_internal(GET_PAGE_ADDRESS(ne->start_page), (ne->end_page - ne->start_page + 1) * PAGE_SIZE);
+		return r;
+	}
+	munmap_internal(GET_PAGE_ADDRESS(old_start_page), old_pages * PAGE_SIZE);
+	/* Moved sections may still be shared with forked processes, remove write protection as mprotect() does */
+	struct prot_plan plan;
+	prot_plan_init(&plan, GetCurrentProcess(), &mm->stats.mremap_protect_calls);
+	if (mm_change_protection(&plan, ne->start_page, ne->end_page, ne->prot & ~PROT_WRITE))
+		prot_plan_flush(&plan);
+	return r;
+}
+
+static void *mremap_internal(void *old_address, size_t old_size, size_t new_size, int flags, void *new_address)
+{
+	if (!IS_ALIGNED(old_address, PAGE_SIZE))
+		return (void*)-EINVAL;
+	if (flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED))
+		return (void*)-EINVAL;
+	if ((flags & MREMAP_FIXED) && !(flags & MREMAP_MAYMOVE))
+		return (void*)-EINVAL;
+	old_size = ALIGN_TO_PAGE(old_size);
+	new_size = ALIGN_TO_PAGE(new_size);
+	if (new_size == 0)
+		return (void*)-EINVAL;
+	if (old_size == 0)
+	{
+		log_error("mremap(): Duplicating a shared mapping is not supported.\n");
+		return (void*)-EINVAL;
+	}
+	size_t old_start_page = GET_PAGE(old_address);
+	size_t old_pages = GET_PAGE(old_size);
+	size_t old_end_page = old_start_page + old_pages - 1;
+	size_t new_pages = GET_PAGE(new_size);
+
+	/* The old range must lie in a single map entry */
+	struct rb_node *node = start_node(old_start_page);
+	if (!node)
+		return (void*)-EFAULT;
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	if (e->start_page > old_start_page || e->end_page < old_end_page)
+		return (void*)-EFAULT;
+	if ((e->flags & INTERNAL_MAP_HUGEPAGE) && !split_hugepage_entry(e))
+		return (void*)-ENOMEM;
+	if (e->flags & INTERNAL_MAP_COPYONFORK)
+	{
+		log_error("mremap(): Copy on fork memory regions cannot be remapped.\n");
+		return (void*)-EINVAL;
+	}
+
+	if (flags & MREMAP_FIXED)
+	{
+		if (!IS_ALIGNED(new_address, PAGE_SIZE))
+			return (void*)-EINVAL;
+		if ((size_t)new_address < ADDRESS_SPACE_LOW || (size_t)new_address >= ADDRESS_SPACE_HIGH
+			|| (size_t)new_address + new_size < ADDRESS_SPACE_LOW || (size_t)new_address + new_size >= ADDRESS_SPACE_HIGH
+			|| (size_t)new_address + new_size < (size_t)new_address)
+			return (void*)-EINVAL;
+		size_t new_start_page = GET_PAGE(new_address);
+		if (new_start_page <= old_end_page && old_start_page <= new_start_page + new_pages - 1)
+			return (void*)-EINVAL;
+		munmap_internal(new_address, new_size);
+		/* The unmapping may have split the old entry */
+		e = rb_entry(start_node(old_start_page), struct map_entry, tree);
+		return move_mapping(e, old_start_page, old_pages, new_start_page, new_pages);
+	}
+
+	if (new_pages <= old_pages)
+	{
+		/* Shrink */
+		if (new_pages < old_pages)
+			munmap_internal(GET_PAGE_ADDRESS(old_start_page + new_pages), (old_pages - new_pages) * PAGE_SIZE);
+		return old_address;
+	}
+
+	/* Grow in place if the following pages are free */
+	size_t grow_start = old_end_page + 1;
+	size_t grow_end = old_start_page + new_pages - 1;
+	bool shared = (e->flags & INTERNAL_MAP_SHARED) != 0;
+	if (old_end_page == e->end_page && grow_end < GET_PAGE(ADDRESS_SPACE_HIGH) && pages_free(e, grow_start, grow_end)
+		&& (!shared || can_grow_shared_entry(e, grow_start, grow_end)))
+	{
+		e->end_page = grow_end;
+		update_next_gap(e);
+		/* Taking ownership of blocks would break sharing of MAP_SHARED entries */
+		if (!(shared ? fill_shared_pages(e, grow_start, grow_end) : fill_populated_pages(e, grow_start, grow_end)))
+		{
+			e->end_page = old_end_page;
+			update_next_gap(e);
+			return (void*)-ENOMEM;
+		}
+		log_info("mremap(): Grown in place.\n");
+		return old_address;
+	}
+	if (!(flags & MREMAP_MAYMOVE))
+		return (void*)-ENOMEM;
+
+	/* Move to a new place at the same offset in block, so whole blocks can be moved without copying */
+	size_t block_offset = old_start_page % PAGES_PER_BLOCK;
+	size_t alloc_page = find_free_pages(new_pages + block_offset, true);
+	if (!alloc_page)
+	{
+		log_error("Cannot find free pages.\n");
+		return (void*)-ENOMEM;
+	}
+	return move_mapping(e, old_start_page, old_pages, alloc_page + block_offset, new_pages);
 }
 
 void *mm_mmap(void *addr, size_t length, int prot, int flags, int internal_flags, struct file *f, off_t offset_pages)
@@ -1286,6 +2841,8 @@ DEFINE_SYSCALL(mprotect, void *, addr, size_t, length, int, prot)
 	log_info("mprotect(%p, %p, %x)\n", addr, length, prot);
 	int r = 0;
 	AcquireSRWLockExclusive(&mm->rw_lock);
+	mm->stats.mprotect_calls++;
+	uint64_t protect_calls = mm->stats.mprotect_protect_calls;
 	if (!IS_ALIGNED(addr, PAGE_SIZE))
 	{
 		r = -EINVAL;
@@ -1334,6 +2891,23 @@ DEFINE_SYSCALL(mprotect, void *, addr, size_t, length, int, prot)
 			size_t range_end = min(end_page, e->end_page);
 			if (range_start > range_end)
 				continue;
+			if (e->flags & INTERNAL_MAP_HUGEPAGE)
+			{
+				/* Large pages are protected as a whole, or moved to ordinary blocks first */
+				DWORD oldProtect;
+				if (range_start == e->start_page && range_end == e->end_page)
+				{
+					mm->stats.mprotect_protect_calls++;
+					mm->stats.protect_calls++;
+				}
+				if ((range_start != e->start_page || range_end != e->end_page
+					|| !VirtualProtect(GET_PAGE_ADDRESS(e->start_page), (e->end_page - e->start_page + 1) * PAGE_SIZE, prot_linux2win(prot), &oldProtect))
+					&& !split_hugepage_entry(e))
+				{
+					r = -ENOMEM;
+					goto out;
+				}
+			}
 			if (range_start == e->start_page && range_end == e->end_page)
 			{
 				/* That's good, the current entry is fully overlapped */
@@ -1355,14 +2929,17 @@ DEFINE_SYSCALL(mprotect, void *, addr, size_t, length, int, prot)
 			}
 		}
 	}
-	if (!mm_change_protection(GetCurrentProcess(), start_page, end_page, prot & ~PROT_WRITE))
+	/* We remove the write protection in case the pages are already shared */
+	struct prot_plan plan;
+	prot_plan_init(&plan, GetCurrentProcess(), &mm->stats.mprotect_protect_calls);
+	if (!mm_change_protection(&plan, start_page, end_page, prot & ~PROT_WRITE) || !prot_plan_flush(&plan))
 	{
-		/* We remove the write protection in case the pages are already shared */
 		r = -ENOMEM; /* TODO */
 		goto out;
 	}
 
 out:
+	log_info("mprotect(): %d protection calls issued.\n", (int)(mm->stats.mprotect_protect_calls - protect_calls));
 	ReleaseSRWLockExclusive(&mm->rw_lock);
 	return r;
 }
@@ -1370,8 +2947,43 @@ out:
 DEFINE_SYSCALL(msync, void *, addr, size_t, len, int, flags)
 {
 	log_info("msync(0x%p, 0x%p, %d)\n", addr, len, flags);
-	log_error("msync() not implemented.\n");
-	return -ENOSYS;
+	if (!IS_ALIGNED(addr, PAGE_SIZE))
+		return -EINVAL;
+	if ((flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC)) || ((flags & MS_ASYNC) && (flags & MS_SYNC)))
+		return -EINVAL;
+	len = ALIGN_TO_PAGE(len);
+	if (len == 0)
+		return 0;
+	if ((size_t)addr < ADDRESS_SPACE_LOW || (size_t)addr >= ADDRESS_SPACE_HIGH
+		|| (size_t)addr + len < ADDRESS_SPACE_LOW || (size_t)addr + len >= ADDRESS_SPACE_HIGH
+		|| (size_t)addr + len < (size_t)addr)
+		return -ENOMEM;
+	int r = 0;
+	AcquireSRWLockExclusive(&mm->rw_lock);
+	size_t start_page = GET_PAGE(addr);
+	size_t end_page = GET_PAGE((size_t)addr + len - 1);
+	size_t last_page = start_page - 1;
+	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (e->start_page > end_page)
+			break;
+		if (e->end_page < start_page)
+			continue;
+		if (e->start_page > last_page + 1)
+			r = -ENOMEM; /* Unmapped pages in range, still sync the mapped ones as Linux does */
+		last_page = e->end_page;
+		/* MS_ASYNC writes back everything in the background */
+		if (!(flags & MS_ASYNC))
+			writeback_range(e, max(start_page, e->start_page), min(end_page, e->end_page));
+	}
+	if (last_page < end_page)
+		r = -ENOMEM;
+	if (flags & MS_ASYNC)
+		schedule_writeback();
+	/* MS_INVALIDATE: Nothing to do, all mappings of this process see the same pages */
+	ReleaseSRWLockExclusive(&mm->rw_lock);
+	return r;
 }
 
 static int mm_populate_internal(const void *addr, size_t len)
@@ -1389,12 +3001,15 @@ static int mm_populate_internal(const void *addr, size_t len)
 			size_t range_end = min(end_page, e->end_page);
 			if (range_start > range_end)
 				continue;
+			/* Copy on fork regions are always committed */
+			if (e->flags & INTERNAL_MAP_COPYONFORK)
+				continue;
 
 			size_t start_block = GET_BLOCK_OF_PAGE(range_start);
 			size_t end_block = GET_BLOCK_OF_PAGE(range_end);
 			/* TODO: Optimization: batch operation on continuous blocks */
 			for (size_t i = start_block; i <= end_block; i++)
-				if (get_section_handle(i))
+				if (get_section_handle(i) || map_file_block(i))
 					continue;
 				else
 				{
@@ -1403,10 +3018,11 @@ static int mm_populate_internal(const void *addr, size_t len)
 					size_t first_page = max(range_start, GET_FIRST_PAGE_OF_BLOCK(i));
 					size_t last_page = min(range_end, GET_LAST_PAGE_OF_BLOCK(i));
 					map_entry_range(e, first_page, last_page);
-					if (e->prot != PROT_READ | PROT_WRITE | PROT_EXEC)
+					int prot = get_populate_prot(e);
+					if (prot != (PROT_READ | PROT_WRITE | PROT_EXEC))
 					{
 						DWORD oldProtect;
-						VirtualProtect(GET_PAGE_ADDRESS(first_page), (last_page - first_page + 1) * PAGE_SIZE, prot_linux2win(e->prot), &oldProtect);
+						VirtualProtect(GET_PAGE_ADDRESS(first_page), (last_page - first_page + 1) * PAGE_SIZE, prot_linux2win(prot), &oldProtect);
 					}
 				}
 		}
@@ -1426,6 +3042,271 @@ void mm_populate(void *addr)
 	ReleaseSRWLockExclusive(&mm->rw_lock);
 }
 
+unsigned int mm_get_fault_around()
+{
+	return mm->fault_around_max;
+}
+
+void mm_set_fault_around(unsigned int blocks)
+{
+	AcquireSRWLockExclusive(&mm->rw_lock);
+	mm->fault_around_max = blocks;
+	ReleaseSRWLockExclusive(&mm->rw_lock);
+}
+
+/* Resident pages of a map entry, by how they are shared */
+struct entry_rss
+{
+	size_t private_pages; /* Anonymous blocks only referenced by us */
+	size_t cow_pages; /* Anonymous blocks still shared with forked processes */
+	size_t file_pages; /* Read only file view blocks, shared with the system file cache */
+	size_t shared_pages; /* MAP_SHARED memory */
+	size_t hugepage_pages; /* Private memory backed by large pages */
+};
+
+/* Account the resident pages of map entry e
+ * A page is considered resident when its block is populated, whether it is actually in
+ * the working set is up to Windows. Blocks are classified by the handle count of their
+ * section, the same way take_block_ownership() decides whether a block must be copied.
+ * A copy on fork region is committed as a whole and never shared.
+ */
+static void get_entry_rss(struct map_entry *e, struct entry_rss *rss)
+{
+	if (e->flags & INTERNAL_MAP_COPYONFORK)
+	{
+		size_t pages = e->end_page - e->start_page + 1;
+		rss->private_pages += pages;
+		if (e->flags & INTERNAL_MAP_HUGEPAGE)
+			rss->hugepage_pages += pages;
+		return;
+	}
+	size_t start_block = GET_BLOCK_OF_PAGE(e->start_page);
+	size_t end_block = GET_BLOCK_OF_PAGE(e->end_page);
+	for (size_t i = start_block; i <= end_block; i++)
+	{
+		HANDLE handle = get_section_handle(i);
+		if (!handle)
+			continue;
+		size_t range_start = max(e->start_page, GET_FIRST_PAGE_OF_BLOCK(i));
+		size_t range_end = min(e->end_page, GET_LAST_PAGE_OF_BLOCK(i));
+		size_t pages = range_end - range_start + 1;
+		OBJECT_BASIC_INFORMATION info;
+		if (e->flags & INTERNAL_MAP_SHARED)
+			rss->shared_pages += pages;
+		else if (is_file_block(i))
+			rss->file_pages += pages;
+		else if (NT_SUCCESS(NtQueryObject(handle, ObjectBasicInformation, &info, sizeof(OBJECT_BASIC_INFORMATION), NULL))
+			&& info.HandleCount > 1)
+		{
+			/* Pages copied by copy_page_on_write() are our own */
+			size_t copied = 0;
+			for (size_t page = range_start; page <= range_end; page++)
+				if (mm_block_private[i] & (1 << GET_PAGE_IN_BLOCK(page)))
+					copied++;
+			rss->private_pages += copied;
+			rss->cow_pages += pages - copied;
+		}
+		else
+			rss->private_pages += pages;
+	}
+}
+
+/* Print the /proc/[pid]/maps line of map entry e */
+static int print_map_entry(char *buf, struct map_entry *e)
+{
+	char *original_buf = buf;
+	uint64_t offset = 0, inode = 0;
+	unsigned int dev = 0;
+	char path[PATH_MAX];
+	path[0] = 0;
+	if (e->f)
+	{
+		offset = (uint64_t)e->offset_pages * PAGE_SIZE;
+		struct newstat stat;
+		if (e->f->op_vtable->stat && e->f->op_vtable->stat(e->f, &stat) == 0)
+		{
+			dev = (unsigned int)stat.st_dev;
+			inode = stat.st_ino;
+		}
+		if (e->f->op_vtable->getpath)
+			e->f->op_vtable->getpath(e->f, path);
+	}
+	else if (e->flags & INTERNAL_MAP_BRK)
+		strcpy(path, "[heap]");
+	buf += ksprintf(buf, "%08llx-%08llx %c%c%c%c %08llx %02x:%02x %llu",
+		(uint64_t)GET_PAGE_ADDRESS(e->start_page), (uint64_t)GET_PAGE_ADDRESS(e->end_page + 1),
+		(e->prot & PROT_READ) ? 'r' : '-', (e->prot & PROT_WRITE) ? 'w' : '-', (e->prot & PROT_EXEC) ? 'x' : '-',
+		(e->flags & INTERNAL_MAP_SHARED) ? 's' : 'p', offset, major(dev), minor(dev), inode);
+	if (path[0])
+	{
+		/* Align path names to the same column as Linux does */
+		int len = (int)(buf - original_buf);
+		do
+			*buf++ = ' ';
+		while (++len < 73);
+		buf += ksprintf(buf, "%s", path);
+	}
+	buf += ksprintf(buf, "\n");
+	return (int)(buf - original_buf);
+}
+
+/* Generate /proc/[pid]/maps (smaps == false) or /proc/[pid]/smaps (smaps == true) of the current process
+ * Kernel mappings (INTERNAL_MAP_NORESET) are not shown. Output is truncated to fit in size bytes.
+ */
+int mm_get_maps(char *buf, int size, bool smaps)
+{
+	/* Longest text of a single map entry */
+	const int max_entry_len = PATH_MAX + 512;
+	AcquireSRWLockShared(&mm->rw_lock);
+	char *original_buf = buf;
+	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (e->flags & INTERNAL_MAP_NORESET)
+			continue;
+		if (buf - original_buf + max_entry_len > size)
+			break;
+		buf += print_map_entry(buf, e);
+		if (smaps)
+		{
+			struct entry_rss rss = { 0 };
+			get_entry_rss(e, &rss);
+			size_t kb_per_page = PAGE_SIZE / 1024;
+			size_t rss_pages = rss.private_pages + rss.cow_pages + rss.file_pages + rss.shared_pages;
+			buf += ksprintf(buf, "Size:           %8lu kB\n", (e->end_page - e->start_page + 1) * kb_per_page);
+			buf += ksprintf(buf, "Rss:            %8lu kB\n", rss_pages * kb_per_page);
+			buf += ksprintf(buf, "Shared_Clean:   %8lu kB\n", rss.file_pages * kb_per_page);
+			buf += ksprintf(buf, "Shared_Dirty:   %8lu kB\n", (rss.cow_pages + rss.shared_pages) * kb_per_page);
+			buf += ksprintf(buf, "Private_Clean:  %8lu kB\n", (size_t)0);
+			buf += ksprintf(buf, "Private_Dirty:  %8lu kB\n", rss.private_pages * kb_per_page);
+			buf += ksprintf(buf, "AnonHugePages:  %8lu kB\n", rss.hugepage_pages * kb_per_page);
+			buf += ksprintf(buf, "Swap:           %8lu kB\n", (size_t)0);
+		}
+	}
+	ReleaseSRWLockShared(&mm->rw_lock);
+	return (int)(buf - original_buf);
+}
+
+/* Memory usage of user mappings of the current process, in pages */
+static void get_usage(size_t *vm_pages, struct entry_rss *rss)
+{
+	*vm_pages = 0;
+	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (e->flags & INTERNAL_MAP_NORESET)
+			continue;
+		*vm_pages += e->end_page - e->start_page + 1;
+		get_entry_rss(e, rss);
+	}
+}
+
+void mm_get_usage(size_t *vm_pages, size_t *rss_pages)
+{
+	struct entry_rss rss = { 0 };
+	AcquireSRWLockShared(&mm->rw_lock);
+	get_usage(vm_pages, &rss);
+	ReleaseSRWLockShared(&mm->rw_lock);
+	*rss_pages = rss.private_pages + rss.cow_pages + rss.file_pages + rss.shared_pages;
+}
+
+/* Generate memory related lines of /proc/[pid]/status of the current process */
+int mm_get_status(char *buf)
+{
+	size_t vm_pages;
+	struct entry_rss rss = { 0 };
+	AcquireSRWLockShared(&mm->rw_lock);
+	get_usage(&vm_pages, &rss);
+	struct mm_stats stats = mm->stats;
+	size_t hugepage_usage = mm->hugepage_usage;
+	ReleaseSRWLockShared(&mm->rw_lock);
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		counters.PeakWorkingSetSize = 0;
+
+	size_t kb_per_page = PAGE_SIZE / 1024;
+	size_t anon_pages = rss.private_pages + rss.cow_pages;
+	char *original_buf = buf;
+	buf += ksprintf(buf, "VmSize:\t%8lu kB\n", vm_pages * kb_per_page);
+	buf += ksprintf(buf, "VmHWM:\t%8lu kB\n", counters.PeakWorkingSetSize / 1024);
+	buf += ksprintf(buf, "VmRSS:\t%8lu kB\n", (anon_pages + rss.file_pages + rss.shared_pages) * kb_per_page);
+	buf += ksprintf(buf, "RssAnon:\t%8lu kB\n", anon_pages * kb_per_page);
+	buf += ksprintf(buf, "RssFile:\t%8lu kB\n", rss.file_pages * kb_per_page);
+	buf += ksprintf(buf, "RssShmem:\t%8lu kB\n", rss.shared_pages * kb_per_page);
+	/* Not in Linux, which reports it per mapping in smaps only */
+	buf += ksprintf(buf, "AnonHugePages:\t%8lu kB\n", hugepage_usage / 1024);
+	/* Not in Linux, fault statistics of the emulated memory manager */
+	buf += ksprintf(buf, "OnDemandFaults:\t%llu\n", stats.on_demand_faults);
+	buf += ksprintf(buf, "CowFaults:\t%llu\n", stats.cow_faults);
+	buf += ksprintf(buf, "DuplicatedBlocks:\t%llu\n", stats.duplicated_blocks);
+	return (int)(buf - original_buf);
+}
+
+int mm_get_stats(char *buf)
+{
+	AcquireSRWLockShared(&mm->rw_lock);
+	struct mm_stats stats = mm->stats;
+	unsigned int fault_around_max = mm->fault_around_max;
+	ReleaseSRWLockShared(&mm->rw_lock);
+	char *original_buf = buf;
+	buf += ksprintf(buf, "on_demand_faults:     %llu\n", stats.on_demand_faults);
+	buf += ksprintf(buf, "cow_faults:           %llu\n", stats.cow_faults);
+	buf += ksprintf(buf, "duplicated_blocks:    %llu\n", stats.duplicated_blocks);
+	buf += ksprintf(buf, "cow_pages:            %llu\n", stats.cow_pages);
+	buf += ksprintf(buf, "private_merges:       %llu\n", stats.private_merges);
+	buf += ksprintf(buf, "fault_around_max:     %u\n", fault_around_max);
+	buf += ksprintf(buf, "fault_around_hits:    %llu\n", stats.fault_around_hits);
+	buf += ksprintf(buf, "fault_around_misses:  %llu\n", stats.fault_around_misses);
+	buf += ksprintf(buf, "fault_around_blocks:  %llu\n", stats.fault_around_blocks);
+	buf += ksprintf(buf, "writeback_writes:     %llu\n", stats.writeback_writes);
+	buf += ksprintf(buf, "writeback_pages:      %llu\n", stats.writeback_pages);
+	buf += ksprintf(buf, "forks:                %llu\n", stats.forks);
+	buf += ksprintf(buf, "exec_forks:           %llu\n", stats.exec_forks);
+	buf += ksprintf(buf, "fork_data_us:         %llu\n", stats.fork_data_us);
+	buf += ksprintf(buf, "fork_map_us:          %llu\n", stats.fork_map_us);
+	buf += ksprintf(buf, "fork_protect_us:      %llu\n", stats.fork_protect_us);
+	buf += ksprintf(buf, "fork_copy_us:         %llu\n", stats.fork_copy_us);
+	buf += ksprintf(buf, "dontneed_blocks:      %llu\n", stats.dontneed_blocks);
+	buf += ksprintf(buf, "dontneed_pages:       %llu\n", stats.dontneed_pages);
+	buf += ksprintf(buf, "reset_pages:          %llu\n", stats.reset_pages);
+	buf += ksprintf(buf, "hugepage_allocs:      %llu\n", stats.hugepage_allocs);
+	buf += ksprintf(buf, "hugepage_fallbacks:   %llu\n", stats.hugepage_fallbacks);
+	buf += ksprintf(buf, "hugepage_splits:      %llu\n", stats.hugepage_splits);
+	buf += ksprintf(buf, "brk_grows:            %llu\n", stats.brk_grows);
+	buf += ksprintf(buf, "brk_trims:            %llu\n", stats.brk_trims);
+	buf += ksprintf(buf, "protect_ranges:       %llu\n", stats.protect_ranges);
+	buf += ksprintf(buf, "protect_calls:        %llu\n", stats.protect_calls);
+	buf += ksprintf(buf, "mprotect_calls:       %llu\n", stats.mprotect_calls);
+	buf += ksprintf(buf, "mprotect_protect_calls: %llu\n", stats.mprotect_protect_calls);
+	buf += ksprintf(buf, "munmap_calls:         %llu\n", stats.munmap_calls);
+	buf += ksprintf(buf, "munmap_protect_calls: %llu\n", stats.munmap_protect_calls);
+	buf += ksprintf(buf, "fork_protect_calls:   %llu\n", stats.fork_protect_calls);
+	buf += ksprintf(buf, "mremap_protect_calls: %llu\n", stats.mremap_protect_calls);
+	return buf - original_buf;
+}
+
+unsigned int mm_get_hugepage_mode()
+{
+	return mm->hugepage_mode;
+}
+
+void mm_set_hugepage_mode(unsigned int mode)
+{
+	if (mode > MM_HUGEPAGE_ALWAYS)
+		return;
+	AcquireSRWLockExclusive(&mm->rw_lock);
+	mm->hugepage_mode = mode;
+	ReleaseSRWLockExclusive(&mm->rw_lock);
+}
+
+uint64_t mm_get_fault_count()
+{
+	AcquireSRWLockShared(&mm->rw_lock);
+	uint64_t count = mm->stats.on_demand_faults + mm->stats.cow_faults;
+	ReleaseSRWLockShared(&mm->rw_lock);
+	return count;
+}
+
 DEFINE_SYSCALL(mlock, const void *, addr, size_t, len)
 {
 	log_info("mlock(0x%p, 0x%p)\n", addr, len);
@@ -1472,17 +3353,289 @@ DEFINE_SYSCALL(munlock, const void *, addr, size_t, len)
 DEFINE_SYSCALL(mremap, void *, old_address, size_t, old_size, size_t, new_size, int, flags, void *, new_address)
 {
 	log_info("mremap(old_address=%p, old_size=%p, new_size=%p, flags=%x, new_address=%p)\n", old_address, old_size, new_size, flags, new_address);
-	log_error("mremap() not implemented.\n");
-	return -ENOSYS;
+	AcquireSRWLockExclusive(&mm->rw_lock);
+	void *r = mremap_internal(old_address, old_size, new_size, flags, new_address);
+	ReleaseSRWLockExclusive(&mm->rw_lock);
+	return (intptr_t)r;
+}
+
+/* Whether pages [start_page, end_page] are entirely covered by map entries */
+static bool pages_mapped(size_t start_page, size_t end_page)
+{
+	size_t page = start_page;
+	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (e->end_page < page)
+			continue;
+		if (e->start_page > page)
+			return false;
+		if (e->end_page >= end_page)
+			return true;
+		page = e->end_page + 1;
+	}
+	return false;
+}
+
+/* MADV_DONTNEED: Drop content of private pages [start_page, end_page], the next access sees zeroes or file content
+ * A populated block is released entirely if no page of it outside the range belongs to a map entry, it is
+ * populated again on demand. Pages in other blocks are refilled in place. MAP_SHARED pages are left untouched
+ * as they always reflect the content of the underlying object.
+ */
+static int madvise_dontneed(size_t start_page, size_t end_page)
+{
+	/* Large page backed entries are released if entirely covered, otherwise moved to ordinary blocks */
+	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (e->start_page > end_page)
+			break;
+		if (e->end_page < start_page || !(e->flags & INTERNAL_MAP_HUGEPAGE))
+			continue;
+		if (e->start_page >= start_page && e->end_page <= end_page)
+		{
+			if (e->prot & PROT_EXEC)
+				dbt_code_changed((size_t)GET_PAGE_ADDRESS(e->start_page), (e->end_page - e->start_page + 1) * PAGE_SIZE);
+			release_hugepage_entry(e);
+		}
+		else if (!split_hugepage_entry(e))
+			return -ENOMEM;
+	}
+	for (size_t i = GET_BLOCK_OF_PAGE(start_page); i <= GET_BLOCK_OF_PAGE(end_page); i++)
+	{
+		if (!get_section_handle(i))
+			continue;
+		size_t block_start = GET_FIRST_PAGE_OF_BLOCK(i);
+		size_t block_end = GET_LAST_PAGE_OF_BLOCK(i);
+		size_t range_start = max(start_page, block_start);
+		size_t range_end = min(end_page, block_end);
+		bool release = true, shared = false, exec = false;
+		for (struct rb_node *cur = start_node(block_start); cur; cur = rb_next(cur))
+		{
+			struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+			if (e->start_page > block_end)
+				break;
+			if (e->end_page < block_start)
+				continue;
+			if (e->flags & INTERNAL_MAP_SHARED)
+				shared = true;
+			if (e->prot & PROT_EXEC)
+				exec = true;
+			if (max(e->start_page, block_start) < range_start || min(e->end_page, block_end) > range_end)
+				release = false;
+		}
+		/* MAP_SHARED regions occupy entire blocks */
+		if (shared)
+			continue;
+		if (exec)
+			dbt_code_changed((size_t)GET_PAGE_ADDRESS(range_start), (range_end - range_start + 1) * PAGE_SIZE);
+		if (release)
+		{
+			HANDLE handle = get_section_handle(i);
+			NtUnmapViewOfSection(NtCurrentProcess(), GET_BLOCK_ADDRESS(i));
+			NtClose(handle);
+			remove_section_handle(i);
+			mm->stats.dontneed_blocks++;
+			continue;
+		}
+		if (!take_block_ownership(i) || !protect_block_entries(i))
+		{
+			log_error("Taking ownership of block %p failed.\n", i);
+			return -ENOMEM;
+		}
+		for (struct rb_node *cur = start_node(range_start); cur; cur = rb_next(cur))
+		{
+			struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+			if (e->start_page > range_end)
+				break;
+			size_t first_page = max(range_start, e->start_page);
+			size_t last_page = min(range_end, e->end_page);
+			if (first_page > last_page)
+				continue;
+			DWORD oldProtect;
+			int prot = get_populate_prot(e);
+			if ((prot & PROT_WRITE) == 0)
+				VirtualProtect(GET_PAGE_ADDRESS(first_page), (last_page - first_page + 1) * PAGE_SIZE, prot_linux2win(prot | PROT_WRITE), &oldProtect);
+			map_entry_range(e, first_page, last_page);
+			if ((prot & PROT_WRITE) == 0)
+				VirtualProtect(GET_PAGE_ADDRESS(first_page), (last_page - first_page + 1) * PAGE_SIZE, prot_linux2win(prot), &oldProtect);
+			mm->stats.dontneed_pages += last_page - first_page + 1;
+		}
+	}
+	return 0;
+}
+
+/* MADV_FREE: Let the system discard private anonymous pages [start_page, end_page] when it needs memory
+ * Until then the pages keep their content. Blocks shared with forked processes are skipped since
+ * their content is still in use there.
+ */
+static int madvise_free(size_t start_page, size_t end_page)
+{
+	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (e->start_page > end_page)
+			break;
+		if (e->end_page >= start_page && (e->f || (e->flags & INTERNAL_MAP_SHARED)))
+			return -EINVAL;
+	}
+	for (size_t i = GET_BLOCK_OF_PAGE(start_page); i <= GET_BLOCK_OF_PAGE(end_page); i++)
+	{
+		if (!get_section_handle(i) || !is_block_exclusive(i))
+			continue;
+		reset_pages(max(start_page, GET_FIRST_PAGE_OF_BLOCK(i)), min(end_page, GET_LAST_PAGE_OF_BLOCK(i)));
+	}
+	return 0;
+}
+
+/* MADV_HUGEPAGE: Back the large page aligned parts of private anonymous mappings in the range by large pages
+ * Only parts without populated blocks are handled, as copying their content would cost more than it saves.
+ */
+static void madvise_hugepage(size_t start_page, size_t end_page)
+{
+	if (mm->hugepage_mode == MM_HUGEPAGE_NEVER || !get_hugepage_size())
+		return;
+	size_t hugepage_pages = mm->hugepage_size / PAGE_SIZE;
+	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (e->start_page > end_page)
+			break;
+		if (e->end_page < start_page || e->f || (e->flags & (INTERNAL_MAP_SHARED | INTERNAL_MAP_COPYONFORK)))
+			continue;
+		size_t first_page = ALIGN_TO(max(start_page, e->start_page), hugepage_pages);
+		size_t last_page = (min(end_page, e->end_page) + 1) / hugepage_pages * hugepage_pages;
+		if (last_page <= first_page)
+			continue;
+		last_page--;
+		size_t i;
+		for (i = GET_BLOCK_OF_PAGE(first_page); i <= GET_BLOCK_OF_PAGE(last_page); i++)
+			if (get_section_handle(i))
+				break;
+		if (i <= GET_BLOCK_OF_PAGE(last_page))
+			continue;
+		if (first_page > e->start_page)
+		{
+			split_map_entry(e, first_page - 1);
+			cur = rb_next(cur);
+			e = rb_entry(cur, struct map_entry, tree);
+		}
+		if (last_page < e->end_page)
+			split_map_entry(e, last_page);
+		make_hugepage_entry(e);
+	}
 }
 
 DEFINE_SYSCALL(madvise, void *, addr, size_t, length, int, advise)
 {
 	log_info("madvise(%p, %p, %x)\n", addr, length, advise);
-	/* Notes behaviour-changing advices, other non-critical advises are ignored for now */
-	if (advise & MADV_DONTFORK)
+	if (!IS_ALIGNED(addr, PAGE_SIZE))
+		return -EINVAL;
+	if (length == 0)
+		return 0;
+	length = ALIGN_TO_PAGE(length);
+	if ((size_t)addr < ADDRESS_SPACE_LOW || (size_t)addr >= ADDRESS_SPACE_HIGH
+		|| (size_t)addr + length < ADDRESS_SPACE_LOW || (size_t)addr + length >= ADDRESS_SPACE_HIGH
+		|| (size_t)addr + length < (size_t)addr)
+	{
+		return -EINVAL;
+	}
+	size_t start_page = GET_PAGE(addr);
+	size_t end_page = GET_PAGE((size_t)addr + length - 1);
+	int r = 0;
+	switch (advise)
+	{
+	case MADV_DONTNEED:
+	case MADV_FREE:
+		AcquireSRWLockExclusive(&mm->rw_lock);
+		if (!pages_mapped(start_page, end_page))
+			r = -ENOMEM;
+		else if (advise == MADV_DONTNEED)
+			r = madvise_dontneed(start_page, end_page);
+		else
+			r = madvise_free(start_page, end_page);
+		ReleaseSRWLockExclusive(&mm->rw_lock);
+		break;
+
+	case MADV_HUGEPAGE:
+		AcquireSRWLockExclusive(&mm->rw_lock);
+		if (!pages_mapped(start_page, end_page))
+			r = -ENOMEM;
+		else
+			madvise_hugepage(start_page, end_page);
+		ReleaseSRWLockExclusive(&mm->rw_lock);
+		break;
+
+	case MADV_DONTFORK:
+		/* Notes behaviour-changing advices, other non-critical advises are ignored for now */
 		log_error("MADV_DONTFORK not supported.\n");
-	return 0;
+		break;
+	}
+	return r;
+}
+
+/* Extend the brk() heap up to the page aligned break brk
+ * The heap map entry is extended in place if possible, its pages are populated on demand as usual.
+ */
+static bool grow_brk(size_t brk)
+{
+	size_t old_brk = (size_t)mm->brk;
+	size_t mapped = mm->brk_mapped;
+	struct map_entry *e = mapped > mm->brk_start ? find_map_entry((void *)(mapped - 1)) : NULL;
+	if (e && !(e->flags & INTERNAL_MAP_BRK))
+		e = NULL;
+	/* Pages kept after an earlier shrink must read as zero again */
+	if (e && mapped > old_brk)
+	{
+		size_t end_page = GET_PAGE(min(brk, mapped)) - 1;
+		if (e->prot & PROT_EXEC)
+			dbt_code_changed(old_brk, (end_page - GET_PAGE(old_brk) + 1) * PAGE_SIZE);
+		if (!fill_populated_pages(e, GET_PAGE(old_brk), end_page))
+			return false;
+	}
+	if (brk <= mapped)
+		return true;
+	size_t start_page = GET_PAGE(mapped);
+	size_t end_page = GET_PAGE(brk) - 1;
+	if (e && e->end_page == start_page - 1 && pages_free(e, start_page, end_page))
+	{
+		e->end_page = end_page;
+		update_next_gap(e);
+		if (!fill_populated_pages(e, start_page, end_page))
+		{
+			e->end_page = start_page - 1;
+			update_next_gap(e);
+			return false;
+		}
+		mm->stats.brk_grows++;
+	}
+	else
+	{
+		void *r = mmap_internal((void *)mapped, brk - mapped, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE, INTERNAL_MAP_NOOVERWRITE | INTERNAL_MAP_BRK, NULL, 0);
+		if ((intptr_t)r < 0)
+			return false;
+	}
+	mm->brk_mapped = brk;
+	return true;
+}
+
+/* Shrink the brk() heap to the page aligned break brk
+ * Unused pages are only unmapped once there are more than MM_BRK_TRIM_THRESHOLD bytes of them.
+ */
+static void shrink_brk(size_t brk)
+{
+	if (mm->brk_mapped - brk <= MM_BRK_TRIM_THRESHOLD)
+		return;
+	/* Keep the block containing the break, only whole blocks can be released */
+	size_t trim = ALIGN_TO_BLOCK(brk);
+	if (munmap_internal((void *)trim, mm->brk_mapped - trim) < 0)
+	{
+		log_error("Shrink brk failed.\n");
+		return;
+	}
+	mm->brk_mapped = trim;
+	mm->stats.brk_trims++;
 }
 
 DEFINE_SYSCALL(brk, void *, addr)
@@ -1490,27 +3643,22 @@ DEFINE_SYSCALL(brk, void *, addr)
 	log_info("brk(%p)\n", addr);
 	log_info("Last brk: %p\n", mm->brk);
 	AcquireSRWLockExclusive(&mm->rw_lock);
-	size_t brk = ALIGN_TO_PAGE(mm->brk);
-	addr = (void*)ALIGN_TO_PAGE(addr);
-	if (addr > 0 && addr < mm->brk)
+	size_t brk = ALIGN_TO_PAGE(addr);
+	if (brk < mm->brk_start)
+		goto out;
+	if (brk < (size_t)mm->brk)
 	{
-		if (munmap_internal(addr, (size_t)brk - (size_t)addr) < 0)
-		{
-			log_error("Shrink brk failed.\n");
-			goto out;
-		}
-		mm->brk = addr;
+		shrink_brk(brk);
+		mm->brk = (void *)brk;
 	}
-	else if (addr > mm->brk)
+	else if (brk > (size_t)mm->brk)
 	{
-		int r = (int)mmap_internal((void *)brk, (size_t)addr - (size_t)brk, PROT_READ | PROT_WRITE | PROT_EXEC,
-			MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE, INTERNAL_MAP_NOOVERWRITE, NULL, 0);
-		if (r < 0)
+		if (!grow_brk(brk))
 		{
 			log_error("Enlarge brk failed.\n");
 			goto out;
 		}
-		mm->brk = addr;
+		mm->brk = (void *)brk;
 	}
 out:
 	ReleaseSRWLockExclusive(&mm->rw_lock);
@@ -22,6 +22,8 @@
 #include <common/types.h>
 #include <common/mman.h>
 
+#include <stdbool.h>
+
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 
@@ -48,6 +50,15 @@
 
 #endif
 
+/* Address space kept free after the initial program break, so the brk() heap can grow in place */
+#ifdef _WIN64
+#define MM_BRK_ARENA_SIZE		0x0000000100000000ULL
+#else
+#define MM_BRK_ARENA_SIZE		0x10000000U
+#endif
+/* Unused heap pages after the program break kept mapped on shrinking brk(), as it often grows again */
+#define MM_BRK_TRIM_THRESHOLD	(16 * BLOCK_SIZE)
+
 /* Internal flags for mm_mmap() */
 #define INTERNAL_MAP_TOPDOWN		1	/* Allocate at highest possible address */
 #define INTERNAL_MAP_NOOVERWRITE	2	/* Don't automatically overwrite existing mappings, report error in such case */
@@ -55,6 +66,8 @@
 #define INTERNAL_MAP_COPYONFORK		8	/* Make a real copy on forking instead of copying on write
 										 * This will cause the memory region to be allocated via VirtualAlloc() */
 #define INTERNAL_MAP_SHARED			16	/* A MAP_SHARED memory region */
+#define INTERNAL_MAP_HUGEPAGE		32	/* Backed by large pages, only set by mm itself on INTERNAL_MAP_COPYONFORK regions */
+#define INTERNAL_MAP_BRK			64	/* The brk() heap, the brk arena after it is not used for other mappings */
 
 void mm_init();
 void mm_reset();
@@ -72,6 +85,8 @@ int mm_check_write(void *addr, size_t size);
 
 int mm_handle_page_fault(void *addr);
 int mm_fork(HANDLE process);
+/* Only duplicate kernel memory, for a child which calls execve() right away */
+int mm_fork_kernel(HANDLE process);
 void mm_afterfork_parent();
 void mm_afterfork_child();
 
@@ -83,6 +98,36 @@ int mm_munmap(void *addr, size_t len);
 /* Populate a memory region containing given address */
 void mm_populate(void *addr);
 
+/* Fault-around: on sequential on demand faults in a mapping, up to this many blocks
+ * after the faulting block are populated at once. Tunable in /proc/flinux/mm/fault_around.
+ */
+#define MM_FAULT_AROUND_DEFAULT		16
+unsigned int mm_get_fault_around();
+void mm_set_fault_around(unsigned int blocks);
+
+/* Large page backing of anonymous private mappings, tunable in /proc/flinux/mm/hugepage
+ * Large pages need the "Lock pages in memory" privilege, without it ordinary blocks are always used.
+ * Large page backed memory is committed up front and copied on fork.
+ */
+#define MM_HUGEPAGE_NEVER		0	/* Never use large pages */
+#define MM_HUGEPAGE_MADVISE		1	/* Only for madvise(MADV_HUGEPAGE) and MAP_HUGETLB regions */
+#define MM_HUGEPAGE_ALWAYS		2	/* Also for all large page aligned anonymous mappings */
+#define MM_HUGEPAGE_DEFAULT		MM_HUGEPAGE_MADVISE
+unsigned int mm_get_hugepage_mode();
+void mm_set_hugepage_mode(unsigned int mode);
+
+/* Write back all dirty MAP_SHARED file pages, called on process exit */
+void mm_writeback_shared();
+
+/* Fault statistics for /proc/flinux/mm/stats */
+int mm_get_stats(char *buf);
+/* Number of page faults handled, reported as minor faults in getrusage() */
+uint64_t mm_get_fault_count();
+/* Memory accounting of user mappings for /proc/[pid]/maps, smaps, stat and status */
+int mm_get_maps(char *buf, int size, bool smaps);
+int mm_get_status(char *buf);
+void mm_get_usage(size_t *vm_pages, size_t *rss_pages);
+
 /* Static allocation
  * Many subsystems need to use static storage which are automatically forked
  * Since mm only accepts allocation granularity at PAGE_SIZE, there could be much space lost
@@ -100,5 +145,5 @@ void *mm_static_alloc(size_t size);
  * Currently the users of this API should make sure to work with zero initialization
  * Because they do not have any chance of manually initialize their shared data area
  */
-#define MM_GLOBAL_SHARED_ALLOC_SIZE		3 * BLOCK_SIZE
+#define MM_GLOBAL_SHARED_ALLOC_SIZE		4 * BLOCK_SIZE
 void *mm_global_shared_alloc(size_t size);
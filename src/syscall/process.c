@@ -23,7 +23,10 @@
 #include <common/resource.h>
 #include <common/sysinfo.h>
 #include <common/wait.h>
+#include <dbt/x86.h>
+#include <fs/shm.h>
 #include <fs/virtual.h>
+#include <syscall/fork.h>
 #include <syscall/mm.h>
 #include <syscall/process.h>
 #include <syscall/process_info.h>
@@ -31,6 +34,7 @@
 #include <syscall/vfs.h>
 #include <syscall/syscall.h>
 #include <datetime.h>
+#include <heap.h>
 #include <log.h>
 #include <ntdll.h>
 #include <str.h>
@@ -38,6 +42,7 @@
 #include <stdbool.h>
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <Psapi.h>
 
 struct process_shared_data
 {
@@ -46,6 +51,10 @@ struct process_shared_data
 };
 
 static volatile struct process_shared_data *process_shared;
+/* Processes always run as root, set*id() calls are accepted and ignored */
+#define PROCESS_UID		0
+#define PROCESS_GID		0
+
 static struct process_data _process;
 
 struct process_data *const process = &_process;
@@ -58,6 +67,9 @@ static void process_init_private()
 	InitializeSRWLock(&process->rw_lock);
 	/* Initialize thread list */
 	process->child_count = 0;
+	process->children_utime = 0;
+	process->children_stime = 0;
+	process->children_maxrss = 0;
 	slist_init(&process->child_list);
 	slist_init(&process->child_freelist);
 	for (int i = 0; i < MAX_CHILD_COUNT; i++)
@@ -193,6 +205,9 @@ void process_afterfork_child(void *stack_base, pid_t pid)
 
 int process_fork(HANDLE hProcess)
 {
+	/* The child keeps the executable name until it calls execve() */
+	if (!WriteProcessMemory(hProcess, process->comm, process->comm, sizeof(process->comm), NULL))
+		return 0;
 	return 1;
 }
 
@@ -253,6 +268,31 @@ pid_t process_init_child(DWORD win_pid, DWORD win_tid, HANDLE process_handle)
 	return pid;
 }
 
+void process_set_child_ids(pid_t pid, pid_t pgid, pid_t sid)
+{
+	process_lock_shared();
+	if (pgid)
+		process_shared->processes[pid].pgid = pgid;
+	if (sid)
+		process_shared->processes[pid].sid = sid;
+	process_unlock_shared();
+}
+
+int process_get_thread_count()
+{
+	return process->thread_count;
+}
+
+void process_set_comm(const char *filename)
+{
+	const char *name = filename;
+	for (const char *p = filename; *p; p++)
+		if (*p == '/')
+			name = p + 1;
+	strncpy(process->comm, name, sizeof(process->comm) - 1);
+	process->comm[sizeof(process->comm) - 1] = 0;
+}
+
 pid_t process_init_thread(DWORD win_tid)
 {
 	AcquireSRWLockExclusive(&process->rw_lock);
@@ -274,6 +314,46 @@ pid_t process_init_thread(DWORD win_tid)
 	return pid;
 }
 
+/* Convert a time span in 100ns units to struct linux_timeval */
+static void ticks_to_timeval(uint64_t ticks, struct linux_timeval *tv)
+{
+	tv->tv_sec = (long)(ticks / 10000000ULL);
+	tv->tv_usec = (long)(ticks % 10000000ULL / 10ULL);
+}
+
+static uint64_t filetime_span_to_ticks(const FILETIME *filetime)
+{
+	return ((uint64_t)filetime->dwHighDateTime << 32ULL) + filetime->dwLowDateTime;
+}
+
+/* Add the resource usage of a terminated child to the children usage, and report it in rusage if not NULL
+ * Windows does not count the descendants of a child in its times.
+ */
+static void collect_child_usage(HANDLE hProcess, struct rusage *rusage)
+{
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	uint64_t utime = 0, stime = 0;
+	if (GetProcessTimes(hProcess, &creation_time, &exit_time, &kernel_time, &user_time))
+	{
+		utime = filetime_span_to_ticks(&user_time);
+		stime = filetime_span_to_ticks(&kernel_time);
+	}
+	size_t maxrss = 0;
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(hProcess, &counters, sizeof(counters)))
+		maxrss = counters.PeakWorkingSetSize / 1024;
+	process->children_utime += utime;
+	process->children_stime += stime;
+	process->children_maxrss = max(process->children_maxrss, maxrss);
+	if (rusage)
+	{
+		ZeroMemory(rusage, sizeof(struct rusage));
+		ticks_to_timeval(utime, &rusage->ru_utime);
+		ticks_to_timeval(stime, &rusage->ru_stime);
+		rusage->ru_maxrss = maxrss;
+	}
+}
+
 /* Caller ensures process rw lock is acquired (shared) */
 static pid_t process_wait(pid_t pid, int *status, int options, struct rusage *rusage)
 {
@@ -281,8 +361,6 @@ static pid_t process_wait(pid_t pid, int *status, int options, struct rusage *ru
 		log_error("Unhandled option WUNTRACED\n");
 	if (options & WCONTINUED)
 		log_error("Unhandled option WCONTINUED\n");
-	if (rusage)
-		log_error("rusage not supported.\n");
 	struct child_process *proc = NULL;
 	if (pid > 0)
 	{
@@ -391,6 +469,7 @@ static pid_t process_wait(pid_t pid, int *status, int options, struct rusage *ru
 		else
 			*status = W_EXITCODE(exit_code, 0);
 	}
+	collect_child_usage(proc->hProcess, rusage);
 	CloseHandle(proc->hProcess);
 	return pid;
 }
@@ -407,8 +486,8 @@ DEFINE_SYSCALL(waitpid, pid_t, pid, int *, status, int, options)
 DEFINE_SYSCALL(wait4, pid_t, pid, int *, status, int, options, struct rusage *, rusage)
 {
 	log_info("sys_wait4(%d, %p, %d, %p)\n", pid, status, options, rusage);
-	if (rusage)
-		log_error("rusage != NULL\n");
+	if (rusage && !mm_check_write(rusage, sizeof(struct rusage)))
+		return -EFAULT;
 	AcquireSRWLockShared(&process->rw_lock);
 	intptr_t r = process_wait(pid, status, options, rusage);
 	ReleaseSRWLockShared(&process->rw_lock);
@@ -418,6 +497,8 @@ DEFINE_SYSCALL(wait4, pid_t, pid, int *, status, int, options, struct rusage *,
 __declspec(noreturn) void process_exit(int exit_code, int exit_signal)
 {
 	/* TODO: Gracefully shutdown subsystems, but take care of race conditions */
+	mm_writeback_shared();
+	shm_shutdown();
 	process_lock_shared();
 	pid_t pid = process->pid;
 	process_shared->processes[pid].exit_code = exit_code;
@@ -460,6 +541,9 @@ DEFINE_SYSCALL(getppid)
 DEFINE_SYSCALL(setpgid, pid_t, pid, pid_t, pgid)
 {
 	log_info("setpgid(%d, %d)\n", pid, pgid);
+	/* A vfork() child sets the process group of the process it is going to create */
+	if (vfork_is_child() && (pid == 0 || pid == process->pid))
+		vfork_setpgid(pgid == process->pid ? 0 : pgid);
 	return 0;
 }
 
@@ -550,13 +634,12 @@ int procfs_pid_iter(int tag, int iter_index, int *type, char *name, int namelen)
 int process_get_stat(char *buf)
 {
 	char *original = buf;
-	char *comm = "hello";
 	char state = 'R';
 	int tty_nr = 0; /* TODO */
 	int tpgid = 0; /* TODO */
 	uint32_t flags = 0; /* TODO */
 	buf += ksprintf(buf, "%d ", process->pid);
-	buf += ksprintf(buf, "(%s) ", comm);
+	buf += ksprintf(buf, "(%s) ", process->comm);
 	buf += ksprintf(buf, "%c ", state);
 	buf += ksprintf(buf, "%d ", process_get_ppid(process->pid));
 	buf += ksprintf(buf, "%d ", process_get_pgid(process->pid));
@@ -564,7 +647,8 @@ int process_get_stat(char *buf)
 	buf += ksprintf(buf, "%d ", tty_nr);
 	buf += ksprintf(buf, "%d ", tpgid);
 	buf += ksprintf(buf, "%u ", flags);
-	uintptr_t minflt = 0, cminflt = 0, majflt = 0, cmajflt = 0; /* TODO */
+	uintptr_t minflt = (uintptr_t)mm_get_fault_count();
+	uintptr_t cminflt = 0, majflt = 0, cmajflt = 0; /* TODO */
 	buf += ksprintf(buf, "%lu ", minflt);
 	buf += ksprintf(buf, "%lu ", cminflt);
 	buf += ksprintf(buf, "%lu ", majflt);
@@ -585,11 +669,13 @@ int process_get_stat(char *buf)
 	buf += ksprintf(buf, "%ld ", 0);
 	uint64_t starttime = 0; /* TODO */
 	buf += ksprintf(buf, "%llu ", starttime);
+	size_t vm_pages, rss_pages;
+	mm_get_usage(&vm_pages, &rss_pages);
 	/* Virtual Memory Size */
-	uintptr_t vsize = 0;
+	uintptr_t vsize = vm_pages * PAGE_SIZE;
 	buf += ksprintf(buf, "%lu ", vsize);
 	/* Resident Set Size */
-	intptr_t rss = 0;
+	intptr_t rss = rss_pages;
 	buf += ksprintf(buf, "%ld ", rss);
 	/* Current soft limit of RSS: RLIMIT_RSS */
 	uintptr_t rsslim = 0;
@@ -637,6 +723,21 @@ int process_get_stat(char *buf)
 	return buf - original;
 }
 
+int process_get_status(char *buf)
+{
+	char *original = buf;
+	buf += ksprintf(buf, "Name:\t%s\n", process->comm);
+	buf += ksprintf(buf, "State:\tR (running)\n");
+	buf += ksprintf(buf, "Tgid:\t%d\n", process->pid);
+	buf += ksprintf(buf, "Pid:\t%d\n", process->pid);
+	buf += ksprintf(buf, "PPid:\t%d\n", process_get_ppid(process->pid));
+	/* Real, effective, saved set and file system ids */
+	buf += ksprintf(buf, "Uid:\t%u\t%u\t%u\t%u\n", PROCESS_UID, PROCESS_UID, PROCESS_UID, PROCESS_UID);
+	buf += ksprintf(buf, "Gid:\t%u\t%u\t%u\t%u\n", PROCESS_GID, PROCESS_GID, PROCESS_GID, PROCESS_GID);
+	buf += mm_get_status(buf);
+	return buf - original;
+}
+
 int process_query(int query_type, char *buf)
 {
 	switch (query_type)
@@ -644,6 +745,15 @@ int process_query(int query_type, char *buf)
 	case PROCESS_QUERY_STAT:
 		return process_get_stat(buf);
 
+	case PROCESS_QUERY_STATUS:
+		return process_get_status(buf);
+
+	case PROCESS_QUERY_MAPS:
+		return mm_get_maps(buf, VIRTUALFS_TEXT_MAX_SIZE, false);
+
+	case PROCESS_QUERY_SMAPS:
+		return mm_get_maps(buf, VIRTUALFS_TEXT_MAX_SIZE, true);
+
 	default:
 		return 0;
 	}
@@ -674,14 +784,20 @@ int process_query_pid(int pid, int query_type, char *buf)
 DEFINE_SYSCALL(setsid)
 {
 	log_info("setsid().\n");
+	if (vfork_is_child())
+	{
+		/* The new process created for the vfork() child leads the session */
+		vfork_setsid();
+		return process->pid;
+	}
 	log_error("setsid() not implemented.\n");
 	return 0;
 }
 
 DEFINE_SYSCALL(getuid)
 {
-	log_info("getuid(): %d\n", 0);
-	return 0;
+	log_info("getuid(): %d\n", PROCESS_UID);
+	return PROCESS_UID;
 }
 
 DEFINE_SYSCALL(setgid, gid_t, gid)
@@ -692,20 +808,20 @@ DEFINE_SYSCALL(setgid, gid_t, gid)
 
 DEFINE_SYSCALL(getgid)
 {
-	log_info("getgid(): %d\n", 0);
-	return 0;
+	log_info("getgid(): %d\n", PROCESS_GID);
+	return PROCESS_GID;
 }
 
 DEFINE_SYSCALL(geteuid)
 {
-	log_info("geteuid(): %d\n", 0);
-	return 0;
+	log_info("geteuid(): %d\n", PROCESS_UID);
+	return PROCESS_UID;
 }
 
 DEFINE_SYSCALL(getegid)
 {
-	log_info("getegid(): %d\n", 0);
-	return 0;
+	log_info("getegid(): %d\n", PROCESS_GID);
+	return PROCESS_GID;
 }
 
 DEFINE_SYSCALL(setuid, uid_t, uid)
@@ -724,9 +840,9 @@ DEFINE_SYSCALL(getresuid, uid_t *, ruid, uid_t *, euid, uid_t *, suid)
 	log_info("getresuid(%d, %d, %d)\n", ruid, euid, suid);
 	if (!mm_check_write(ruid, sizeof(*ruid)) || !mm_check_write(euid, sizeof(*euid)) || !mm_check_write(suid, sizeof(*suid)))
 		return -EFAULT;
-	*ruid = 0;
-	*euid = 0;
-	*suid = 0;
+	*ruid = PROCESS_UID;
+	*euid = PROCESS_UID;
+	*suid = PROCESS_UID;
 	return 0;
 }
 
@@ -740,9 +856,9 @@ DEFINE_SYSCALL(getresgid, uid_t *, rgid, gid_t *, egid, gid_t *, sgid)
 	log_info("getresgid(%d, %d, %d)\n", rgid, egid, sgid);
 	if (!mm_check_write(rgid, sizeof(*rgid)) || !mm_check_write(egid, sizeof(*egid)) || !mm_check_write(sgid, sizeof(*sgid)))
 		return -EFAULT;
-	*rgid = 0;
-	*egid = 0;
-	*sgid = 0;
+	*rgid = PROCESS_GID;
+	*egid = PROCESS_GID;
+	*sgid = PROCESS_GID;
 	return 0;
 }
 DEFINE_SYSCALL(getgroups, int, size, gid_t *, list)
@@ -754,6 +870,8 @@ DEFINE_SYSCALL(getgroups, int, size, gid_t *, list)
 DEFINE_SYSCALL(exit, int, status)
 {
 	log_info("exit(%d)\n", status);
+	if (vfork_is_child())
+		vfork_exit(status);
 	log_shutdown();
 	process_lock_shared();
 	process_shared->processes[current_thread->pid].status = PROCESS_NOTEXIST;
@@ -763,12 +881,18 @@ DEFINE_SYSCALL(exit, int, status)
 	if (InterlockedDecrement(&process->thread_count) == 0)
 		process_exit(status, 0);
 	else
+	{
+		dbt_exit_thread();
+		heap_thread_exit();
 		ExitThread(status);
+	}
 }
 
 DEFINE_SYSCALL(exit_group, int, status)
 {
 	log_info("exit_group(%d)\n", status);
+	if (vfork_is_child())
+		vfork_exit(status);
 	log_shutdown();
 	process_exit(status, 0);
 }
@@ -888,6 +1012,7 @@ DEFINE_SYSCALL(setrlimit, int, resource, const struct rlimit *, rlim)
 	}
 }
 
+
 DEFINE_SYSCALL(getrusage, int, who, struct rusage *, usage)
 {
 	log_info("getrusage(%d, %p)\n", who, usage);
@@ -896,6 +1021,32 @@ DEFINE_SYSCALL(getrusage, int, who, struct rusage *, usage)
 	ZeroMemory(usage, sizeof(struct rusage));
 	switch (who)
 	{
+	case RUSAGE_SELF:
+	case RUSAGE_THREAD:
+	{
+		FILETIME creation_time, exit_time, kernel_time, user_time;
+		if (who == RUSAGE_SELF)
+			GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time);
+		else
+			GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time);
+		ticks_to_timeval(filetime_span_to_ticks(&user_time), &usage->ru_utime);
+		ticks_to_timeval(filetime_span_to_ticks(&kernel_time), &usage->ru_stime);
+		/* Memory is process wide, like on Linux this is the peak resident set size */
+		PROCESS_MEMORY_COUNTERS counters;
+		if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+			usage->ru_maxrss = counters.PeakWorkingSetSize / 1024;
+		usage->ru_minflt = mm_get_fault_count();
+		return 0;
+	}
+
+	case RUSAGE_CHILDREN:
+		AcquireSRWLockShared(&process->rw_lock);
+		ticks_to_timeval(process->children_utime, &usage->ru_utime);
+		ticks_to_timeval(process->children_stime, &usage->ru_stime);
+		usage->ru_maxrss = process->children_maxrss;
+		ReleaseSRWLockShared(&process->rw_lock);
+		return 0;
+
 	default:
 		log_error("Unhandled who: %d.\n", who);
 		return -EINVAL;
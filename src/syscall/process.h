@@ -38,6 +38,11 @@ void *process_get_stack_base();
 pid_t process_init_child(DWORD win_pid, DWORD win_tid, HANDLE process_handle);
 void process_thread_entry(pid_t tid);
 pid_t process_init_thread(DWORD win_tid);
+/* Set process group and session of a child process, 0 keeps the current one */
+void process_set_child_ids(pid_t pid, pid_t pgid, pid_t sid);
+int process_get_thread_count();
+/* Set the executable name from the file passed to execve() */
+void process_set_comm(const char *filename);
 
 __declspec(noreturn) void process_exit(int exit_code, int exit_signal);
 bool process_pid_exist(pid_t pid);
@@ -50,6 +55,9 @@ pid_t process_get_sid();
 enum
 {
 	PROCESS_QUERY_STAT,		/* /proc/[pid]/stat */
+	PROCESS_QUERY_STATUS,	/* /proc/[pid]/status */
+	PROCESS_QUERY_MAPS,		/* /proc/[pid]/maps */
+	PROCESS_QUERY_SMAPS,	/* /proc/[pid]/smaps */
 };
 int process_query(int query_type, char *buf);
 int process_query_pid(pid_t pid, int query_type, char *buf);
@@ -70,6 +70,8 @@ struct process_data
 	SRWLOCK rw_lock;
 	/* pid of this process */
 	pid_t pid;
+	/* Executable name (basename of the last execve() file, truncated), as in /proc/[pid]/comm */
+	char comm[16];
 	/* Information of threads of this process */
 	int thread_count;
 	struct list thread_list, thread_freelist;
@@ -78,6 +80,9 @@ struct process_data
 	int child_count;
 	struct slist child_list, child_freelist;
 	struct child_process child[MAX_CHILD_COUNT];
+	/* Resource usage of terminated children which were waited for, times are in 100ns units */
+	uint64_t children_utime, children_stime;
+	size_t children_maxrss;
 	/* Mutex for process_shared_data */
 	/* You have to lock this mutex on the following scenarios:
 	* 1. When writing to shared area
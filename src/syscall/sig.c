@@ -21,6 +21,7 @@
 #include <common/sigcontext.h>
 #include <common/sigframe.h>
 #include <common/signal.h>
+#include <dbt/cpuid.h>
 #include <syscall/mm.h>
 #include <syscall/process.h>
 #include <syscall/process_info.h>
@@ -66,6 +67,10 @@ struct signal_packet
 
 static struct signal_data *signal;
 
+/* Signal state of a vfork() parent, put back when the child calls execve() or exits */
+static struct sigaction vfork_actions[_NSIG];
+static sigset_t vfork_sigmask;
+
 /* Create a uni-direction, message based pipe */
 static volatile long process_pipe_count = 0;
 static bool create_pipe(HANDLE *read, HANDLE *write, bool is_duplex)
@@ -269,7 +274,91 @@ static DWORD WINAPI signal_thread(LPVOID parameter)
 
 void fpu_fxsave(void *save_area);
 void fpu_fxrstor(void *save_area);
+void fpu_xsave(void *save_area, uint32_t mask);
+void fpu_xrstor(void *save_area, uint32_t mask);
 void signal_restorer();
+
+/* Save FPU/SIMD state in the same layout as the Linux kernel does:
+ * A legacy fsave header (struct fpstate up to _fxsr_env) followed by the
+ * 64 byte aligned FXSAVE/XSAVE image, terminated by FP_XSTATE_MAGIC2 if XSAVE is used.
+ */
+static void signal_save_fpstate(struct fpstate *fpstate)
+{
+	struct i387_fxsave_struct *fx = (struct i387_fxsave_struct *)&fpstate->_fxsr_env;
+	if (dbt_xsave_mask)
+	{
+		/* XSAVE only writes the xstate_bv field of the header, the rest must be zero */
+		memset((uint8_t *)fx + sizeof(struct i387_fxsave_struct), 0, sizeof(struct xsave_hdr));
+		fpu_xsave(fx, dbt_xsave_mask);
+		fpstate->sw_reserved.magic1 = FP_XSTATE_MAGIC1;
+		fpstate->sw_reserved.extended_size = offsetof(struct fpstate, _fxsr_env) + dbt_xsave_size + FP_XSTATE_MAGIC2_SIZE;
+		fpstate->sw_reserved.xstate_bv = dbt_xsave_mask;
+		fpstate->sw_reserved.xstate_size = dbt_xsave_size;
+		memset(fpstate->sw_reserved.padding, 0, sizeof(fpstate->sw_reserved.padding));
+		*(uint32_t *)((uint8_t *)fx + dbt_xsave_size) = FP_XSTATE_MAGIC2;
+	}
+	else
+	{
+		fpu_fxsave(fx);
+		fpstate->sw_reserved.magic1 = 0;
+	}
+	/* Fill in legacy fsave header */
+	fpstate->cw = fx->cwd | 0xFFFF0000U;
+	fpstate->sw = fx->swd | 0xFFFF0000U;
+	fpstate->tag = 0xFFFF0000U;
+	for (int i = 0; i < 8; i++) /* Abridged tag: 1 = valid (00), 0 = empty (11) */
+		if (!(fx->twd & (1 << i)))
+			fpstate->tag |= 3 << (i * 2);
+	fpstate->ipoff = fx->fip;
+	fpstate->cssel = (fx->fcs & 0xFFFF) | ((uint32_t)fx->fop << 16);
+	fpstate->dataoff = fx->foo;
+	fpstate->datasel = fx->fos;
+	for (int i = 0; i < 8; i++)
+		memcpy(&fpstate->_st[i], &fx->st_space[i * 4], sizeof(struct fpreg));
+	fpstate->status = fx->swd;
+	fpstate->magic = X86_FXSR_MAGIC;
+}
+
+/* Restore FPU/SIMD state saved by signal_save_fpstate()
+ * The state comes from user memory and may have been modified by the signal handler.
+ * XRSTOR and FXRSTOR fault on malformed images, so they are validated first.
+ * If the extended state descriptor does not match what we saved, only the legacy
+ * FXSAVE part is restored, like the Linux kernel does.
+ * Returns false if the state can not be restored.
+ */
+static bool signal_restore_fpstate(struct fpstate *fpstate, bool xstate)
+{
+	struct i387_fxsave_struct *fx = (struct i387_fxsave_struct *)&fpstate->_fxsr_env;
+	size_t fx_offset = offsetof(struct fpstate, _fxsr_env);
+	if (((uintptr_t)fx & 15) || !mm_check_read(fpstate, fx_offset + sizeof(struct i387_fxsave_struct)))
+		return false;
+	if (fx->mxcsr & ~dbt_mxcsr_mask)
+		return false;
+	if (xstate && dbt_xsave_mask
+		&& ((uintptr_t)fx & 63) == 0
+		&& fpstate->sw_reserved.magic1 == FP_XSTATE_MAGIC1
+		&& fpstate->sw_reserved.xstate_size == dbt_xsave_size
+		&& fpstate->sw_reserved.extended_size == fx_offset + dbt_xsave_size + FP_XSTATE_MAGIC2_SIZE
+		&& mm_check_read(fx, dbt_xsave_size + FP_XSTATE_MAGIC2_SIZE)
+		&& *(uint32_t *)((uint8_t *)fx + dbt_xsave_size) == FP_XSTATE_MAGIC2)
+	{
+		/* xcomp_bv (reserved1[0]) must be zero for the standard format, the reserved bytes must be zero */
+		struct xsave_hdr *hdr = (struct xsave_hdr *)((uint8_t *)fx + sizeof(struct i387_fxsave_struct));
+		if (hdr->xstate_bv & ~(uint64_t)dbt_xsave_mask)
+			return false;
+		for (int i = 0; i < 2; i++)
+			if (hdr->reserved1[i])
+				return false;
+		for (int i = 0; i < 5; i++)
+			if (hdr->reserved2[i])
+				return false;
+		fpu_xrstor(fx, (uint32_t)fpstate->sw_reserved.xstate_bv & dbt_xsave_mask);
+	}
+	else
+		fpu_fxrstor(fx);
+	return true;
+}
+
 static void signal_save_sigcontext(struct sigcontext *sc, struct syscall_context *context, void *fpstate, uint32_t mask)
 {
 	/* TODO: Add missing register values */
@@ -301,13 +390,13 @@ void signal_setup_handler(struct syscall_context *context)
 {
 	int sig = current_thread->current_siginfo.si_signo;
 	uintptr_t sp = context->esp;
-	/* TODO: Make fpstate layout the same as in Linux kernel */
 	/* Allocate fpstate space */
-	sp -= sizeof(struct fpstate);
-	/* Align fpstate to 512 byte boundary */
-	sp = sp & -512UL;
-	void *fpstate = (void*)sp;
-	fpu_fxsave(fpstate);
+	size_t fx_offset = offsetof(struct fpstate, _fxsr_env);
+	sp -= fx_offset + (dbt_xsave_mask ? dbt_xsave_size + FP_XSTATE_MAGIC2_SIZE : 512);
+	/* Align FXSAVE/XSAVE image to 64 byte boundary */
+	sp = ((sp + fx_offset) & -64UL) - fx_offset;
+	struct fpstate *fpstate = (struct fpstate *)sp;
+	signal_save_fpstate(fpstate);
 
 	/* Allocate sigcontext space */
 	sp -= sizeof(struct rt_sigframe);
@@ -323,7 +412,7 @@ void signal_setup_handler(struct syscall_context *context)
 	frame->pinfo = (uint32_t)&frame->info;
 	frame->puc = (uint32_t)&frame->uc;
 
-	frame->uc.uc_flags = 0;
+	frame->uc.uc_flags = dbt_xsave_mask ? UC_FP_XSTATE : 0;
 	frame->uc.uc_link = 0;
 	/* TODO: frame->uc.uc_stack */
 	EnterCriticalSection(&signal->mutex);
@@ -409,8 +498,13 @@ DEFINE_SYSCALL(rt_sigreturn, uintptr_t, bx, uintptr_t, cx, uintptr_t, dx, uintpt
 		log_error("sigreturn: Invalid frame.\n");
 		return -EFAULT;
 	}
-	/* TODO: Check validity of fpstate */
-	fpu_fxrstor(frame->uc.uc_mcontext.fpstate);
+	struct fpstate *fpstate = (struct fpstate *)frame->uc.uc_mcontext.fpstate;
+	if (fpstate && !signal_restore_fpstate(fpstate, (frame->uc.uc_flags & UC_FP_XSTATE) != 0))
+	{
+		/* Linux kills the task with SIGSEGV on a bad sigreturn frame */
+		log_error("sigreturn: Invalid fpstate.\n");
+		process_exit(0, SIGSEGV);
+	}
 	EnterCriticalSection(&signal->mutex);
 	current_thread->sigmask = frame->uc.uc_sigmask;
 	send_pending_signal();
@@ -470,6 +564,23 @@ void signal_afterfork_parent()
 	LeaveCriticalSection(&signal->mutex);
 }
 
+void signal_vfork_save()
+{
+	EnterCriticalSection(&signal->mutex);
+	memcpy(vfork_actions, signal->actions, sizeof(vfork_actions));
+	vfork_sigmask = current_thread->sigmask;
+	LeaveCriticalSection(&signal->mutex);
+}
+
+void signal_vfork_restore()
+{
+	EnterCriticalSection(&signal->mutex);
+	memcpy(signal->actions, vfork_actions, sizeof(vfork_actions));
+	current_thread->sigmask = vfork_sigmask;
+	send_pending_signal();
+	LeaveCriticalSection(&signal->mutex);
+}
+
 void signal_shutdown()
 {
 	struct signal_packet packet;
@@ -37,6 +37,9 @@ void signal_init();
 int signal_fork(HANDLE process);
 void signal_afterfork_parent();
 void signal_afterfork_child();
+/* Save the signal actions and mask while a vfork() child runs, restore them for the parent */
+void signal_vfork_save();
+void signal_vfork_restore();
 void signal_shutdown();
 void signal_init_thread(struct thread *thread);
 int signal_kill(pid_t pid, siginfo_t *siginfo);
@@ -130,6 +130,22 @@ fpu_fxrstor PROC save_area
 	ret
 fpu_fxrstor ENDP
 
+fpu_xsave PROC save_area, save_mask
+	mov ecx, save_area
+	mov eax, save_mask
+	xor edx, edx
+	xsave [ecx]
+	ret
+fpu_xsave ENDP
+
+fpu_xrstor PROC save_area, save_mask
+	mov ecx, save_area
+	mov eax, save_mask
+	xor edx, edx
+	xrstor [ecx]
+	ret
+fpu_xrstor ENDP
+
 OPTION PROLOGUE: NONE
 OPTION EPILOGUE: NONE
 ; this function will be translated by dbt before run
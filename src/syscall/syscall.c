@@ -76,7 +76,6 @@ static LONG CALLBACK exception_handler(PEXCEPTION_POINTERS ep)
 		}
 		else
 		{
-			log_info("IP: 0x%p\n", ep->ContextRecord->Xip);
 #ifdef _WIN64
 			if (code[0] == 0xCD && code[1] == 0x80) /* INT 80h */
 			{
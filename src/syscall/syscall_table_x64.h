@@ -26,9 +26,9 @@ SYSCALL(mremap)
 SYSCALL(msync)
 SYSCALL(unimplemented)
 SYSCALL(madvise)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(shmget)
+SYSCALL(shmat)
+SYSCALL(shmctl)
 SYSCALL(dup)
 SYSCALL(dup2)
 SYSCALL(unimplemented)
@@ -64,7 +64,7 @@ SYSCALL(uname)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(shmdt)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
@@ -316,7 +316,7 @@ SYSCALL(unimplemented)
 SYSCALL(renameat2)
 SYSCALL(unimplemented)
 SYSCALL(getrandom)
-SYSCALL(unimplemented)
+SYSCALL(memfd_create)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
@@ -114,7 +114,7 @@ SYSCALL(unimplemented)
 SYSCALL(wait4)
 SYSCALL(unimplemented)
 SYSCALL(sysinfo)
-SYSCALL(unimplemented)
+SYSCALL(ipc)
 SYSCALL(fsync)
 SYSCALL(unimplemented)
 SYSCALL(clone)
@@ -353,6 +353,6 @@ SYSCALL(unimplemented)
 SYSCALL(renameat2)
 SYSCALL(unimplemented)
 SYSCALL(getrandom)
-SYSCALL(unimplemented)
+SYSCALL(memfd_create)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
@@ -21,12 +21,14 @@
 #include <common/fadvise.h>
 #include <common/fcntl.h>
 #include <common/ioctls.h>
+#include <common/mman.h>
 #include <fs/console.h>
 #include <fs/devfs.h>
 #include <fs/epollfd.h>
 #include <fs/eventfd.h>
 #include <fs/pipe.h>
 #include <fs/procfs.h>
+#include <fs/shm.h>
 #include <fs/socket.h>
 #include <fs/sysfs.h>
 #include <fs/winfs.h>
@@ -75,6 +77,11 @@ struct vfs_data
 
 static struct vfs_data *vfs;
 
+/* File descriptor table of a vfork() parent, put back when the child calls execve() or exits */
+static struct filed vfork_filed[MAX_FD_COUNT];
+static struct file *vfork_cwd;
+static int vfork_umask;
+
 static void vfs_add(struct file_system *fs)
 {
 	fs->next = vfs->fs_first;
@@ -151,6 +158,8 @@ void vfs_init()
 	vfs_add(devfs_alloc());
 	vfs_add(procfs_alloc());
 	vfs_add(sysfs_alloc());
+	vfs_add(shmfs_alloc());
+	shm_init();
 	/* Initialize CWD */
 	if (vfs_openat(AT_FDCWD, "/", O_DIRECTORY | O_PATH, 0, &vfs->cwd) < 0)
 	{
@@ -172,6 +181,7 @@ void vfs_reset()
 			vfs_close(i);
 	}
 	vfs->umask = S_IWGRP | S_IWOTH;
+	shm_reset();
 }
 
 void vfs_shutdown()
@@ -223,6 +233,7 @@ void vfs_afterfork_child()
 	vfs = mm_static_alloc(sizeof(struct vfs_data));
 	InitializeSRWLock(&vfs->rw_lock);
 	console_afterfork();
+	shm_afterfork_child();
 
 	int index[MAX_FD_COUNT];
 	for (int i = 0; i < MAX_FD_COUNT; i++)
@@ -252,6 +263,36 @@ void vfs_afterfork_parent()
 	ReleaseSRWLockShared(&vfs->rw_lock);
 }
 
+void vfs_vfork_save()
+{
+	AcquireSRWLockShared(&vfs->rw_lock);
+	for (int i = 0; i < MAX_FD_COUNT; i++)
+	{
+		vfork_filed[i] = vfs->filed[i];
+		if (vfork_filed[i].fd)
+			vfs_ref(vfork_filed[i].fd);
+	}
+	vfork_cwd = vfs->cwd;
+	vfs_ref(vfork_cwd);
+	vfork_umask = vfs->umask;
+	ReleaseSRWLockShared(&vfs->rw_lock);
+}
+
+void vfs_vfork_restore()
+{
+	AcquireSRWLockExclusive(&vfs->rw_lock);
+	for (int i = 0; i < MAX_FD_COUNT; i++)
+	{
+		if (vfs->filed[i].fd)
+			vfs_release(vfs->filed[i].fd);
+		vfs->filed[i] = vfork_filed[i];
+	}
+	vfs_release(vfs->cwd);
+	vfs->cwd = vfork_cwd;
+	vfs->umask = vfork_umask;
+	ReleaseSRWLockExclusive(&vfs->rw_lock);
+}
+
 static int store_file_internal(struct file *f, int cloexec)
 {
 	for (int i = 0; i < MAX_FD_COUNT; i++)
@@ -344,6 +385,24 @@ out:
 	return r;
 }
 
+DEFINE_SYSCALL(memfd_create, const char *, name, unsigned int, flags)
+{
+	log_info("memfd_create(\"%s\", %x)\n", name, flags);
+	if (!mm_check_read_string(name))
+		return -EFAULT;
+	/* Sealing is not supported, MFD_ALLOW_SEALING is accepted as no seal is ever applied */
+	if (flags & ~(MFD_CLOEXEC | MFD_ALLOW_SEALING))
+		return -EINVAL;
+	struct file *f;
+	int r = shm_memfd_alloc(name, flags, &f);
+	if (r < 0)
+		return r;
+	r = vfs_store_file(f, (flags & MFD_CLOEXEC) > 0);
+	if (r < 0)
+		vfs_release(f);
+	return r;
+}
+
 static int vfs_dup(int fd, int newfd, int flags)
 {
 	AcquireSRWLockExclusive(&vfs->rw_lock);
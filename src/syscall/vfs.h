@@ -40,6 +40,9 @@ void vfs_shutdown();
 int vfs_fork(HANDLE process);
 void vfs_afterfork_parent();
 void vfs_afterfork_child();
+/* Save the file descriptor table while a vfork() child runs, restore it for the parent */
+void vfs_vfork_save();
+void vfs_vfork_restore();
 int vfs_store_file(struct file *f, int cloexec);
 
 int vfs_openat(int dirfd, const char *pathname, int flags, int mode, struct file **f);